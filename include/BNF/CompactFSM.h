@@ -0,0 +1,111 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BNF_COMPACTFSM_H
+#define BNF_COMPACTFSM_H
+
+#include <llvm/Support/raw_ostream.h>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "Support/Z3.h"
+
+using namespace llvm;
+
+class FSMnode;
+class CompactFSM;
+
+typedef std::shared_ptr<FSMnode> FSMnodeRef;
+typedef std::shared_ptr<const CompactFSM> CompactFSMRef;
+
+/// a frozen FSM, i.e., the states reachable from the entry numbered densely, which is built once after an FSM is
+/// simplified and then only traversed, e.g., by the diff and the dot output
+///
+/// the states are numbered in breadth-first order from the entry, which is state 0, and the edges of a state are
+/// contiguous in the edge arrays, in the order of FSMnode::transition. an edge refers to its guard by a position
+/// in the guard table, which keeps each distinct guard once.
+class CompactFSM {
+public:
+    static constexpr uint32_t Entry = 0;
+
+private:
+    /// the position of the first edge of each state, and the number of edges at the end
+    std::vector<uint32_t> EdgeBegin;
+
+    /// the target state and the guard of each edge
+    /// @{
+    std::vector<uint32_t> EdgeTarget;
+    std::vector<uint32_t> EdgeGuard;
+    /// @}
+
+    std::vector<z3::expr> Guards;
+
+    /// the ids of the FSM nodes, which name the states in the output
+    std::vector<int> Names;
+
+    std::vector<bool> Exits;
+
+public:
+    CompactFSM(const FSMnode *Entry, const std::set<FSMnodeRef> &Exits);
+
+    /// an FSM given by the edges, the names and the exit flags of its states, state 0 is the entry.
+    /// the states not reachable from the entry are dropped, and the others are renumbered breadth-first
+    CompactFSM(const std::vector<std::vector<std::pair<uint32_t, z3::expr>>> &Edges, const std::vector<int> &Names,
+               const std::vector<bool> &Exits);
+
+    uint32_t numStates() const { return Names.size(); }
+
+    uint32_t numEdges() const { return EdgeTarget.size(); }
+
+    uint32_t numGuards() const { return Guards.size(); }
+
+    /// the edges of a state are [edgeBegin(S), edgeEnd(S))
+    /// @{
+    uint32_t edgeBegin(uint32_t S) const { return EdgeBegin[S]; }
+
+    uint32_t edgeEnd(uint32_t S) const { return EdgeBegin[S + 1]; }
+
+    uint32_t numEdges(uint32_t S) const { return EdgeBegin[S + 1] - EdgeBegin[S]; }
+    /// @}
+
+    uint32_t target(uint32_t E) const { return EdgeTarget[E]; }
+
+    /// the position of the guard of an edge in the guard table
+    uint32_t guardOf(uint32_t E) const { return EdgeGuard[E]; }
+
+    const z3::expr &guard(uint32_t G) const { return Guards[G]; }
+
+    const std::vector<z3::expr> &guards() const { return Guards; }
+
+    int name(uint32_t S) const { return Names[S]; }
+
+    bool exit(uint32_t S) const { return Exits[S]; }
+
+    /// the bytes held by the arrays, not counting the guards shared with the z3 context
+    size_t memoryUsage() const;
+
+private:
+    /// the position of a guard in the guard table, keyed by the id of the guard
+    uint32_t addGuard(const z3::expr &, std::unordered_map<unsigned, uint32_t> &GuardOf);
+};
+
+raw_ostream &operator<<(llvm::raw_ostream &, const CompactFSM &);
+
+#endif //BNF_COMPACTFSM_H
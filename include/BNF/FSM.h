@@ -7,6 +7,7 @@
 #include <llvm/ADT/StringRef.h>
 #include "Support/Z3.h"
 #include "BNF/BNF.h"
+#include "BNF/CompactFSM.h"
 #include "BNF/Bound.h"
 #include "BNF/Bound.h"
 #include <vector>
@@ -18,17 +19,26 @@ using namespace llvm;
 #define BYTE_ARRAY "B"
 class FSMnode;
 class FSM;
+class GuardIndex;
 
 typedef std::shared_ptr<FSM> FSMRef;
 typedef std::shared_ptr<FSMnode> FSMnodeRef;
 
+/// orders the nodes by their ids instead of their addresses, so that the transitions are visited,
+/// merged and numbered in the same order in every run
+struct FSMnodeLess {
+    bool operator()(const FSMnodeRef &, const FSMnodeRef &) const;
+};
+
 class FSMnode{
 private:
     static int nextID;
     int ID;
 
 public:
-    std::map<FSMnodeRef, z3::expr> transition;
+    typedef std::map<FSMnodeRef, z3::expr, FSMnodeLess> TransitionMap;
+
+    TransitionMap transition;
 
 public:
     FSMnode() : ID(nextID++) {}
@@ -48,6 +58,10 @@ public:
     }
 };
 
+inline bool FSMnodeLess::operator()(const FSMnodeRef &A, const FSMnodeRef &B) const {
+    return A->id() < B->id();
+}
+
 class FSM {
 public:
     std::set<FSMnodeRef> allNodes;
@@ -89,19 +103,33 @@ public:
 
     void connectFSM(FSMRef fsm);// FSM1 -> FSM2
 
+    /// a copy with fresh nodes and the same guards
+    FSMRef clone() const;
+
     void simplify();
 
-    void simplify_node(FSMnodeRef node);
+    /// merge the children of a node reached by equal guards, put the children getting more transitions into Grown,
+    /// and return the number of children merged
+    unsigned simplify_node(FSMnodeRef node, GuardIndex &Guards, std::vector<FSMnodeRef> &Grown);
+
+    /// merge the reachable states with the same guards to the same states, return the number of states merged
+    unsigned merge_states(GuardIndex &Guards);
+
+    /// the compact form of the states reachable from the entry, call it after the FSM is simplified
+    CompactFSMRef freeze() const;
 
 public:
     friend raw_ostream &operator<<(llvm::raw_ostream &, const FSMRef &);
 };
 
 FSMRef combineFSM(std::set<FSMRef> v);//conbine a vector of FSM into a entire FSM and return
-FSMRef getFSMfromIndexRange(BoundRef From, BoundRef To, Product *P);//get the range[start, end] of a production into a FSM
 FSMRef getFSMfromIndex(BoundRef B, Product *P, z3::expr result);//get the B[B] related constraints of a production into a FSM
 void bisimulation(FSMRef f1, FSMRef f2);//compare two FSMs using bisimulation
 void bisimulation(FSMRef f1, FSMRef f2, FSMnodeRef n1, FSMnodeRef n2);
+void bisimulation(const CompactFSM &F1, const CompactFSM &F2);
+void partitionRefinement(FSMRef f1, FSMRef f2);//compare two FSMs by the coarsest bisimulation over their union, see FSMPartition.cpp
+void partitionRefinement(const CompactFSM &F1, const CompactFSM &F2);
+CompactFSMRef minimizeFSM(const CompactFSM &F);//merge the states moving to equivalent states on the same messages, the minimal FSM if F is deterministic, see FSMMinimize.cpp
 int equal_AndOp( z3::expr_vector AndOps1,  z3::expr_vector AndOps2);
 void similarity(z3::expr_vector diff1, z3::expr_vector diff2);
 
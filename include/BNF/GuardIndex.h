@@ -0,0 +1,88 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BNF_GUARDINDEX_H
+#define BNF_GUARDINDEX_H
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <map>
+#include <unordered_map>
+#include "Support/ByteDomain.h"
+#include "Support/Z3.h"
+
+using namespace llvm;
+
+/// an index of the guards of FSM transitions, which decides the equality of two guards without the solver
+/// if they have the same canonical form
+///
+/// a guard is canonicalized once by ordering the operands of its commutative operators, folding its constant
+/// sub-exprs, and ordering its conjuncts and dropping the duplicated ones, which keeps it equivalent to the guard.
+/// z3 shares structurally equal exprs, so the canonical forms are bucketed by their ids,
+/// and equal canonical forms mean equal guards. other pairs are first tried on the byte domains of the guards, see ByteDomain,
+/// and then decided by the solver once, keyed by their canonical forms.
+class GuardIndex {
+public:
+    typedef function_ref<bool(const z3::expr &, const z3::expr &)> SolveFn;
+
+    typedef function_ref<bool(const z3::expr &)> FeasibleFn;
+
+private:
+    /// each guard indexed and its canonical form, keyed by the id of the guard, the guard is kept alive
+    /// so that its id is not reused by another expr
+    std::unordered_map<unsigned, std::pair<z3::expr, z3::expr>> Canonicals;
+
+    /// each sub-expr normalized and its normal form, keyed and kept alive as Canonicals, see normalize
+    std::unordered_map<unsigned, std::pair<z3::expr, z3::expr>> Normals;
+
+    /// the results of the solver, keyed by the ids of two canonical forms
+    std::map<std::pair<unsigned, unsigned>, bool> Solved;
+
+    /// the byte domain and the feasibility of each canonical form, keyed by its id
+    std::unordered_map<unsigned, ByteDomain> Domains;
+    std::unordered_map<unsigned, bool> Feasible;
+
+    unsigned NumByIndex = 0;
+    unsigned NumByDomain = 0;
+    unsigned NumBySolver = 0;
+    unsigned NumFeasibleByDomain = 0;
+    unsigned NumFeasibleBySolver = 0;
+
+public:
+    /// the canonical form of a guard, which is equivalent to it
+    const z3::expr &canonical(const z3::expr &);
+
+    /// return true if two guards are equal, Solve decides the equality of their canonical forms
+    /// if they are not the same
+    bool equal(const z3::expr &, const z3::expr &, SolveFn Solve);
+
+    /// return true if a guard is satisfiable, Solve decides the satisfiability of its canonical form
+    /// if the byte domain cannot
+    bool feasible(const z3::expr &, FeasibleFn Solve);
+
+    /// print how many equalities and feasibilities are decided without the solver
+    void report(StringRef Name) const;
+
+private:
+    /// order the operands of the commutative operators by their ids and fold the constant sub-exprs
+    const z3::expr &normalize(const z3::expr &);
+
+    const ByteDomain &domain(const z3::expr &Canonical);
+};
+
+#endif //BNF_GUARDINDEX_H
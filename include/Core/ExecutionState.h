@@ -28,9 +28,12 @@
 #include "Memory/HeapMemoryBlock.h"
 #include "Memory/MessageBuffer.h"
 #include "Memory/StackMemoryBlock.h"
+#include "Support/Persistent.h"
 
 using namespace llvm;
 
+/// an abstract state, which is copy-on-write, i.e., a fork shares everything with its origin and
+/// only copies what it changes later
 class ExecutionState {
 private:
 #ifndef NDEBUG
@@ -42,13 +45,22 @@ private:
 #endif
 
     /// record the path conditions that only relates to message buffer
-    std::vector<z3::expr> PC;
+    PersistentVector<z3::expr> PC;
 
-    /// values really used in this state
-    std::map<AbstractValue *, std::shared_ptr<AbstractValue>> AbsValRevisionMap;
+    /// an index of the path conditions for conflict checking, see conflictAt
+    /// @{
+    /// the operand ids compared by the conditions -> positions of the conditions in PC
+    PersistentMap<unsigned, std::shared_ptr<const std::vector<unsigned>>> PCOperandMap;
+    /// positions of the conditions that may conflict with any condition, e.g., those comparing numerals only
+    PersistentVector<unsigned> PCAnyVec;
+    /// @}
+
+    /// values really used in this state, a value is never changed after it is put into the map,
+    /// thus can be shared by the states forked from or merged to this state
+    PersistentMap<AbstractValue *, std::shared_ptr<AbstractValue>> AbsValRevisionMap;
 
     /// named message bytes, use the expr id for efficiency
-    std::set<unsigned> NamedByteSet;
+    PersistentSet<unsigned> NamedByteSet;
 
 public:
     ExecutionState();
@@ -106,6 +118,13 @@ public:
 
     /// replace the conditions from a specified index with a given condition
     void replacePC(unsigned, const z3::expr &);
+
+    /// append a condition as it is, e.g., one recorded in a function summary
+    void appendPC(const z3::expr &E) { pushPC(E); }
+
+    /// the position of the first condition in the pc, with which Z3::simplify finds \p E conflicts,
+    /// or UINT_MAX if there is no such condition
+    unsigned conflictAt(const z3::expr &E) const;
     /// @}
 
     /// get the exact abstract value used in this state, either for store or not
@@ -118,6 +137,10 @@ public:
     /// call the function before a function call
     void markCall();
 
+    /// release the memory spaces shared by all states, call it when the analysis ends,
+    /// i.e., before the z3 session holding the values in the memory is destroyed
+    static void releaseMemorySpaces();
+
     /// given a byte id, check if it is named or not
     bool named(unsigned ID) { return NamedByteSet.count(ID); }
 
@@ -133,6 +156,8 @@ private:
 
     bool conflict(const z3::expr &);
 
+    void pushPC(const z3::expr &);
+
     friend raw_ostream &operator<<(llvm::raw_ostream &, ExecutionState &);
 
     bool optimize(std::vector<std::pair<AddressValue *, z3::expr>> &);
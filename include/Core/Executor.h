@@ -66,12 +66,12 @@ private:
     /// @}
 
     /// count the number of merging during the analysis
-    static unsigned MergeID;
-    static unsigned LoopAnalysisID;
+    static thread_local unsigned MergeID;
+    static thread_local unsigned LoopAnalysisID;
 
     /// collect source code level type info
     DistinctMetadataAnalysis *DMA = nullptr;
-    static std::map<Value *, DIType *> ValueDebugTypeMap;
+    static thread_local std::map<Value *, DIType *> ValueDebugTypeMap;
 
 public:
     explicit Executor(Pass *P) : DriverPass(P), PC(Z3::bool_val(true)) {}
@@ -0,0 +1,129 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CORE_FUNCTIONSUMMARY_H
+#define CORE_FUNCTIONSUMMARY_H
+
+#include <llvm/IR/Function.h>
+
+#include <cstdint>
+#include <set>
+#include <vector>
+
+#include "Core/ExecutionState.h"
+#include "Memory/AbstractValue.h"
+#include "Memory/MemoryBlock.h"
+
+using namespace llvm;
+
+/// summaries of the calls analyzed by Executor::visitCallIPA, see FunctionSummary.cpp
+///
+/// a call is summarized only if its effect is fully described by its return value and the conditions
+/// it appends to the pc, i.e., it reads nothing but the message and its own stack, writes nothing but its own stack,
+/// and allocates nothing but its own stack; such a call is keyed by the callee and its abstract arguments,
+/// and is not analyzed again if the pc at the call site is used by the callee the same way as it was recorded
+class FunctionSummary {
+public:
+    typedef std::vector<uint64_t> Key;
+
+    /// the effect of a summarized call
+    struct Effect {
+        /// the exprs the key refers to by id, kept alive so that the ids are not reused
+        std::vector<z3::expr> Inputs;
+
+        /// the return value, which is a scalar if not poison
+        bool HasReturn = false;
+        bool ReturnPoison = true;
+        z3::expr Return;
+
+        /// the conditions appended to the pc
+        std::vector<z3::expr> PC;
+
+        /// the conditions checked against the pc, none of them conflicts with the pc at the call site
+        std::vector<z3::expr> Checked;
+
+        /// the conditions added to the pc, with what they are simplified to by the pc at the call site
+        std::vector<std::pair<z3::expr, z3::expr>> Simplified;
+
+        Effect() : Return(Z3::bool_val(false)) {}
+    };
+
+    /// record the effect of a call between its construction and summarize()
+    class Recorder {
+    private:
+        Key K;
+        Effect E;
+        std::vector<z3::expr> EntryPC;
+        std::set<MemoryBlock *> LocalBlocks;
+        std::set<unsigned> CheckedSet;
+        std::set<unsigned> SimplifiedSet;
+        bool Summarizable;
+        bool Active;
+
+        friend class FunctionSummary;
+
+    public:
+        Recorder(Function *Callee, const std::vector<AbstractValue *> &Args, ExecutionState *ES);
+
+        ~Recorder();
+
+        /// summarize the call after returning from the callee, \p Ret is the value bound to the call site
+        void summarize(ExecutionState *ES, AbstractValue *Ret, bool Escaped);
+    };
+
+    /// the summary of a call, or null if the call has not been summarized under the pc of \p ES
+    static const Effect *lookup(Function *Callee, const std::vector<AbstractValue *> &Args, ExecutionState *ES);
+
+    /// replay a summary at a call site, \p Ret is the value bound to the call site
+    static void apply(const Effect &, ExecutionState *ES, AbstractValue *Ret);
+
+    /// hooks for the executor, which tell the calls being recorded what the analysis does
+    /// @{
+    static void stackAllocated(MemoryBlock *);
+
+    static void read(MemoryBlock *);
+
+    static void written(MemoryBlock *);
+
+    /// an effect that cannot be replayed, e.g., a heap allocation or a loop summary
+    static void unsummarizable();
+
+    /// the message buffer is overwritten, summaries reading it are stale
+    static void invalidate();
+    /// @}
+
+    /// hooks for the execution state, which tell the calls being recorded how they use the pc
+    /// @{
+    /// \p Cond is checked against the pc and conflicts with none of its conditions
+    static void checked(const z3::expr &Cond);
+
+    /// a condition checked against the pc conflicts with the \p I-th condition of the pc
+    static void conflicted(unsigned I);
+
+    /// \p Cond is added to the pc, and is simplified to \p Res by the first \p I conditions of the pc
+    static void simplified(const z3::expr &Cond, const z3::expr &Res, unsigned I);
+    /// @}
+
+    /// release the summaries of the calling thread, call it before the z3 session holding them is destroyed
+    static void release();
+
+    /// print the hit rate of the summaries of all threads
+    static void report();
+};
+
+#endif //CORE_FUNCTIONSUMMARY_H
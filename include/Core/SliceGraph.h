@@ -19,6 +19,7 @@
 
 #ifndef BNF_SLICEGRAPH_H
 #define BNF_SLICEGRAPH_H
+#include <llvm/ADT/ArrayRef.h>
 #include <queue>
 #include "Support/Z3.h"
 //#include "BNF/BNF.h"
@@ -26,12 +27,14 @@
 
 
 class SliceGraph;
+class SliceGraphLayout;
 
 extern std::vector<z3::expr> graphsForDiff;
 extern SliceGraph graph1;
 extern SliceGraph graph2;
 class SliceGraphNode {
     friend class SliceGraph;
+    friend class SliceGraphLayout;
 
 private:
     /// @{
@@ -47,6 +50,9 @@ private:
     std::set<SliceGraphNode *> Children;
     std::set<SliceGraphNode *> Parents;
 
+    /// the index in the latest layout built over the node, see SliceGraphLayout
+    unsigned Index = ~0u;
+
 public:
 
     SliceGraphNode(SliceGraphNode *node): Condition(node->getCondition()) {
@@ -104,27 +110,7 @@ public:
 
     std::set<SliceGraphNode *>::const_iterator parent_end() const { return Parents.end(); }
 
-    std::set<SliceGraphNode *> find_exitschild() {
-        std::set<SliceGraphNode *> res;
-        std::vector<SliceGraphNode *> Stack;
-        std::set<SliceGraphNode *> Visited;
-        Stack.push_back(this);
-        while (!Stack.empty()) {
-            auto *Top = Stack.back();
-            Stack.pop_back();
-            if (Visited.count(Top)) continue;
-            Visited.insert(Top);
-
-            if(Top->getNumChildren()==0){
-                res.insert(Top);
-            }
-
-            for (auto *Ch: Top->Children) {
-                Stack.push_back(Ch);
-            }
-        }
-        return res;
-    }
+    std::set<SliceGraphNode *> find_exitschild();
 
     SliceGraphNode* findmaxSubgraph(std::set<SliceGraphNode *> diff_nodes){
         SliceGraphNode *node;
@@ -144,6 +130,56 @@ public:
     
 };
 
+/// a compact snapshot of the nodes reachable from some entries
+///
+/// the nodes get dense indices in dfs order, the children and the parents of a node are ranges of flat (CSR)
+/// arrays of indices, so that a traversal marks visited nodes in a bitset instead of a std::set of pointers;
+/// the snapshot is valid until the graph is changed, and the order of children follows the node's child set
+class SliceGraphLayout {
+private:
+    std::vector<SliceGraphNode *> Nodes;
+    std::vector<unsigned> EntryIndices;
+    std::vector<unsigned> ChildOffsets;
+    std::vector<unsigned> ChildIndices;
+    std::vector<unsigned> ParentOffsets;
+    std::vector<unsigned> ParentIndices;
+
+public:
+    explicit SliceGraphLayout(const std::set<SliceGraphNode *> &Entries);
+
+    unsigned size() const { return Nodes.size(); }
+
+    SliceGraphNode *node(unsigned I) const { return Nodes[I]; }
+
+    const std::vector<SliceGraphNode *> &nodes() const { return Nodes; }
+
+    /// a node is in the layout iff its index points back to itself, thus stale indices are harmless
+    bool contains(const SliceGraphNode *N) const { return N->Index < Nodes.size() && Nodes[N->Index] == N; }
+
+    unsigned index(const SliceGraphNode *N) const {
+        assert(contains(N));
+        return N->Index;
+    }
+
+    llvm::ArrayRef<unsigned> entries() const { return EntryIndices; }
+
+    llvm::ArrayRef<unsigned> children(unsigned I) const {
+        return llvm::makeArrayRef(ChildIndices.data() + ChildOffsets[I], ChildOffsets[I + 1] - ChildOffsets[I]);
+    }
+
+    /// the parents in the layout, i.e., reachable from the entries
+    llvm::ArrayRef<unsigned> parents(unsigned I) const {
+        return llvm::makeArrayRef(ParentIndices.data() + ParentOffsets[I], ParentOffsets[I + 1] - ParentOffsets[I]);
+    }
+
+    /// the nodes in post order, following the entries and the children in order
+    void postOrder(std::vector<unsigned> &) const;
+
+    /// the nodes in the order of their addresses, i.e., the order of a std::set of the nodes, which decides
+    /// the results of the simplification passes
+    std::vector<unsigned> addressOrder() const;
+};
+
 class SliceGraph {
 private:
     std::set<SliceGraphNode *> Entries;
@@ -181,26 +217,16 @@ public:
     SliceGraph* findSubgraph(SliceGraphNode *node);
 
 
+    /// visit the nodes reachable from the entries in dfs order, the action must not change the graph structure
     template<class ActionAtDFS>
     void dfs(ActionAtDFS Act) const {
-        std::vector<SliceGraphNode *> Stack;
-        std::set<SliceGraphNode *> Visited;
-        for (auto *En: Entries)
-            Stack.push_back(En);
-        while (!Stack.empty()) {
-            auto *Top = Stack.back();
-            Stack.pop_back();
-            if (Visited.count(Top)) continue;
-            Visited.insert(Top);
-
-            Act(Top);
-
-            for (auto *Ch: Top->Children) {
-                Stack.push_back(Ch);
-            }
-        }
+        SliceGraphLayout Layout(Entries);
+        for (auto *N: Layout.nodes())
+            Act(N);
     }
 
+    SliceGraphLayout layout() const { return SliceGraphLayout(Entries); }
+
 private:
     z3::expr simplify(const z3::expr &) const;
 
@@ -208,11 +234,7 @@ private:
 
     void remove(SliceGraphNode *, bool PreserveReachability, std::set<SliceGraphNode *> *Deleted);
 
-    void postOrder(std::vector<SliceGraphNode *> &);
-
-    void postOrder(SliceGraphNode *, std::set<SliceGraphNode *> &, std::vector<SliceGraphNode *> &);
-
-    void topoOrder(std::vector<SliceGraphNode *> &);
+    void topoOrder(const SliceGraphLayout &, std::vector<unsigned> &) const;
 
     std::vector<z3::expr> merge(std::vector<std::vector<z3::expr>> &);
 
@@ -224,26 +246,7 @@ private:
 public:
     static SliceGraph *get(const z3::expr PC, bool AllExpanded = false);
 
-    void dfs_findexits(){
-        std::vector<SliceGraphNode *> Stack;
-        std::set<SliceGraphNode *> Visited;
-        for (auto *En: Entries)
-            Stack.push_back(En);
-            while (!Stack.empty()) {
-                auto *Top = Stack.back();
-                Stack.pop_back();
-                if (Visited.count(Top)) continue;
-                Visited.insert(Top);
-
-                if(Top->getNumChildren()==0){
-                    getExits().insert(Top);
-                }
-
-                for (auto *Ch: Top->Children) {
-                    Stack.push_back(Ch);
-                }
-            }
-    }
+    void dfs_findexits();
 
 
 private:
@@ -19,6 +19,7 @@
 #ifndef CORE_SYMBOLICEXECUTION_H
 #define CORE_SYMBOLICEXECUTION_H
 
+#include <unordered_map>
 #include "Core/SymbolicExecutionTree.h"
 #include "Core/SliceGraph.h"
 #include "Support/PushPop.h"
@@ -34,6 +35,38 @@ struct PhiPointer {
     }
 };
 
+/// what the executions from a slice node depend on, i.e., the node and its descendants, see SymbolicExecution::reach
+struct SliceReach {
+    /// ids of the phis in the conditions
+    std::vector<unsigned> Phis;
+
+    /// ids the executions may look up in the named elements
+    std::vector<unsigned> Queries;
+
+    /// ids of the variables and the selects in the conditions,
+    /// a path condition sharing none of them never simplifies the conditions
+    std::vector<unsigned> Atoms;
+};
+
+/// a branch executed in another thread, together with the part of the stacks it starts with
+struct SymbolicExecutionTask {
+    /// the tree node the executed subtree is put under
+    SymbolicExecutionTreeNode *Parent;
+    SliceGraphNode *Node;
+    std::vector<PhiPointer> Selectors;
+
+    /// the stacks, exprs are in the context of the forking thread
+    /// @{
+    std::vector<PhiPointer> PhiSelectors;
+    std::vector<z3::expr> Named;
+    std::vector<z3::expr> PathConds;
+    /// @}
+
+    /// positions of the exprs above in the exprs translated for a thread, see SymbolicExecution::runInParallel
+    std::vector<unsigned> NamedPos;
+    std::vector<unsigned> PathCondPos;
+};
+
 class SymbolicExecution {
 private:
     PushPopSet<PhiPointer> PhiSelectorStack;
@@ -42,6 +75,26 @@ private:
     PushPopVector<z3::expr> PathCondStack;
     std::map<unsigned, std::vector<unsigned>> PhiID2DupValIDMap;
 
+    /// subtrees already executed, keyed by the slice node and the part of the stacks the subtree depends on,
+    /// so that an identical subtree is shared instead of executed again; a subtree is the tree nodes put
+    /// under the parent, which are empty if the subtree is pruned, see doSymbolicExecutionDFS
+    std::map<std::vector<uint64_t>, std::vector<SymbolicExecutionTreeNode *>> SubtreeMap;
+    std::unordered_map<SliceGraphNode *, SliceReach> ReachMap;
+    /// the atoms of a path condition, which is kept here so that its id is not reused
+    std::unordered_map<unsigned, std::pair<z3::expr, std::vector<unsigned>>> PathCondAtomMap;
+    unsigned NumTreeNodes = 0;
+    unsigned NumSharedSubtrees = 0;
+
+    /// branches forked as tasks, null if the execution runs in one thread
+    std::vector<SymbolicExecutionTask> *Tasks = nullptr;
+    /// the exprs of the named elements, which are translated for the tasks
+    std::unordered_map<unsigned, z3::expr> NamedExprMap;
+    /// the number of paths from a slice node, which estimates the work of a branch
+    std::unordered_map<SliceGraphNode *, uint64_t> PathNumMap;
+
+    /// in a task thread, the conditions of the slice nodes and their ids in the context of the thread
+    std::unordered_map<SliceGraphNode *, std::pair<z3::expr, unsigned>> ConditionMap;
+
 public:
     static char ID;
 
@@ -52,6 +105,20 @@ public:
     SymbolicExecutionTree *run(const z3::expr &, SliceGraph &);
 
 private:
+    void doSymbolicExecution(SymbolicExecutionTreeNode *, SliceGraphNode *, std::vector<PhiPointer> &);
+
+    void fork(SymbolicExecutionTreeNode *, SliceGraphNode *, std::vector<PhiPointer> &);
+
+    void runInParallel(SliceGraph &, std::vector<SymbolicExecutionTask> &, unsigned NumThreads);
+
+    SymbolicExecutionTreeNode *runTask(const SymbolicExecutionTask &, const std::vector<z3::expr> &);
+
+    uint64_t pathNum(SliceGraphNode *);
+
+    z3::expr condition(SliceGraphNode *) const;
+
+    unsigned conditionID(SliceGraphNode *) const;
+
     void doSymbolicExecutionDFS(SymbolicExecutionTreeNode *, SliceGraphNode *, std::vector<PhiPointer> &);
 
     z3::expr doSymbolicExecutionSimplify(const z3::expr &);
@@ -62,6 +129,10 @@ private:
 
     z3::expr doSymbolicExecutionEliminateConflict(const z3::expr &);
 
+    const SliceReach &reach(SliceGraphNode *);
+
+    std::vector<uint64_t> subtreeKey(SliceGraphNode *);
+
     void evaluatePhi(SliceGraphNode *, std::map<unsigned, std::vector<unsigned>> &);
 
     void findDupPhiVal(const z3::expr &);
@@ -20,16 +20,17 @@
 #ifndef CORE_EXECUTIONTREE_H
 #define CORE_EXECUTIONTREE_H
 
+#include <map>
 #include <set>
 #include <vector>
 #include "Support/Z3.h"
 
+/// a node of the tree, which may be shared by several parents, see SymbolicExecution
 class SymbolicExecutionTreeNode {
     friend class SymbolicExecutionTree;
 
 private:
     z3::expr Expr;
-    SymbolicExecutionTreeNode *Parent = nullptr;
     std::set<SymbolicExecutionTreeNode *> Children;
 
 public:
@@ -43,13 +44,18 @@ public:
 
     void addChild(SymbolicExecutionTreeNode *);
 
-    SymbolicExecutionTreeNode *getParent() const { return Parent; }
+    const std::set<SymbolicExecutionTreeNode *> &getChildren() const { return Children; }
 };
 
+/// the tree of executions on a slice graph, where identical subtrees are shared, i.e., it is in fact a dag,
+/// thus the passes below never modify a node whose result depends on the path reaching it
 class SymbolicExecutionTree {
 private:
     SymbolicExecutionTreeNode *Root;
 
+    /// nodes created when simplifying the tree
+    std::vector<SymbolicExecutionTreeNode *> Created;
+
 public:
     SymbolicExecutionTree(SymbolicExecutionTreeNode *Rt) : Root(Rt) {}
 
@@ -62,13 +68,20 @@ public:
     z3::expr pc() const;
 
 private:
-    void compressInfeasiblePaths();
+    /// return false if all paths through the node are infeasible, which are removed
+    bool compressInfeasiblePaths(SymbolicExecutionTreeNode *, std::map<SymbolicExecutionTreeNode *, bool> &);
+
+    /// return the nodes replacing the node under the nearest ancestor kept, whose assertion is given
+    const std::set<SymbolicExecutionTreeNode *> &
+    compressOffsprings(SymbolicExecutionTreeNode *, const z3::expr &,
+                       std::map<std::pair<SymbolicExecutionTreeNode *, unsigned>,
+                               std::set<SymbolicExecutionTreeNode *>> &);
 
-    void compressOffsprings();
+    void compressSiblings(SymbolicExecutionTreeNode *, std::set<SymbolicExecutionTreeNode *> &);
 
-    void compressSiblings();
+    std::set<SymbolicExecutionTreeNode *> nodes() const;
 
-    z3::expr pc(SymbolicExecutionTreeNode *) const;
+    z3::expr pc(SymbolicExecutionTreeNode *, std::map<SymbolicExecutionTreeNode *, z3::expr> &) const;
 
 public:
     template<class ActionAtDFS>
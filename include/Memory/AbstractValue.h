@@ -22,6 +22,7 @@
 #include <llvm/Support/Casting.h>
 #include <z3++.h>
 #include "Support/DL.h"
+#include "Support/Pool.h"
 #include "Support/Z3.h"
 
 #define DEFAULT_IMPL {                                                 \
@@ -48,6 +49,13 @@ public:
 
     virtual ~AbstractValue() = 0;
 
+    /// values are allocated in the pool of the analysis thread, including the clones and the values of memory blocks
+    /// @{
+    static void *operator new(size_t Size) { return Pool::allocate(Size); }
+
+    static void operator delete(void *P, size_t Size) { Pool::deallocate(P, Size); }
+    /// @}
+
     [[nodiscard]] AbstractValueKind getKind() const;
 
     [[nodiscard]] StringRef getKindName() const;
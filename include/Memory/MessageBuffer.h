@@ -19,13 +19,19 @@
 #ifndef MEMORY_MESSAGEBUFFER_H
 #define MEMORY_MESSAGEBUFFER_H
 
+#include <deque>
+
 #include "Memory/MemoryBlock.h"
+#include "Support/FlatHash.h"
 #include "Support/Z3.h"
 
 class MessageBuffer : public MemoryBlock {
 private:
     z3::expr Data;
-    std::vector<AbstractValue *> VarIDAbsVal;
+
+    /// values of the bytes at variable offsets, which are temporaries of the current function,
+    /// kept in chunks and released in one shot by gc()
+    std::deque<ScalarValue> VarIDAbsVal;
 
     /// in some rare cases, developers reuse the message buffer, e.g., tcp in lwip
     /// but the store dominates all uses
@@ -33,7 +39,8 @@ private:
     ///  some bugs may be in the implementation
     /// todo the variable offset may be (almost) equivalent but in different style,
     ///  e.g., zext(len.32 + 4.32, 64) vs. zext(len, 64) + 4.64, which needs more expression rewriting
-    std::map<z3::expr, z3::expr, Z3::less_than> VariableOffsetStore;
+    /// keyed by the id of the offset, which is kept in the entry together with the value stored
+    FlatIDMap<std::pair<z3::expr, z3::expr>> VariableOffsetStore;
 
 public:
     MessageBuffer(Type *Ty, unsigned Num = 1);
@@ -0,0 +1,89 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SUPPORT_BYTEDOMAIN_H
+#define SUPPORT_BYTEDOMAIN_H
+
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "Support/Z3.h"
+
+/// an over-approximation of the messages satisfying a condition, which decides trivial queries without the solver
+///
+/// a term is the message length, a byte at a constant index, e.g., Z3::byte_array_element(B, 2), or a concatenation
+/// of such bytes. the conjuncts comparing a term with a numeral narrow an unsigned interval of the term, those masking
+/// or extracting bits of a term fix its known bits, and the other conjuncts are ignored. thus an empty domain means
+/// an unsat condition, and a message built from the least values of the terms, if the condition holds on it, means a
+/// sat condition.
+class ByteDomain {
+public:
+    /// Unknown if the domain cannot decide the query, i.e., the solver has to
+    enum Answer { No, Yes, Unknown };
+
+private:
+    struct Term {
+        unsigned ID;
+        unsigned Width;
+        /// the constant indices of the bytes, the most significant first, empty for the length
+        std::vector<uint64_t> Bytes;
+        uint64_t Lo;
+        uint64_t Hi;
+        /// the bits known to be zero and known to be one
+        uint64_t Zero = 0;
+        uint64_t One = 0;
+        /// the values excluded by disequalities
+        std::vector<uint64_t> Excluded;
+    };
+
+    /// a message given by the bytes at some constant indices and its length, the other bytes are zero
+    struct Witness {
+        std::map<uint64_t, uint8_t> Bytes;
+        uint64_t Length = 0;
+    };
+
+    z3::expr Cond;
+
+    std::vector<Term> Terms;
+
+    bool Empty = false;
+
+    bool HasWitness = false;
+
+    Witness Message;
+
+public:
+    explicit ByteDomain(const z3::expr &Cond);
+
+    /// whether the condition is satisfiable
+    Answer satisfiable() const;
+
+    /// whether two conditions are equivalent, they are not if a message satisfying one of them falsifies the other
+    static Answer equivalent(const ByteDomain &, const ByteDomain &);
+
+private:
+    Term *term(const z3::expr &);
+
+    void constrain(const z3::expr &Conjunct);
+
+    bool witness(bool MaxLength, Witness &) const;
+
+    Answer evaluate(const Witness &) const;
+};
+
+#endif //SUPPORT_BYTEDOMAIN_H
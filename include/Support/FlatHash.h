@@ -0,0 +1,150 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SUPPORT_FLATHASH_H
+#define SUPPORT_FLATHASH_H
+
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/// open-addressing tables keyed by 32-bit ids, e.g., the ids z3 assigns to exprs
+///
+/// the slots are a flat array probed linearly, so that a lookup touches one or two cache lines instead of
+/// the nodes of a red-black tree; the tables only grow, i.e., an id cannot be erased
+namespace flat_hash {
+static const unsigned EmptyID = ~0u;
+
+/// z3 assigns ids almost consecutively, a multiplicative hash spreads them over the slots
+inline size_t slot(unsigned ID, size_t Mask) {
+    return (size_t) (((uint64_t) ID * 0x9e3779b97f4a7c15ULL) >> 32) & Mask;
+}
+} // namespace flat_hash
+
+class FlatIDSet {
+private:
+    std::vector<unsigned> Slots;
+    size_t Size = 0;
+
+    void grow() {
+        std::vector<unsigned> Old(Slots.empty() ? 16 : Slots.size() * 2, flat_hash::EmptyID);
+        Old.swap(Slots);
+        Size = 0;
+        for (auto ID: Old)
+            if (ID != flat_hash::EmptyID) insert(ID);
+    }
+
+public:
+    size_t size() const { return Size; }
+
+    bool empty() const { return Size == 0; }
+
+    bool count(unsigned ID) const {
+        if (Slots.empty()) return false;
+        auto Mask = Slots.size() - 1;
+        for (auto I = flat_hash::slot(ID, Mask);; I = (I + 1) & Mask) {
+            if (Slots[I] == ID) return true;
+            if (Slots[I] == flat_hash::EmptyID) return false;
+        }
+    }
+
+    /// return true if the id is not in the set before
+    bool insert(unsigned ID) {
+        assert(ID != flat_hash::EmptyID);
+        if ((Size + 1) * 4 > Slots.size() * 3) grow();
+        auto Mask = Slots.size() - 1;
+        for (auto I = flat_hash::slot(ID, Mask);; I = (I + 1) & Mask) {
+            if (Slots[I] == ID) return false;
+            if (Slots[I] == flat_hash::EmptyID) {
+                Slots[I] = ID;
+                ++Size;
+                return true;
+            }
+        }
+    }
+
+    void clear() {
+        std::vector<unsigned>().swap(Slots);
+        Size = 0;
+    }
+};
+
+/// the entries are kept densely in insertion order, the slots only hold their indices
+template<typename ValueT>
+class FlatIDMap {
+private:
+    std::vector<unsigned> Slots;
+    std::vector<std::pair<unsigned, ValueT>> Entries;
+
+    void grow() {
+        Slots.assign(Slots.empty() ? 16 : Slots.size() * 2, flat_hash::EmptyID);
+        auto Mask = Slots.size() - 1;
+        for (unsigned K = 0; K < Entries.size(); ++K) {
+            auto I = flat_hash::slot(Entries[K].first, Mask);
+            while (Slots[I] != flat_hash::EmptyID) I = (I + 1) & Mask;
+            Slots[I] = K;
+        }
+    }
+
+public:
+    typedef typename std::vector<std::pair<unsigned, ValueT>>::const_iterator const_iterator;
+
+    size_t size() const { return Entries.size(); }
+
+    bool empty() const { return Entries.empty(); }
+
+    const_iterator begin() const { return Entries.begin(); }
+
+    const_iterator end() const { return Entries.end(); }
+
+    /// the value of an id, or null if the id is not in the map
+    ValueT *find(unsigned ID) {
+        if (Slots.empty()) return nullptr;
+        auto Mask = Slots.size() - 1;
+        for (auto I = flat_hash::slot(ID, Mask);; I = (I + 1) & Mask) {
+            if (Slots[I] == flat_hash::EmptyID) return nullptr;
+            if (Entries[Slots[I]].first == ID) return &Entries[Slots[I]].second;
+        }
+    }
+
+    const ValueT *find(unsigned ID) const { return const_cast<FlatIDMap *>(this)->find(ID); }
+
+    bool count(unsigned ID) const { return find(ID); }
+
+    /// insert the value if the id is not in the map, like std::map::insert,
+    /// return the value of the id and whether it is inserted
+    std::pair<ValueT *, bool> insert(unsigned ID, const ValueT &V) {
+        assert(ID != flat_hash::EmptyID);
+        if (auto *Found = find(ID)) return {Found, false};
+        if ((Entries.size() + 1) * 4 > Slots.size() * 3) grow();
+        auto Mask = Slots.size() - 1;
+        auto I = flat_hash::slot(ID, Mask);
+        while (Slots[I] != flat_hash::EmptyID) I = (I + 1) & Mask;
+        Slots[I] = Entries.size();
+        Entries.emplace_back(ID, V);
+        return {&Entries.back().second, true};
+    }
+
+    void clear() {
+        std::vector<unsigned>().swap(Slots);
+        Entries.clear();
+    }
+};
+
+#endif //SUPPORT_FLATHASH_H
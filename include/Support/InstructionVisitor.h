@@ -28,8 +28,8 @@
 
 
 namespace llvm {
-inline std::set<Instruction *> Inst;
-inline std::set<Instruction *> slice_Inst;
+inline thread_local std::set<Instruction *> Inst;
+inline thread_local std::set<Instruction *> slice_Inst;
     // We operate on opaque instruction classes, so forward declare all instruction
     // types now...
     //
@@ -0,0 +1,263 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SUPPORT_PERSISTENT_H
+#define SUPPORT_PERSISTENT_H
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/// a persistent hash array mapped trie, keyed by pointers or integers
+///
+/// copying a map is O(1), the copies share all nodes, and an update only copies the nodes
+/// on the path to the entry that are shared with other copies
+template<typename KeyT, typename ValueT>
+class PersistentMap {
+private:
+    static const unsigned Bits = 5;
+    static const unsigned Mask = (1u << Bits) - 1;
+
+    struct Node {
+        /// slots holding an entry and slots holding a child
+        uint32_t DataMap = 0;
+        uint32_t NodeMap = 0;
+        std::vector<std::pair<KeyT, ValueT>> Entries;
+        std::vector<std::shared_ptr<Node>> Children;
+    };
+
+    std::shared_ptr<Node> Root;
+    size_t Size = 0;
+
+    /// a bijection, so that two keys never collide in all levels
+    static uint64_t hash(const KeyT &K) {
+        uint64_t H = (uint64_t) K;
+        H ^= H >> 33;
+        H *= 0xff51afd7ed558ccdULL;
+        H ^= H >> 33;
+        H *= 0xc4ceb9fe1a85ec53ULL;
+        H ^= H >> 33;
+        return H;
+    }
+
+    static unsigned index(uint32_t Map, uint32_t Bit) {
+        return __builtin_popcount(Map & (Bit - 1));
+    }
+
+    /// make the node writable, i.e., not shared with other maps
+    static Node *own(std::shared_ptr<Node> &N) {
+        if (!N) N = std::make_shared<Node>();
+        else if (N.use_count() > 1) N = std::make_shared<Node>(*N);
+        return N.get();
+    }
+
+    static bool set(std::shared_ptr<Node> &Ptr, uint64_t H, unsigned Shift, const KeyT &K, const ValueT &V) {
+        auto *N = own(Ptr);
+        uint32_t Bit = 1u << ((H >> Shift) & Mask);
+        if (N->NodeMap & Bit) {
+            return set(N->Children[index(N->NodeMap, Bit)], H, Shift + Bits, K, V);
+        } else if (N->DataMap & Bit) {
+            auto Idx = index(N->DataMap, Bit);
+            if (N->Entries[Idx].first == K) {
+                N->Entries[Idx].second = V;
+                return false;
+            }
+            // push the entry down to a new child together with the new one
+            std::shared_ptr<Node> Child;
+            auto Entry = std::move(N->Entries[Idx]);
+            set(Child, hash(Entry.first), Shift + Bits, Entry.first, Entry.second);
+            set(Child, H, Shift + Bits, K, V);
+            N->Entries.erase(N->Entries.begin() + Idx);
+            N->DataMap &= ~Bit;
+            N->NodeMap |= Bit;
+            N->Children.insert(N->Children.begin() + index(N->NodeMap, Bit), std::move(Child));
+            return true;
+        } else {
+            N->DataMap |= Bit;
+            N->Entries.insert(N->Entries.begin() + index(N->DataMap, Bit), std::make_pair(K, V));
+            return true;
+        }
+    }
+
+    static bool erase(std::shared_ptr<Node> &Ptr, uint64_t H, unsigned Shift, const KeyT &K) {
+        if (!Ptr) return false;
+        uint32_t Bit = 1u << ((H >> Shift) & Mask);
+        if (Ptr->NodeMap & Bit) {
+            auto Idx = index(Ptr->NodeMap, Bit);
+            if (!contains(Ptr->Children[Idx].get(), H, Shift + Bits, K)) return false;
+            auto *N = own(Ptr);
+            auto &Child = N->Children[Idx];
+            erase(Child, H, Shift + Bits, K);
+            if (Child->DataMap == 0 && Child->NodeMap == 0) {
+                N->Children.erase(N->Children.begin() + Idx);
+                N->NodeMap &= ~Bit;
+            }
+            return true;
+        } else if (Ptr->DataMap & Bit) {
+            auto Idx = index(Ptr->DataMap, Bit);
+            if (!(Ptr->Entries[Idx].first == K)) return false;
+            auto *N = own(Ptr);
+            N->Entries.erase(N->Entries.begin() + Idx);
+            N->DataMap &= ~Bit;
+            return true;
+        }
+        return false;
+    }
+
+    static const ValueT *find(const Node *N, uint64_t H, unsigned Shift, const KeyT &K) {
+        while (N) {
+            uint32_t Bit = 1u << ((H >> Shift) & Mask);
+            if (N->NodeMap & Bit) {
+                N = N->Children[index(N->NodeMap, Bit)].get();
+                Shift += Bits;
+            } else if (N->DataMap & Bit) {
+                auto &Entry = N->Entries[index(N->DataMap, Bit)];
+                return Entry.first == K ? &Entry.second : nullptr;
+            } else {
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    static bool contains(const Node *N, uint64_t H, unsigned Shift, const KeyT &K) {
+        return find(N, H, Shift, K);
+    }
+
+    template<typename FuncT>
+    static void forEach(const Node *N, FuncT &F) {
+        if (!N) return;
+        for (auto &Entry: N->Entries) F(Entry.first, Entry.second);
+        for (auto &Child: N->Children) forEach(Child.get(), F);
+    }
+
+public:
+    size_t size() const { return Size; }
+
+    bool empty() const { return Size == 0; }
+
+    /// the value of a key, or null if the key is not in the map
+    const ValueT *find(const KeyT &K) const { return find(Root.get(), hash(K), 0, K); }
+
+    bool count(const KeyT &K) const { return find(K); }
+
+    void set(const KeyT &K, const ValueT &V) {
+        if (set(Root, hash(K), 0, K, V)) ++Size;
+    }
+
+    bool erase(const KeyT &K) {
+        if (!erase(Root, hash(K), 0, K)) return false;
+        --Size;
+        return true;
+    }
+
+    /// visit all entries in an unspecified order
+    template<typename FuncT>
+    void forEach(FuncT F) const { forEach(Root.get(), F); }
+};
+
+/// a persistent set, see PersistentMap
+template<typename KeyT>
+class PersistentSet {
+private:
+    PersistentMap<KeyT, bool> Map;
+
+public:
+    size_t size() const { return Map.size(); }
+
+    bool count(const KeyT &K) const { return Map.count(K); }
+
+    void insert(const KeyT &K) { Map.set(K, true); }
+
+    bool erase(const KeyT &K) { return Map.erase(K); }
+
+    template<typename FuncT>
+    void forEach(FuncT F) const {
+        Map.forEach([&F](const KeyT &K, bool) { F(K); });
+    }
+};
+
+/// a persistent vector, whose elements are kept in immutable chunks shared by the copies and a tail owned by itself
+///
+/// copying a vector only copies the pointers to the chunks and the tail, which is shorter than a chunk
+template<typename T, unsigned ChunkSize = 32>
+class PersistentVector {
+private:
+    std::vector<std::shared_ptr<const std::vector<T>>> Chunks;
+    std::vector<T> Tail;
+
+public:
+    class const_iterator {
+    private:
+        const PersistentVector *Vec;
+        size_t I;
+
+    public:
+        const_iterator(const PersistentVector *Vec, size_t I) : Vec(Vec), I(I) {}
+
+        const T &operator*() const { return (*Vec)[I]; }
+
+        const_iterator &operator++() {
+            ++I;
+            return *this;
+        }
+
+        bool operator!=(const const_iterator &It) const { return I != It.I; }
+
+        bool operator==(const const_iterator &It) const { return I == It.I; }
+    };
+
+    size_t size() const { return Chunks.size() * ChunkSize + Tail.size(); }
+
+    bool empty() const { return Chunks.empty() && Tail.empty(); }
+
+    const T &operator[](size_t I) const {
+        assert(I < size());
+        if (I < Chunks.size() * ChunkSize) return (*Chunks[I / ChunkSize])[I % ChunkSize];
+        return Tail[I - Chunks.size() * ChunkSize];
+    }
+
+    const T &at(size_t I) const { return (*this)[I]; }
+
+    const T &back() const { return (*this)[size() - 1]; }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+
+    const_iterator end() const { return const_iterator(this, size()); }
+
+    void push_back(const T &E) {
+        Tail.push_back(E);
+        if (Tail.size() == ChunkSize) {
+            Chunks.push_back(std::make_shared<const std::vector<T>>(std::move(Tail)));
+            Tail.clear();
+        }
+    }
+
+    void pop_back() {
+        assert(!empty());
+        if (Tail.empty()) {
+            Tail = *Chunks.back();
+            Chunks.pop_back();
+        }
+        Tail.pop_back();
+    }
+};
+
+#endif //SUPPORT_PERSISTENT_H
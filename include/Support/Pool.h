@@ -0,0 +1,61 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SUPPORT_POOL_H
+#define SUPPORT_POOL_H
+
+#include <cstddef>
+
+/// a pool of small blocks owned by the calling thread, like the z3 session, an analysis runs in one thread
+///
+/// blocks are carved from large chunks and recycled by size, so that the many short-lived objects of
+/// an analysis, e.g., abstract values, neither hit the global allocator nor fragment the heap
+class Pool {
+public:
+    static void *allocate(size_t Size);
+
+    static void deallocate(void *P, size_t Size);
+
+    /// return the chunks of the calling thread to the system, call it when the analysis ends;
+    /// the chunks are kept if some block is still in use
+    static void release();
+};
+
+/// an allocator for std::allocate_shared, which puts an object and its control block into the pool
+template<typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator() = default;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(size_t N) { return static_cast<T *>(Pool::allocate(N * sizeof(T))); }
+
+    void deallocate(T *P, size_t N) { Pool::deallocate(P, N * sizeof(T)); }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U> &) const { return true; }
+
+    template<typename U>
+    bool operator!=(const PoolAllocator<U> &) const { return false; }
+};
+
+#endif //SUPPORT_POOL_H
@@ -150,6 +150,9 @@ public:
     size_t size() const {
         return ElementSet.size();
     }
+
+    /// the elements in the order they are added
+    const std::vector<T> &get() const { return ElementVector; }
 };
 
 #endif //SUPPORT_PUSHPOP_H
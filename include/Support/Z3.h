@@ -25,11 +25,59 @@
 #include <llvm/Support/Debug.h>
 #include <llvm/Support/raw_ostream.h>
 #include <map>
+#include <memory>
 #include <set>
 #include <z3++.h>
 
 using namespace llvm;
 
+/// an analysis session, which owns the z3 context and everything built on it, i.e.,
+/// the solvers, the fresh-variable counters, the length of the message and the phi bookkeeping
+///
+/// the Z3 and Z3Solver facades work on the current session of the calling thread,
+/// a thread never entering a session works on a default one, which lives until the thread exits
+class Z3Session {
+public:
+    struct State;
+
+private:
+    std::unique_ptr<State> S;
+
+    friend class Z3;
+
+    friend State &state();
+
+public:
+    /// a child session shares the fresh-variable counters of its parent, so that exprs of the child
+    /// can be translated into the parent without confusing their free and index variables
+    ///
+    /// a child with a namespace instead has its own counters and prefixes its fresh names with the namespace,
+    /// so that the names it creates do not depend on how its thread is scheduled against its siblings
+    explicit Z3Session(Z3Session *Parent = nullptr, const std::string &Namespace = "");
+
+    ~Z3Session();
+
+    Z3Session(const Z3Session &) = delete;
+
+    Z3Session &operator=(const Z3Session &) = delete;
+
+    z3::context &context();
+
+    /// the current session of the calling thread
+    static Z3Session &current();
+
+    /// make a session current in the calling thread, and restore the previous one when leaving the scope
+    class Scope {
+    private:
+        Z3Session *Prev;
+
+    public:
+        explicit Scope(Z3Session &);
+
+        ~Scope();
+    };
+};
+
 class Z3 {
 public:
     enum Z3Format {
@@ -42,6 +90,14 @@ public:
     /// call only at initialization
     static void initialize();
 
+    /// translate exprs into the given session, usually the one of another thread, and append them to the vector,
+    /// translations are serialized, so the vector must hold exprs of the given session only
+    static void translate(const std::vector<z3::expr> &, Z3Session &, std::vector<z3::expr> &);
+
+    /// copy the bookkeeping of the given phis in the current session into the given session, which must not be in use,
+    /// so that the phis translated into the given session can be queried there
+    static void translate_phis(const std::set<unsigned> &PhiIDs, Z3Session &);
+
     /// create new single values or consts
     /// @{
     static z3::expr bv_val(unsigned, unsigned);
@@ -315,6 +371,26 @@ public:
     static bool check(const z3::expr_vector &);
 
     static void getmodel(const z3::expr &,const z3::expr &,const z3::expr &);
+
+    /// incremental solving, which does not reset the solver between checks
+    /// assertions added in a scope, and what the solver learns from them, are kept until the scope is popped
+    /// @{
+    static void push();
+
+    static void pop();
+
+    static void add(const z3::expr &);
+
+    /// return a fresh literal asserted to be equivalent to the expr in the current scope,
+    /// so that many checks over the expr share a single encoding of it
+    static z3::expr proxy(const z3::expr &);
+
+    /// check the assertions in all scopes together with the given expr, which is only assumed in this check
+    static bool checkIncremental(const z3::expr &);
+    /// @}
+
+    /// print how many checks are answered by the query cache, see Z3SolverCache.cpp
+    static void reportCache();
 };
 
 raw_ostream &operator<<(llvm::raw_ostream &, const Z3::Z3Format &);
@@ -25,6 +25,7 @@
 #include <iostream> 
 #include <string> 
 #include "Support/ADT.h"
+#include "Support/ByteDomain.h"
 
 #define DEBUG_TYPE "BNF"
 
@@ -1764,7 +1765,8 @@ void cmp_product (Product * product1, Product * product2){
 void cmp_Formula(z3::expr F1, z3::expr F2){
     //errs()<<"hahha\n";
     //check whether F1 and F2 is semantically equal 
-    if(Z3Solver::check(F1!=F2)==z3::unsat){
+    //formulas the byte domains find equal need no solver
+    if(ByteDomain::equivalent(ByteDomain(F1), ByteDomain(F2)) == ByteDomain::Yes || Z3Solver::check(F1!=F2)==z3::unsat){
         errs()<<"equal\n";
         //F1==F2
         errs()<<F1<<" == "<<F2<<"\n";
@@ -145,33 +145,15 @@ BoundRef Bound::createBound(int64_t N) {
 }
 
 
+static bool isByteArraySelect(const z3::expr &E) {
+    return E.is_app() && E.decl().decl_kind() == Z3_OP_SELECT && E.arg(0).is_const() &&
+           E.arg(0).decl().name().str() == BYTE_ARRAY;
+}
+
 bool Bound::findexprwithIndex(const z3::expr & Expr, const BoundRef b){
-    std::set<unsigned> Visited;
-    z3::expr_vector Stack = Z3::vec();
-    Stack.push_back(Expr);
-    while (!Stack.empty()) {
-        auto Top = Stack.back();
-        Stack.pop_back();
-        auto TopID = Z3::id(Top);
-        if (Visited.count(TopID)) {
-            continue;
-        }
-        Visited.insert(TopID);
-        if(Top.is_app() && Top.decl().decl_kind() == Z3_OP_SELECT && Top.arg(0).is_const() && Top.arg(0).decl().name().str() == BYTE_ARRAY) {
-            BoundRef bound_index = Bound::createBound(Top.arg(1));
-            //errs()<<"compare: "<<bound_index<<"\n";
-            if (b == bound_index) {
-                //errs()<<"compare result: true\n";
-                return true;
-            }
-            //errs()<<"compare result: false\n";
-        }
-
-
-        auto NumArgs = Top.num_args();
-        for (unsigned I = 0; I < NumArgs; ++I) {
-            Stack.push_back(Top.arg(I));
-        }
+    // the selects of an expr are collected once and cached by Z3::find_all
+    for (auto Select: Z3::find_all(Expr, true, isByteArraySelect)) {
+        if (b == Bound::createBound(Select.arg(1))) return true;
     }
     return false;
 }
@@ -0,0 +1,99 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "BNF/CompactFSM.h"
+#include "BNF/FSM.h"
+
+CompactFSM::CompactFSM(const FSMnode *EntryNode, const std::set<FSMnodeRef> &ExitNodes) {
+    std::unordered_map<const FSMnode *, uint32_t> StateOf;
+    std::vector<const FSMnode *> Nodes = {EntryNode};
+    StateOf.emplace(EntryNode, 0);
+    std::unordered_map<unsigned, uint32_t> GuardOf;
+    // the states are appended while their predecessors are visited, so the edges are laid out state by state
+    for (uint32_t S = 0; S < Nodes.size(); ++S) {
+        EdgeBegin.push_back(EdgeTarget.size());
+        for (auto &T: Nodes[S]->transition) {
+            auto It = StateOf.emplace(T.first.get(), Nodes.size());
+            if (It.second) Nodes.push_back(T.first.get());
+            EdgeTarget.push_back(It.first->second);
+            EdgeGuard.push_back(addGuard(T.second, GuardOf));
+        }
+    }
+    EdgeBegin.push_back(EdgeTarget.size());
+
+    Names.reserve(Nodes.size());
+    for (auto *N: Nodes) Names.push_back(N->id());
+    Exits.assign(Nodes.size(), false);
+    for (auto &N: ExitNodes) {
+        auto It = StateOf.find(N.get());
+        if (It != StateOf.end()) Exits[It->second] = true;
+    }
+}
+
+CompactFSM::CompactFSM(const std::vector<std::vector<std::pair<uint32_t, z3::expr>>> &Edges,
+                       const std::vector<int> &StateNames, const std::vector<bool> &StateExits) {
+    std::vector<uint32_t> StateOf(Edges.size(), UINT32_MAX);
+    std::vector<uint32_t> Order = {0};
+    StateOf[0] = 0;
+    std::unordered_map<unsigned, uint32_t> GuardOf;
+    for (uint32_t S = 0; S < Order.size(); ++S) {
+        EdgeBegin.push_back(EdgeTarget.size());
+        for (auto &E: Edges[Order[S]]) {
+            if (StateOf[E.first] == UINT32_MAX) {
+                StateOf[E.first] = Order.size();
+                Order.push_back(E.first);
+            }
+            EdgeTarget.push_back(StateOf[E.first]);
+            EdgeGuard.push_back(addGuard(E.second, GuardOf));
+        }
+    }
+    EdgeBegin.push_back(EdgeTarget.size());
+
+    Names.reserve(Order.size());
+    Exits.reserve(Order.size());
+    for (auto S: Order) {
+        Names.push_back(StateNames[S]);
+        Exits.push_back(StateExits[S]);
+    }
+}
+
+uint32_t CompactFSM::addGuard(const z3::expr &G, std::unordered_map<unsigned, uint32_t> &GuardOf) {
+    auto It = GuardOf.emplace(Z3::id(G), Guards.size());
+    if (It.second) Guards.push_back(G);
+    return It.first->second;
+}
+
+size_t CompactFSM::memoryUsage() const {
+    return (EdgeBegin.capacity() + EdgeTarget.capacity() + EdgeGuard.capacity()) * sizeof(uint32_t) +
+           Guards.capacity() * sizeof(z3::expr) + Names.capacity() * sizeof(int) + Exits.capacity() / 8;
+}
+
+raw_ostream &operator<<(raw_ostream &DotStream, const CompactFSM &Machine) {
+    DotStream << "\n";
+    DotStream << "digraph machine {\n";
+    for (uint32_t S = 0; S < Machine.numStates(); ++S) {
+        DotStream << "\tstate_" << Machine.name(S) << "[label=\"" << Machine.name(S) << "\"];\n";
+        for (auto E = Machine.edgeBegin(S); E < Machine.edgeEnd(S); ++E) {
+            DotStream << "\tstate_" << Machine.name(S) << "->state_" << Machine.name(Machine.target(E))
+                      << "[label=\"" << Z3::to_string(Machine.guard(Machine.guardOf(E))) << "\"];\n";
+        }
+        DotStream << "\n";
+    }
+    DotStream << "}\n";
+    return DotStream;
+}
@@ -1,10 +1,35 @@
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Debug.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include "BNF/FSM.h"
+#include "BNF/GuardIndex.h"
 #include "Support/Z3.h"
 
 #define DEBUG_TYPE "FSM"
 
+static cl::opt<unsigned> FSMThreads("pardiff-fsm-threads",
+                                    cl::desc("the number of threads computing the guards of an FSM, 0 means one per core"),
+                                    cl::init(1));
+
+static cl::opt<bool> FSMMergeStates("pardiff-fsm-merge-states",
+                                    cl::desc("merge the FSM states with the same guards to the same states after "
+                                             "merging the sibling nodes"),
+                                    cl::init(true));
+
+static cl::opt<unsigned> BisimThreads("pardiff-bisim-threads",
+                                      cl::desc("the number of threads comparing two FSMs, 0 means one per core"),
+                                      cl::init(1));
+
 // Initialize static member variable
 int FSMnode::nextID = 0;
 
@@ -38,14 +63,52 @@ void FSM::connectFSM(FSMRef fsm){
 
 
 void FSM::simplify(){//start from the entry node, combine the edges with the equivalent constraints and start node
-    simplify_node(Entry);
+    GuardIndex Guards;
+    // a node is simplified once, unless merging its siblings adds transitions to it later
+    std::unordered_set<const FSMnode *> Done;
+    std::vector<FSMnodeRef> Worklist = {Entry};
+    unsigned NumSimplified = 0;
+    unsigned NumMerged = 0;
+    while (!Worklist.empty()) {
+        auto N = Worklist.back();
+        Worklist.pop_back();
+        if (!Done.insert(N.get()).second) continue;
+        ++NumSimplified;
+        std::vector<FSMnodeRef> Grown;
+        NumMerged += simplify_node(N, Guards, Grown);
+        for (auto &G: Grown) Done.erase(G.get());
+        // pushed in reverse, so that the children are simplified depth-first in the order of the transitions
+        for (auto It = N->transition.rbegin(); It != N->transition.rend(); ++It) Worklist.push_back(It->first);
+    }
+    unsigned NumStates = FSMMergeStates ? merge_states(Guards) : 0;
+    errs() << "FSM simplify: " << NumSimplified << " nodes simplified, " << NumMerged << " sibling nodes merged, "
+           << NumStates << " states merged\n";
+    Guards.report("FSM simplify");
 }
 
+/// the guards are encoded once per scope, keyed by their ids
+static z3::expr proxyOf(std::map<unsigned, z3::expr> &proxies, const z3::expr &C){
+    auto It = proxies.find(Z3::id(C));
+    if(It == proxies.end())
+        It = proxies.insert({Z3::id(C), Z3Solver::proxy(C)}).first;
+    return It->second;
+}
+
+/// the solver fallback of GuardIndex::equal, which compares the guards by their proxies
+static bool solveByProxies(std::map<unsigned, z3::expr> &proxies, const z3::expr &C1, const z3::expr &C2){
+    return !Z3Solver::checkIncremental(proxyOf(proxies, C1) != proxyOf(proxies, C2));
+}
 
-void FSM::simplify_node(FSMnodeRef node){//start from node, combine the edges with the equivalent constraints and start node
+unsigned FSM::simplify_node(FSMnodeRef node, GuardIndex &Guards, std::vector<FSMnodeRef> &Grown){//combine the children of node reached by the equivalent constraints
     //step one: find equal state to merge:
     std::set<FSMnodeRef> delete_set;
-    std::map<FSMnodeRef, z3::expr>::iterator it, it1;
+    FSMnode::TransitionMap::iterator it, it1;
+    //the guards equal by the index are merged without the solver, the others are compared by their proxies
+    Z3Solver::push();
+    std::map<unsigned, z3::expr> proxies;
+    auto solve = [&proxies](const z3::expr &C1, const z3::expr &C2){
+        return solveByProxies(proxies, C1, C2);
+    };
     for (it = node->transition.begin(); it != node->transition.end(); ++it){
         it1 = it;
         it1++;
@@ -56,24 +119,97 @@ void FSM::simplify_node(FSMnodeRef node){//start from node, combine the edges wi
                 continue;
             if(delete_set.count(it1->first))
                 continue;
-            z3::expr F1 = it->second;
-            z3::expr F2 = it1->second;
-            if(Z3Solver::check(F1!=F2)==z3::unsat){
+            if(Guards.equal(it->second, it1->second, solve)){
                //merge_set[child.first].insert(child1.first);
                merge_node(it->first, it1->first);
                delete_set.insert(it1->first);
+               Grown.push_back(it->first);
             }
         }
     }
+    Z3Solver::pop();
     for(auto N: delete_set){
         deleteNode(N);
         node->deleteTransition(N);    
     }
+    return delete_set.size();
+}
 
-    //step two: recursively simplify_node
-    for(auto& child: node->transition) {
-        simplify_node(child.first);
-    } 
+unsigned FSM::merge_states(GuardIndex &Guards){
+    // the reachable nodes in post order, a transition to a node still on the stack closes a cycle
+    enum { Unvisited, Visiting, Visited };
+    std::unordered_map<const FSMnode *, unsigned> States;
+    std::vector<FSMnodeRef> Post;
+    std::vector<std::pair<FSMnodeRef, FSMnode::TransitionMap::iterator>> Stack;
+    States[Entry.get()] = Visiting;
+    Stack.emplace_back(Entry, Entry->transition.begin());
+    while (!Stack.empty()) {
+        auto &Top = Stack.back();
+        if (Top.second == Top.first->transition.end()) {
+            States[Top.first.get()] = Visited;
+            Post.push_back(Top.first);
+            Stack.pop_back();
+            continue;
+        }
+        auto Child = (Top.second++)->first;
+        auto &State = States[Child.get()];
+        if (State != Unvisited) continue;
+        State = Visiting;
+        Stack.emplace_back(Child, Child->transition.begin());
+    }
+
+    // bottom-up, a node is merged into the first node with the same guards to the same classes of nodes,
+    // and a node reaching a node not classified yet, i.e., on a cycle, stays in a class of its own
+    typedef std::vector<std::pair<unsigned, unsigned>> Signature;
+    std::unordered_map<const FSMnode *, unsigned> ClassOf;
+    std::vector<FSMnodeRef> Reps;
+    std::map<Signature, unsigned> Classes;
+    for (auto &N: Post) {
+        Signature Sig;
+        bool Unique = false;
+        for (auto &T: N->transition) {
+            auto It = ClassOf.find(T.first.get());
+            if (It == ClassOf.end()) {
+                Unique = true;
+                break;
+            }
+            Sig.emplace_back(It->second, Z3::id(Guards.canonical(T.second)));
+        }
+        if (!Unique) {
+            std::sort(Sig.begin(), Sig.end());
+            Sig.emplace_back(UINT_MAX, Exits.count(N));
+            auto It = Classes.emplace(std::move(Sig), Reps.size());
+            if (!It.second) {
+                ClassOf[N.get()] = It.first->second;
+                continue;
+            }
+        }
+        ClassOf[N.get()] = Reps.size();
+        Reps.push_back(N);
+    }
+
+    // redirect the transitions to the representatives, the guards to the same representative are joined
+    // in the order of their ids, so that the joined guard does not depend on the order of the nodes in memory
+    for (auto &R: Reps) {
+        std::map<FSMnodeRef, std::vector<z3::expr>, FSMnodeLess> Joined;
+        for (auto &T: R->transition) Joined[Reps[ClassOf.at(T.first.get())]].push_back(T.second);
+        R->transition.clear();
+        for (auto &J: Joined) {
+            auto &Vec = J.second;
+            std::sort(Vec.begin(), Vec.end(), Z3::less_than());
+            auto Guard = Vec[0];
+            for (unsigned K = 1; K < Vec.size(); ++K) Guard = Guard || Vec[K];
+            R->addTransition(J.first, Guard);
+        }
+    }
+    for (auto &N: Post) {
+        auto &R = Reps[ClassOf.at(N.get())];
+        if (R == N) continue;
+        deleteNode(N);
+        deleteexit(N);
+    }
+    Entry = Reps[ClassOf.at(Entry.get())];
+    return Post.size() - Reps.size();
 }
 
 
@@ -85,42 +221,261 @@ void FSM::merge_node(FSMnodeRef N1, FSMnodeRef N2){//merge N2 -> N1
 }
 
 
-FSMRef FSM::getFSMfromProduction(Product *P){
+FSMRef FSM::clone() const{
+    FSMRef Ret = std::make_shared<FSM>();
+    std::unordered_map<const FSMnode *, FSMnodeRef> Clones;
+    std::vector<const FSMnode *> Worklist;
+    auto CloneOf = [&Clones, &Worklist](const FSMnodeRef &N) -> FSMnodeRef {
+        auto It = Clones.find(N.get());
+        if (It != Clones.end()) return It->second;
+        FSMnodeRef C = std::make_shared<FSMnode>();
+        Clones.emplace(N.get(), C);
+        Worklist.push_back(N.get());
+        return C;
+    };
+    if (Entry) Ret->Entry = CloneOf(Entry);
+    for (auto &N: allNodes) Ret->allNodes.insert(CloneOf(N));
+    for (auto &N: Exits) Ret->Exits.insert(CloneOf(N));
+    // the guards are shared, only the nodes reachable by the transitions are copied
+    while (!Worklist.empty()) {
+        auto *N = Worklist.back();
+        Worklist.pop_back();
+        FSMnodeRef C = Clones.at(N);
+        for (auto &T: N->transition) C->addTransition(CloneOf(T.first), T.second);
+    }
+    return Ret;
+}
+
+
+FSMRef combineFSM(std::set<FSMRef> v){
     FSMRef f = std::make_shared<FSM>();
-    if(P->getRHS().size()==1){// conjunction: B[..]L[]B[..]L[] or B[..]B[..]
-        auto Conj = P->getRHS().front();
-        for(unsigned J = 0; J < Conj.size(); ++J){
-            auto *Item = Conj[J];
-            if(auto *IItem = dyn_cast<Interval>(Item)){
-                f->connectFSM(getFSMfromIndexRange(IItem->getFrom(), IItem->getTo(), P));
+    FSMnodeRef start_node = std::make_shared<FSMnode>();//new a start entry node
+    f->addnode(start_node);
+    f->setentry(start_node);
+    for(FSMRef fsm: v){
+        for(const auto &entry : fsm->Entry->transition) {
+            start_node->addTransition(entry);
+        }
+        for(auto &exit: fsm->Exits){
+            f->addexit(exit);
+        }
+        f->allNodes.insert(fsm->allNodes.begin(), fsm->allNodes.end());
+        f->deleteNode(fsm->Entry);
+        //no need to add the other transitions in fsm into the original fsm because transition is static
+    }
+    return f;
+}
+
+
+/// the guard of the byte at a bound, i.e., the conjunction of the assertions on the byte
+static z3::expr guardOf(const BoundRef &B, const z3::expr_vector &Assertions){
+    return z3::mk_and(Bound::getexprwithIndex(B, Assertions)).simplify();
+}
+
+FSMRef getFSMfromIndex(BoundRef B, Product *P, z3::expr result){
+    FSMRef PFSM = std::make_shared<FSM>();
+    FSMnodeRef start_node = std::make_shared<FSMnode>();
+    FSMnodeRef end_node = std::make_shared<FSMnode>();
+    PFSM->addnode(start_node);
+    PFSM->addnode(end_node);
+    PFSM->setentry(start_node);
+    PFSM->addexit(end_node); 
+    // for(auto e: P->getAssertions()){
+    //     errs()<<e<<"\n";
+    // }
+    start_node->addTransition(end_node, result);
+    return PFSM;
+
+}
+
+
+namespace {
+/// the guards of the ends of the intervals in the products reachable from some products
+///
+/// the ends are collected before the FSM is built, and the guards of a product are a task. the tasks run in
+/// several threads, each thread has its own z3 session holding a copy of the assertions and bounds, and
+/// the guards are translated back into the current session after all the threads finish
+class IntervalGuards {
+    struct End {
+        Product *P;
+        BoundRef B;
+    };
+
+    struct Worker {
+        std::unique_ptr<Z3Session> Session;
+        std::vector<z3::expr> Exprs; // the exprs of the tasks in the context of the session
+        std::vector<std::pair<unsigned, z3::expr>> Results; // the index of an end and its guard
+        std::exception_ptr Error;
+    };
+
+    std::vector<End> Ends;
+
+    /// the index of an end in Ends, keyed by the interval and whether it is the upper end
+    std::map<std::pair<const Interval *, bool>, unsigned> EndIDs;
+
+    /// a product and the ends of its intervals, in the order the products are visited
+    std::vector<std::pair<Product *, std::vector<unsigned>>> Tasks;
+
+    std::vector<z3::expr> Guards;
+
+public:
+    IntervalGuards(const std::vector<Product *> &Roots, unsigned NumThreads) {
+        std::set<Product *> Visited;
+        for (auto *P: Roots) collect(P, Visited);
+        Guards.assign(Ends.size(), Z3::bool_val(true));
+        if (NumThreads > 1 && Tasks.size() > 1) {
+            runInParallel(NumThreads);
+            return;
+        }
+        for (auto &Task: Tasks) {
+            auto Assertions = Task.first->getAssertions();
+            for (auto ID: Task.second) Guards[ID] = guardOf(Ends[ID].B, Assertions);
+        }
+    }
+
+    /// the guard of an end of an interval, or null if the upper end is the lower one
+    const z3::expr *guard(const Interval *I, bool Upper) const {
+        auto It = EndIDs.find({I, Upper});
+        return It == EndIDs.end() ? nullptr : &Guards[It->second];
+    }
+
+private:
+    void collect(Product *P, std::set<Product *> &Visited) {
+        if (!Visited.insert(P).second) return;
+        auto RHS = P->getRHS();
+        if (RHS.size() != 1) {
+            for (auto &Conjunction: RHS) {
+                if (auto *PItem = dyn_cast<Product>(Conjunction[0])) collect(PItem, Visited);
             }
-            else if(auto *PItem = dyn_cast<Product>(Item)){
-                FSMRef PFSM = FSM::getFSMfromProduction(PItem);              
-                f->connectFSM(PFSM);
+            return;
+        }
+        std::vector<unsigned> IDs;
+        for (auto *Item: RHS.front()) {
+            if (auto *IItem = dyn_cast<Interval>(Item)) {
+                IDs.push_back(end(IItem, false, P, IItem->getFrom()));
+                if (IItem->getFrom() != IItem->getTo()) IDs.push_back(end(IItem, true, P, IItem->getTo()));
+            } else if (auto *PItem = dyn_cast<Product>(Item)) {
+                collect(PItem, Visited);
             }
+        }
+        if (!IDs.empty()) Tasks.emplace_back(P, std::move(IDs));
+    }
 
-       }
-       return f;
+    unsigned end(const Interval *I, bool Upper, Product *P, const BoundRef &B) {
+        EndIDs.emplace(std::make_pair(I, Upper), Ends.size());
+        Ends.push_back({P, B});
+        return Ends.size() - 1;
     }
 
-    else{// disjunction: L | L | L | ...
-        std::set<FSMRef> VFSM;
-        for (auto &Conjunction: P->getRHS()){// |
-            auto *Item = Conjunction[0];
-            FSMRef PFSM = FSM::getFSMfromRHS(Item);
-            VFSM.insert(PFSM);
+    void runInParallel(unsigned NumThreads) {
+        // collect the exprs the tasks need, so that they are translated for a thread at once
+        std::vector<z3::expr> Exprs;
+        std::unordered_map<unsigned, unsigned> PosMap;
+        auto Pos = [&Exprs, &PosMap](const z3::expr &E) -> unsigned {
+            auto It = PosMap.find(Z3::id(E));
+            if (It != PosMap.end()) return It->second;
+            PosMap[Z3::id(E)] = Exprs.size();
+            Exprs.push_back(E);
+            return Exprs.size() - 1;
+        };
+        std::vector<std::vector<unsigned>> AssertionPos(Tasks.size());
+        std::vector<unsigned> BoundPos(Ends.size(), UINT_MAX);
+        for (unsigned K = 0; K < Tasks.size(); ++K) {
+            for (auto E: Tasks[K].first->getAssertions()) AssertionPos[K].push_back(Pos(E));
+            for (auto ID: Tasks[K].second) {
+                if (isa<SymbolicBound>(Ends[ID].B.get())) BoundPos[ID] = Pos(Ends[ID].B->expr());
+            }
+        }
+
+        std::vector<std::unique_ptr<Worker>> Workers;
+        for (unsigned I = 0; I < std::min<size_t>(NumThreads, Tasks.size()); ++I) {
+            Workers.emplace_back(new Worker);
+            auto &W = *Workers.back();
+            W.Session = std::make_unique<Z3Session>(&Z3Session::current());
+            Z3::translate(Exprs, *W.Session, W.Exprs);
+        }
+
+        // the products with the most assertions go first, so that the threads finish at about the same time
+        std::vector<unsigned> Order(Tasks.size());
+        for (unsigned K = 0; K < Order.size(); ++K) Order[K] = K;
+        std::stable_sort(Order.begin(), Order.end(), [&AssertionPos](unsigned X, unsigned Y) {
+            return AssertionPos[X].size() > AssertionPos[Y].size();
+        });
+
+        std::atomic<unsigned> Next{0};
+        auto Work = [this, &Order, &Next, &AssertionPos, &BoundPos](Worker &W) {
+            Z3Session::Scope EnterSession(*W.Session);
+            try {
+                for (unsigned K = Next++; K < Order.size(); K = Next++) {
+                    z3::expr_vector Assertions = Z3::vec();
+                    for (auto P: AssertionPos[Order[K]]) Assertions.push_back(W.Exprs[P]);
+                    for (auto ID: Tasks[Order[K]].second) {
+                        auto B = BoundPos[ID] == UINT_MAX ? Ends[ID].B : Bound::createBound(W.Exprs[BoundPos[ID]]);
+                        W.Results.emplace_back(ID, guardOf(B, Assertions));
+                    }
+                }
+            } catch (...) {
+                W.Error = std::current_exception();
+            }
+        };
+        std::vector<std::thread> Threads;
+        for (unsigned I = 1; I < Workers.size(); ++I) Threads.emplace_back(Work, std::ref(*Workers[I]));
+        Work(*Workers[0]);
+        for (auto &T: Threads) T.join();
+        for (auto &W: Workers) {
+            if (W->Error) std::rethrow_exception(W->Error);
+        }
+
+        for (auto &W: Workers) {
+            std::vector<z3::expr> Results, Translated;
+            for (auto &R: W->Results) Results.push_back(R.second);
+            Z3::translate(Results, Z3Session::current(), Translated);
+            for (unsigned I = 0; I < Translated.size(); ++I) Guards[W->Results[I].first] = Translated[I];
         }
-        f = combineFSM(VFSM);
-        return f;
     }
-    
+};
+} // namespace
+
+static unsigned numFSMThreads(){
+    return FSMThreads ? FSMThreads : std::max(1u, std::thread::hardware_concurrency());
 }
 
+namespace {
+/// the FSM built for each product referenced more than once, a later reference gets a clone of it
+/// instead of rebuilding it
+struct ProductTemplates {
+    /// the number of references to each product reachable from the roots
+    std::unordered_map<const Product *, unsigned> NumRefs;
+    std::unordered_map<const Product *, FSMRef> FSMs;
+    unsigned NumCloned = 0;
+
+    explicit ProductTemplates(const std::vector<Product *> &Roots) {
+        for (auto *P: Roots) count(P);
+    }
 
-FSMRef FSM::getFSMfromRHS(RHSItem *Item){ //Interval or Product
+    void count(Product *P) {
+        if (NumRefs[P]++) return;
+        auto RHS = P->getRHS();
+        for (auto &Conjunction: RHS) {
+            for (auto *Item: Conjunction) {
+                if (auto *PItem = dyn_cast<Product>(Item)) count(PItem);
+            }
+        }
+    }
+
+    void report() const {
+        errs() << "FSM templates: " << NumRefs.size() << " products built, " << FSMs.size() << " kept as templates, "
+               << NumCloned << " references cloned\n";
+    }
+};
+} // namespace
+
+static FSMRef getFSMfromProduction(Product *P, const IntervalGuards &Guards, ProductTemplates &Templates);
+
+static FSMRef getFSMfromRHS(RHSItem *Item, const IntervalGuards &Guards, ProductTemplates &Templates){ //Interval or Product
     FSMRef PFSM;
     if(auto *PItem = dyn_cast<Product>(Item)){
-        PFSM = FSM::getFSMfromProduction(PItem);
+        PFSM = getFSMfromProduction(PItem, Guards, Templates);
     }
     else{
         llvm_unreachable("Error : not Product!");
@@ -134,37 +489,18 @@ FSMRef FSM::getFSMfromRHS(RHSItem *Item){ //Interval or Product
     return PFSM;
 }
 
-
-FSMRef combineFSM(std::set<FSMRef> v){
-    FSMRef f = std::make_shared<FSM>();
-    FSMnodeRef start_node = std::make_shared<FSMnode>();//new a start entry node
-    f->addnode(start_node);
-    f->setentry(start_node);
-    for(FSMRef fsm: v){
-        for(const auto &entry : fsm->Entry->transition) {
-            start_node->addTransition(entry);
-        }
-        for(auto &exit: fsm->Exits){
-            f->addexit(exit);
-        }
-        f->allNodes.insert(fsm->allNodes.begin(), fsm->allNodes.end());
-        f->deleteNode(fsm->Entry);
-        //no need to add the other transitions in fsm into the original fsm because transition is static
-    }
-    return f;
-}
-
-
-FSMRef getFSMfromIndexRange(BoundRef From, BoundRef To, Product *P){
+static FSMRef getFSMfromIndexRange(Interval *I, Product *P, const IntervalGuards &Guards){
     FSMRef PFSM = std::make_shared<FSM>();
+    auto From = I->getFrom();
+    auto To = I->getTo();
     errs()<<"from: "<<From<<"->to: "<<To<<"\n";
-    z3::expr result = z3::mk_and(Bound::getexprwithIndex(From, P->getAssertions())).simplify();      
+    const z3::expr &result = *Guards.guard(I, false);
     if(!result.is_true()){
         errs()<<result<<"\n";
         PFSM->connectFSM(getFSMfromIndex(From, P,result));
     }
-    if(From!=To){
-        z3::expr result = z3::mk_and(Bound::getexprwithIndex(To, P->getAssertions())).simplify();      
+    if(auto *ToResult = Guards.guard(I, true)){
+        const z3::expr &result = *ToResult;
         if(!result.is_true()){
             errs()<<result<<"\n";
             PFSM->connectFSM(getFSMfromIndex(To, P,result));
@@ -173,97 +509,310 @@ FSMRef getFSMfromIndexRange(BoundRef From, BoundRef To, Product *P){
     return PFSM;
 }
 
-FSMRef getFSMfromIndex(BoundRef B, Product *P, z3::expr result){
-    FSMRef PFSM = std::make_shared<FSM>();
-    FSMnodeRef start_node = std::make_shared<FSMnode>();
-    FSMnodeRef end_node = std::make_shared<FSMnode>();
-    PFSM->addnode(start_node);
-    PFSM->addnode(end_node);
-    PFSM->setentry(start_node);
-    PFSM->addexit(end_node); 
-    // for(auto e: P->getAssertions()){
-    //     errs()<<e<<"\n";
-    // }
-    start_node->addTransition(end_node, result);
-    return PFSM;
+static FSMRef buildFSMfromProduction(Product *P, const IntervalGuards &Guards, ProductTemplates &Templates){
+    FSMRef f = std::make_shared<FSM>();
+    if(P->getRHS().size()==1){// conjunction: B[..]L[]B[..]L[] or B[..]B[..]
+        auto Conj = P->getRHS().front();
+        for(unsigned J = 0; J < Conj.size(); ++J){
+            auto *Item = Conj[J];
+            if(auto *IItem = dyn_cast<Interval>(Item)){
+                f->connectFSM(getFSMfromIndexRange(IItem, P, Guards));
+            }
+            else if(auto *PItem = dyn_cast<Product>(Item)){
+                FSMRef PFSM = getFSMfromProduction(PItem, Guards, Templates);              
+                f->connectFSM(PFSM);
+            }
+
+       }
+       return f;
+    }
 
+    else{// disjunction: L | L | L | ...
+        std::set<FSMRef> VFSM;
+        for (auto &Conjunction: P->getRHS()){// |
+            auto *Item = Conjunction[0];
+            FSMRef PFSM = getFSMfromRHS(Item, Guards, Templates);
+            VFSM.insert(PFSM);
+        }
+        f = combineFSM(VFSM);
+        return f;
+    }
+    
+}
+
+/// the connections mutate the FSM of a product, so the template is a clone kept aside before the first
+/// reference gets the FSM
+static FSMRef getFSMfromProduction(Product *P, const IntervalGuards &Guards, ProductTemplates &Templates){
+    auto It = Templates.FSMs.find(P);
+    if(It != Templates.FSMs.end()){
+        ++Templates.NumCloned;
+        return It->second->clone();
+    }
+    FSMRef f = buildFSMfromProduction(P, Guards, Templates);
+    if(Templates.NumRefs[P] > 1){
+        Templates.FSMs.emplace(P, f->clone());
+    }
+    return f;
+}
+
+FSMRef FSM::getFSMfromProduction(Product *P){
+    IntervalGuards Guards({P}, numFSMThreads());
+    ProductTemplates Templates({P});
+    return ::getFSMfromProduction(P, Guards, Templates);
+}
+
+
+FSMRef FSM::getFSMfromRHS(RHSItem *Item){ //Interval or Product
+    std::vector<Product *> Roots;
+    if(auto *PItem = dyn_cast<Product>(Item)) Roots.push_back(PItem);
+    IntervalGuards Guards(Roots, numFSMThreads());
+    ProductTemplates Templates(Roots);
+    return ::getFSMfromRHS(Item, Guards, Templates);
 }
 
 
 FSMRef FSM::getFSM(BNFRef B){
     std::set<FSMRef> v;
     errs()<<"product size: "<<(B->Products).size()<<"\n";
+    std::vector<Product *> Roots;
     for(auto *P: B->Products){
         if(!(P->getLHS())){
-            v.insert(FSM::getFSMfromProduction(P));
+            Roots.push_back(P);
         }
     }
+    IntervalGuards Guards(Roots, numFSMThreads());
+    ProductTemplates Templates(Roots);
+    for(auto *P: Roots){
+        v.insert(::getFSMfromProduction(P, Guards, Templates));
+    }
+    Templates.report();
     assert(v.size()==1);//shouldn't have more than one start in our defined BNF
     return *(v.begin());
 }
 
 
+CompactFSMRef FSM::freeze() const{
+    return std::make_shared<CompactFSM>(Entry.get(), Exits);
+}
+
 void bisimulation(FSMRef f1, FSMRef f2){
     bisimulation(f1, f2, f1->Entry, f2->Entry);
 }
 
-void bisimulation(FSMRef f1, FSMRef f2, FSMnodeRef n1, FSMnodeRef n2){
-    //TODO
-    std::set<FSMnodeRef> child_set;
-    std::vector<std::pair<FSMnodeRef, FSMnodeRef>> bisim_pair;
-    z3::expr_vector diff1 = Z3::vec();
-    z3::expr_vector diff2 = Z3::vec();
-    errs()<<"start new group:\n";
-    for (const auto& child1: n1->transition){
-        z3::expr x1 = child1.second;
-        bool flag = false;
-        for (const auto& child2: n2->transition){      
-            z3::expr x2 = child2.second;
-            if(Z3Solver::check(x1 != x2) == z3::unsat) {//find the same transition, continue to compare
-                flag = true;
-                child_set.insert(child2.first);
-                bisim_pair.push_back(std::make_pair(child1.first, child2.first));
-                //bisimulation(f1, f2, child1.first, child2.first);//continue to compare
-                break;
+namespace {
+/// a state of the first FSM and a state of the second
+typedef std::pair<uint32_t, uint32_t> NodePair;
+
+/// what comparing a pair of nodes finds, the transitions are recorded by their positions among the edges of the nodes
+struct BisimResult {
+    std::vector<unsigned> Only1; // transitions of the first node having no equal transition in the second
+    std::vector<unsigned> Only2; // transitions of the second node having no equal transition in the first
+    std::vector<NodePair> Matched; // children reached by equal transitions, in the order they are found
+};
+
+/// compares the pairs of nodes in several threads, each thread has its own z3 session holding a copy
+/// of the guard tables, and steals pairs from the others when its own queue is empty
+///
+/// every pair is compared once, the report is printed afterwards by replaying the depth-first order
+/// of the sequential algorithm, so that it does not depend on the number of threads
+class BisimScheduler {
+    struct Worker {
+        std::unique_ptr<Z3Session> Session; // null for the calling thread, which uses the current session
+        std::vector<z3::expr> Guards1; // the guard tables in the context of the session
+        std::vector<z3::expr> Guards2;
+        GuardIndex Index;
+        std::deque<NodePair> Queue;
+        std::mutex QueueMutex;
+        std::exception_ptr Error;
+    };
+
+    std::vector<std::unique_ptr<Worker>> Workers;
+
+    const CompactFSM &F1;
+    const CompactFSM &F2;
+
+    std::mutex ResultMutex;
+    std::map<NodePair, BisimResult> Results;
+
+    /// an idle worker waits until a pair is queued, all the pairs are compared, or a worker fails
+    std::mutex WaitMutex;
+    std::condition_variable Wakeup;
+    unsigned Pending = 0; // the number of pairs claimed but not compared yet
+    unsigned Queued = 0; // the number of pairs in the queues
+    bool Stopped = false;
+
+public:
+    BisimScheduler(const CompactFSM &F1, const CompactFSM &F2, unsigned NumThreads) : F1(F1), F2(F2) {
+        for (unsigned I = 0; I < NumThreads; ++I) {
+            Workers.emplace_back(new Worker);
+            auto &W = *Workers.back();
+            if (I == 0) {
+                W.Guards1 = F1.guards();
+                W.Guards2 = F2.guards();
+            } else {
+                W.Session = std::make_unique<Z3Session>(&Z3Session::current());
+                Z3::translate(F1.guards(), *W.Session, W.Guards1);
+                Z3::translate(F2.guards(), *W.Session, W.Guards2);
             }
-        }       
-            if(!flag && (Z3Solver::check(x1) == z3::sat)){
-            
-            errs()<<"diff: in F1 not in F2:  while compair "<<"state_"<<n1->id()<<" and state_"<< n2->id()<< ": state_" << n1->id() << " -> state_"<<child1.first->id()<<":"<<x1 <<"\n";
-            diff1.push_back(x1);
         }
+        claim({CompactFSM::Entry, CompactFSM::Entry}, 0);
     }
-    for (const auto& child: n2->transition){
-        if(!child_set.count(child.first) && (Z3Solver::check(child.second) == z3::sat)){
-            
-            errs()<<"diff: in F2 not in F1:  while compair "<<"state_"<<n1->id()<<" and state_"<< n2->id()<< ": state_" << n2->id()<< " -> state_"<<child.first->id()<<":"<<child.second<<"\n";
-            diff2.push_back(child.second);
+
+    void run() {
+        std::vector<std::thread> Threads;
+        for (unsigned I = 1; I < Workers.size(); ++I) {
+            Threads.emplace_back([this, I]() {
+                Z3Session::Scope EnterSession(*Workers[I]->Session);
+                work(I);
+            });
         }
+        work(0);
+        for (auto &T: Threads) T.join();
+        for (auto &W: Workers) {
+            if (W->Error) std::rethrow_exception(W->Error);
+        }
+        for (auto &W: Workers) W->Index.report("FSM diff");
     }
-    for(auto &pair: bisim_pair){
-        bisimulation(f1, f2, pair.first, pair.second);
+
+    void report(const NodePair &P) {
+        auto N1 = F1.name(P.first);
+        auto N2 = F2.name(P.second);
+        auto &R = Results.at(P);
+        errs()<<"start new group:\n";
+        for (auto K: R.Only1){
+            auto E = F1.edgeBegin(P.first) + K;
+            errs()<<"diff: in F1 not in F2:  while compair "<<"state_"<<N1<<" and state_"<< N2<< ": state_" << N1 << " -> state_"<<F1.name(F1.target(E))<<":"<<F1.guard(F1.guardOf(E)) <<"\n";
+        }
+        for (auto K: R.Only2){
+            auto E = F2.edgeBegin(P.second) + K;
+            errs()<<"diff: in F2 not in F1:  while compair "<<"state_"<<N1<<" and state_"<< N2<< ": state_" << N2<< " -> state_"<<F2.name(F2.target(E))<<":"<<F2.guard(F2.guardOf(E))<<"\n";
+        }
+        for (auto &Pair: R.Matched) report(Pair);
     }
-    //errs()<<"end new group:\n";
-    //similarity(diff1, diff2);
-}
 
-raw_ostream &operator<<(raw_ostream &DotStream, const FSMRef &Machine) {
-    auto DotState = [](FSMnodeRef State, raw_ostream &OS) {
-        OS << "\tstate_" << State->id() << "[label=\"" << State->id() << "\"];\n";
-        for (auto Ch: State->transition) {
-            OS << "\tstate_" << State->id() << "->state_" << Ch.first->id()
-               << "[label=\"" << Z3::to_string(Ch.second) << "\"];\n";
+private:
+    void claim(const NodePair &P, unsigned I) {
+        {
+            std::lock_guard<std::mutex> Lock(ResultMutex);
+            if (!Results.emplace(P, BisimResult()).second) return;
         }
-        OS << "\n";
-    };
+        {
+            std::lock_guard<std::mutex> Wait(WaitMutex);
+            std::lock_guard<std::mutex> Lock(Workers[I]->QueueMutex);
+            Workers[I]->Queue.push_back(P);
+            ++Pending;
+            ++Queued;
+        }
+        Wakeup.notify_one();
+    }
+
+    bool take(unsigned I, NodePair &P) {
+        // the newest pair of its own, or the oldest pair of another worker
+        bool Taken = false;
+        for (unsigned J = 0; J < Workers.size() && !Taken; ++J) {
+            auto &W = *Workers[(I + J) % Workers.size()];
+            std::lock_guard<std::mutex> Lock(W.QueueMutex);
+            if (W.Queue.empty()) continue;
+            if (J == 0) {
+                P = W.Queue.back();
+                W.Queue.pop_back();
+            } else {
+                P = W.Queue.front();
+                W.Queue.pop_front();
+            }
+            Taken = true;
+        }
+        // the wait mutex is always locked before a queue mutex
+        if (Taken) {
+            std::lock_guard<std::mutex> Wait(WaitMutex);
+            --Queued;
+        }
+        return Taken;
+    }
+
+    void work(unsigned I) {
+        try {
+            NodePair P;
+            while (true) {
+                if (!take(I, P)) {
+                    std::unique_lock<std::mutex> Wait(WaitMutex);
+                    Wakeup.wait(Wait, [this]() { return !Pending || Stopped || Queued; });
+                    if (!Pending || Stopped) return;
+                    continue;
+                }
+                compare(I, P);
+                std::lock_guard<std::mutex> Wait(WaitMutex);
+                if (--Pending == 0) Wakeup.notify_all();
+                if (Stopped) return;
+            }
+        } catch (...) {
+            Workers[I]->Error = std::current_exception();
+            std::lock_guard<std::mutex> Wait(WaitMutex);
+            Stopped = true;
+            Wakeup.notify_all();
+        }
+    }
+
+    void compare(unsigned I, const NodePair &P) {
+        auto &Guards1 = Workers[I]->Guards1;
+        auto &Guards2 = Workers[I]->Guards2;
+        auto Begin1 = F1.edgeBegin(P.first), End1 = F1.edgeEnd(P.first);
+        auto Begin2 = F2.edgeBegin(P.second), End2 = F2.edgeEnd(P.second);
+        BisimResult R;
+        std::vector<bool> Matched2(End2 - Begin2, false);
+
+        //the guards equal by the index are matched without the solver, the others are compared by their proxies
+        auto &Index = Workers[I]->Index;
+        Z3Solver::push();
+        std::map<unsigned, z3::expr> proxies;
+        auto solve = [&proxies](const z3::expr &C1, const z3::expr &C2){
+            return solveByProxies(proxies, C1, C2);
+        };
+        auto feasible = [&proxies](const z3::expr &C){
+            return Z3Solver::checkIncremental(proxyOf(proxies, C));
+        };
+        for (auto E1 = Begin1; E1 < End1; ++E1){
+            auto &x1 = Guards1[F1.guardOf(E1)];
+            bool flag = false;
+            for (auto E2 = Begin2; E2 < End2; ++E2){
+                if(Index.equal(x1, Guards2[F2.guardOf(E2)], solve)) {//find the same transition, continue to compare
+                    flag = true;
+                    Matched2[E2 - Begin2] = true;
+                    R.Matched.emplace_back(F1.target(E1), F2.target(E2));
+                    break;
+                }
+            }
+            if(!flag && Index.feasible(x1, feasible)){
+                R.Only1.push_back(E1 - Begin1);
+            }
+        }
+        for (unsigned K2 = 0; K2 < Matched2.size(); ++K2){
+            if(!Matched2[K2] && Index.feasible(Guards2[F2.guardOf(Begin2 + K2)], feasible)){
+                R.Only2.push_back(K2);
+            }
+        }
+        Z3Solver::pop();
 
-    DotStream << "\n";
-    DotStream << "digraph machine {\n";
-    for (auto &N: Machine->getallNodes()) {
-        DotState(N, DotStream);
+        for (auto &Pair: R.Matched) claim(Pair, I);
+        std::lock_guard<std::mutex> Lock(ResultMutex);
+        Results[P] = std::move(R);
     }
-    DotStream << "}\n";
-    return DotStream;
+};
+} // namespace
+
+void bisimulation(FSMRef f1, FSMRef f2, FSMnodeRef n1, FSMnodeRef n2){
+    bisimulation(CompactFSM(n1.get(), f1->Exits), CompactFSM(n2.get(), f2->Exits));
+}
+
+void bisimulation(const CompactFSM &F1, const CompactFSM &F2){
+    unsigned NumThreads = BisimThreads ? BisimThreads : std::max(1u, std::thread::hardware_concurrency());
+    BisimScheduler Scheduler(F1, F2, NumThreads);
+    Scheduler.run();
+    Scheduler.report({CompactFSM::Entry, CompactFSM::Entry});
+}
+
+raw_ostream &operator<<(raw_ostream &DotStream, const FSMRef &Machine) {
+    return DotStream << *Machine->freeze();
 }
 
 int equal_AndOp( z3::expr_vector AndOps1,  z3::expr_vector AndOps2){
@@ -0,0 +1,417 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <llvm/Support/CommandLine.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "BNF/CompactFSM.h"
+#include "BNF/FSM.h"
+#include "BNF/GuardIndex.h"
+#include "Support/ByteDomain.h"
+#include "Support/Z3.h"
+
+#define DEBUG_TYPE "FSMMinimize"
+
+static cl::opt<unsigned> MintermLimit("pardiff-fsm-minterm-limit",
+                                      cl::desc("the max number of minterms of the outgoing guards of an FSM state, "
+                                               "a state with more minterms is taken as nondeterministic"),
+                                      cl::init(64));
+
+namespace {
+/// the minimization of a compact FSM, which merges the states moving to the same blocks of states on the same messages
+///
+/// the outgoing guards of each state are first split into minterms by the solver, i.e., the satisfiable conjunctions of
+/// the guards and their negations. an edge covering no minterm is infeasible and dropped, and a state is deterministic
+/// if the edges covering a minterm have the same target. an edge to a state reaching no exit is dropped as well, since
+/// no message taking it is accepted.
+///
+/// then the blocks are refined as Hopcroft's algorithm does, starting from the states grouped by whether they are
+/// exits and by their ranks. a block C taken from the worklist splits each block by the predicates, under which its
+/// states move into C, i.e., the disjunctions of their guards to C. if all the states are deterministic, the largest
+/// part of a split block is not put into the worklist, since splitting by the block and the other parts implies
+/// splitting by it; otherwise all the parts are.
+///
+/// the result is the minimal FSM if all the states are deterministic. otherwise it is the quotient by the coarsest
+/// bisimulation, which may keep states accepting the same messages apart.
+class FSMMinimizer {
+    const CompactFSM &F;
+
+    /// the guards are numbered by their canonical forms, Guards keeps the first guard of each number
+    GuardIndex Index;
+    std::vector<z3::expr> Guards;
+    std::vector<z3::expr> Proxies;
+    std::unordered_map<unsigned, unsigned> GuardIDs;
+
+    /// the number of each guard in the guard table of F
+    std::vector<unsigned> GuardOf;
+
+    /// the source of each edge, and the feasible edges to each state
+    std::vector<uint32_t> SourceOf;
+    std::vector<bool> Feasible;
+    std::vector<std::vector<uint32_t>> Preds;
+
+    bool Deterministic = true;
+    unsigned NumMinterms = 0;
+    unsigned NumMintermsByDomain = 0;
+    unsigned NumMintermsBySolver = 0;
+
+    /// the predicates are the sets of guard numbers, the empty set is false
+    std::map<std::vector<unsigned>, unsigned> PredicateIDs;
+    std::vector<std::vector<unsigned>> Predicates;
+    std::map<std::pair<unsigned, unsigned>, bool> EqualPredicates;
+
+    std::vector<unsigned> BlockOf;
+    std::vector<std::vector<uint32_t>> Blocks;
+    std::vector<unsigned> Worklist;
+    std::vector<bool> InWorklist;
+    unsigned NumSplits = 0;
+
+public:
+    explicit FSMMinimizer(const CompactFSM &F) : F(F) {
+        for (auto &G: F.guards()) GuardOf.push_back(guard(G));
+        SourceOf.resize(F.numEdges());
+        Feasible.assign(F.numEdges(), false);
+        Preds.resize(F.numStates());
+        for (uint32_t S = 0; S < F.numStates(); ++S) {
+            for (auto E = F.edgeBegin(S); E < F.edgeEnd(S); ++E) SourceOf[E] = S;
+            minterms(S);
+            for (auto E = F.edgeBegin(S); E < F.edgeEnd(S); ++E) {
+                if (Feasible[E]) Preds[F.target(E)].push_back(E);
+            }
+        }
+        prune();
+    }
+
+    CompactFSMRef minimize() {
+        // the initial blocks group the states by whether they are exits and by their ranks
+        std::vector<unsigned> Ranks;
+        if (!rank(Ranks)) Ranks.assign(F.numStates(), 0);
+        std::map<std::pair<bool, unsigned>, unsigned> Initial;
+        BlockOf.resize(F.numStates());
+        for (uint32_t S = 0; S < F.numStates(); ++S) {
+            auto It = Initial.emplace(std::make_pair(F.exit(S), Ranks[S]), Blocks.size());
+            if (It.second) Blocks.emplace_back();
+            BlockOf[S] = It.first->second;
+            Blocks[BlockOf[S]].push_back(S);
+        }
+        for (unsigned B = 0; B < Blocks.size(); ++B) queue(B);
+
+        while (!Worklist.empty()) {
+            auto C = Worklist.back();
+            Worklist.pop_back();
+            InWorklist[C] = false;
+
+            // the guards of the states moving into C, and the blocks of the states, which may be split
+            std::map<uint32_t, std::vector<unsigned>> Moves;
+            for (auto T: Blocks[C]) {
+                for (auto E: Preds[T]) Moves[SourceOf[E]].push_back(GuardOf[F.guardOf(E)]);
+            }
+            std::set<unsigned> Touched;
+            for (auto &M: Moves) Touched.insert(BlockOf[M.first]);
+            for (auto X: Touched) split(X, Moves);
+        }
+        return build();
+    }
+
+    void report(const CompactFSM &Minimal) const {
+        errs() << "FSM minimize: " << F.numStates() << " states and " << F.numEdges() << " edges to "
+               << Minimal.numStates() << " states and " << Minimal.numEdges() << " edges, " << NumMinterms
+               << " minterms (" << NumMintermsByDomain << " checks by the byte domain, " << NumMintermsBySolver
+               << " by the solver), " << NumSplits << " blocks split" << (Deterministic ? "" : ", nondeterministic")
+               << "\n";
+        Index.report("FSM minimize");
+    }
+
+private:
+    unsigned guard(const z3::expr &E) {
+        auto &Canonical = Index.canonical(E);
+        auto It = GuardIDs.emplace(Z3::id(Canonical), Guards.size());
+        if (It.second) {
+            Guards.push_back(E);
+            Proxies.push_back(Z3Solver::proxy(Canonical));
+        }
+        return It.first->second;
+    }
+
+    /// whether a minterm is satisfiable, it is given by the proxies and by the guards, on which the byte domain
+    /// may decide it without the solver
+    bool satisfiable(const z3::expr &Proxy, const z3::expr &Cond) {
+        auto Decided = ByteDomain(Cond).satisfiable();
+        if (Decided != ByteDomain::Unknown) {
+            ++NumMintermsByDomain;
+            return Decided == ByteDomain::Yes;
+        }
+        ++NumMintermsBySolver;
+        return Z3Solver::checkIncremental(Proxy);
+    }
+
+    /// split the outgoing guards of a state into minterms, each kept with the edges covering it
+    void minterms(uint32_t S) {
+        struct Minterm {
+            z3::expr Proxy;
+            z3::expr Cond;
+            std::vector<uint32_t> Edges;
+        };
+        std::vector<Minterm> Minterms = {{Z3::bool_val(true), Z3::bool_val(true), {}}};
+        std::map<unsigned, uint32_t> FirstEdge;
+        // a minterm negating the last guard and covering no edge before is dropped anyway, it is never checked
+        uint32_t Last = F.edgeBegin(S);
+        for (auto E = F.edgeBegin(S); E < F.edgeEnd(S); ++E) {
+            if (!FirstEdge.count(GuardOf[F.guardOf(E)])) Last = E;
+            FirstEdge.emplace(GuardOf[F.guardOf(E)], E);
+        }
+        FirstEdge.clear();
+        for (auto E = F.edgeBegin(S); E < F.edgeEnd(S); ++E) {
+            auto G = GuardOf[F.guardOf(E)];
+            // an edge with the guard of an earlier edge covers the same minterms
+            auto It = FirstEdge.emplace(G, E);
+            if (!It.second) {
+                for (auto &M: Minterms) {
+                    if (std::count(M.Edges.begin(), M.Edges.end(), It.first->second)) M.Edges.push_back(E);
+                }
+                continue;
+            }
+            std::vector<Minterm> Next;
+            for (auto &M: Minterms) {
+                auto First = M.Proxy.is_true();
+                Minterm In = {First ? Proxies[G] : M.Proxy && Proxies[G], First ? Guards[G] : M.Cond && Guards[G],
+                              M.Edges};
+                // a minterm is satisfiable, so is its conjunction with the negated guard if that with the guard is not
+                if (!satisfiable(In.Proxy, In.Cond)) {
+                    Next.push_back(M);
+                    continue;
+                }
+                In.Edges.push_back(E);
+                Next.push_back(std::move(In));
+                if (E == Last && M.Edges.empty()) continue;
+                Minterm Out = {First ? !Proxies[G] : M.Proxy && !Proxies[G], First ? !Guards[G] : M.Cond && !Guards[G],
+                               M.Edges};
+                if (satisfiable(Out.Proxy, Out.Cond)) Next.push_back(std::move(Out));
+            }
+            if (Next.size() > MintermLimit) {
+                // too many minterms, the edges are only checked for feasibility
+                Deterministic = false;
+                for (auto E1 = F.edgeBegin(S); E1 < F.edgeEnd(S); ++E1) {
+                    auto G1 = GuardOf[F.guardOf(E1)];
+                    Feasible[E1] = Index.feasible(Guards[G1], [&](const z3::expr &) {
+                        return Z3Solver::checkIncremental(Proxies[G1]);
+                    });
+                }
+                return;
+            }
+            Minterms.swap(Next);
+        }
+        for (auto &M: Minterms) {
+            if (M.Edges.empty()) continue;
+            ++NumMinterms;
+            for (auto E: M.Edges) {
+                Feasible[E] = true;
+                if (F.target(E) != F.target(M.Edges[0])) Deterministic = false;
+            }
+        }
+    }
+
+    /// drop the edges to the states reaching no exit, so that these states are left without feasible edges and a
+    /// state moving into one of them is not told apart from a state having no such edge
+    void prune() {
+        std::vector<bool> Live(F.numStates(), false);
+        std::vector<uint32_t> Stack;
+        for (uint32_t S = 0; S < F.numStates(); ++S) {
+            if (F.exit(S)) {
+                Live[S] = true;
+                Stack.push_back(S);
+            }
+        }
+        while (!Stack.empty()) {
+            auto T = Stack.back();
+            Stack.pop_back();
+            for (auto E: Preds[T]) {
+                if (Live[SourceOf[E]]) continue;
+                Live[SourceOf[E]] = true;
+                Stack.push_back(SourceOf[E]);
+            }
+        }
+        for (uint32_t S = 0; S < F.numStates(); ++S) {
+            if (Live[S]) continue;
+            for (auto E: Preds[S]) Feasible[E] = false;
+            Preds[S].clear();
+        }
+    }
+
+    /// the ranks of the states, i.e., the longest distances to a state without feasible edges. after pruning, such a
+    /// state is either an exit or reaches no exit, so equivalent states share their ranks if the FSM is acyclic;
+    /// return false if a cycle is found
+    bool rank(std::vector<unsigned> &Ranks) const {
+        enum { Unvisited, Visiting, Done };
+        std::vector<unsigned> States(F.numStates(), Unvisited);
+        Ranks.assign(F.numStates(), 0);
+        std::vector<std::pair<uint32_t, uint32_t>> Stack;
+        for (uint32_t Root = 0; Root < F.numStates(); ++Root) {
+            if (States[Root] != Unvisited) continue;
+            States[Root] = Visiting;
+            Stack.emplace_back(Root, F.edgeBegin(Root));
+            while (!Stack.empty()) {
+                auto &Top = Stack.back();
+                auto S = Top.first;
+                if (Top.second == F.edgeEnd(S)) {
+                    States[S] = Done;
+                    Stack.pop_back();
+                    if (!Stack.empty()) {
+                        auto P = Stack.back().first;
+                        Ranks[P] = std::max(Ranks[P], Ranks[S] + 1);
+                    }
+                    continue;
+                }
+                auto E = Top.second++;
+                if (!Feasible[E]) continue;
+                auto T = F.target(E);
+                if (States[T] == Visiting) return false;
+                if (States[T] == Done) {
+                    Ranks[S] = std::max(Ranks[S], Ranks[T] + 1);
+                    continue;
+                }
+                States[T] = Visiting;
+                Stack.emplace_back(T, F.edgeBegin(T));
+            }
+        }
+        return true;
+    }
+
+    unsigned predicate(std::vector<unsigned> Gs) {
+        std::sort(Gs.begin(), Gs.end());
+        Gs.erase(std::unique(Gs.begin(), Gs.end()), Gs.end());
+        auto It = PredicateIDs.emplace(Gs, Predicates.size());
+        if (It.second) Predicates.push_back(std::move(Gs));
+        return It.first->second;
+    }
+
+    z3::expr proxyOf(unsigned P) const {
+        auto Result = Proxies[Predicates[P][0]];
+        for (unsigned K = 1; K < Predicates[P].size(); ++K) Result = Result || Proxies[Predicates[P][K]];
+        return Result;
+    }
+
+    bool equal(unsigned P1, unsigned P2) {
+        if (P1 == P2) return true;
+        // a predicate of feasible edges is satisfiable, i.e., not false
+        if (Predicates[P1].empty() || Predicates[P2].empty()) return false;
+        auto It = EqualPredicates.emplace(std::make_pair(std::min(P1, P2), std::max(P1, P2)), false);
+        if (!It.second) return It.first->second;
+        if (Predicates[P1].size() == 1 && Predicates[P2].size() == 1) {
+            auto G1 = Predicates[P1][0], G2 = Predicates[P2][0];
+            It.first->second = Index.equal(Guards[G1], Guards[G2], [&](const z3::expr &, const z3::expr &) {
+                return !Z3Solver::checkIncremental(Proxies[G1] != Proxies[G2]);
+            });
+        } else {
+            It.first->second = !Z3Solver::checkIncremental(proxyOf(P1) != proxyOf(P2));
+        }
+        return It.first->second;
+    }
+
+    void queue(unsigned B) {
+        if (B >= InWorklist.size()) InWorklist.resize(B + 1, false);
+        if (InWorklist[B]) return;
+        InWorklist[B] = true;
+        Worklist.push_back(B);
+    }
+
+    void split(unsigned X, const std::map<uint32_t, std::vector<unsigned>> &Moves) {
+        std::vector<unsigned> Reps;
+        std::vector<std::vector<uint32_t>> Parts;
+        for (auto S: Blocks[X]) {
+            auto It = Moves.find(S);
+            auto P = predicate(It == Moves.end() ? std::vector<unsigned>() : It->second);
+            unsigned K = 0;
+            while (K < Reps.size() && !equal(Reps[K], P)) ++K;
+            if (K == Reps.size()) {
+                Reps.push_back(P);
+                Parts.emplace_back();
+            }
+            Parts[K].push_back(S);
+        }
+        if (Parts.size() == 1) return;
+        ++NumSplits;
+
+        // the largest part keeps the block
+        unsigned Largest = 0;
+        for (unsigned K = 1; K < Parts.size(); ++K) {
+            if (Parts[K].size() > Parts[Largest].size()) Largest = K;
+        }
+        for (unsigned K = 0; K < Parts.size(); ++K) {
+            if (K == Largest) continue;
+            unsigned B = Blocks.size();
+            for (auto S: Parts[K]) BlockOf[S] = B;
+            Blocks.push_back(std::move(Parts[K]));
+            queue(B);
+        }
+        Blocks[X] = std::move(Parts[Largest]);
+        if (!Deterministic) queue(X);
+    }
+
+    /// the first state of a block represents it, the guards of its edges to a block are joined in the order of
+    /// their ids, and the block of the entry becomes the entry
+    CompactFSMRef build() const {
+        std::vector<unsigned> Order = {BlockOf[CompactFSM::Entry]};
+        for (unsigned B = 0; B < Blocks.size(); ++B) {
+            if (B != Order[0]) Order.push_back(B);
+        }
+        std::vector<uint32_t> NewBlock(Blocks.size());
+        for (unsigned K = 0; K < Order.size(); ++K) NewBlock[Order[K]] = K;
+
+        std::vector<std::vector<std::pair<uint32_t, z3::expr>>> Edges(Order.size());
+        std::vector<int> Names;
+        std::vector<bool> Exits;
+        for (unsigned K = 0; K < Order.size(); ++K) {
+            auto Rep = Blocks[Order[K]][0];
+            Names.push_back(F.name(Rep));
+            Exits.push_back(F.exit(Rep));
+            std::map<uint32_t, std::vector<z3::expr>> Joined;
+            for (auto E = F.edgeBegin(Rep); E < F.edgeEnd(Rep); ++E) {
+                if (Feasible[E]) Joined[NewBlock[BlockOf[F.target(E)]]].push_back(F.guard(F.guardOf(E)));
+            }
+            for (auto &J: Joined) {
+                auto &Vec = J.second;
+                std::sort(Vec.begin(), Vec.end(), Z3::less_than());
+                Vec.erase(std::unique(Vec.begin(), Vec.end(), [](const z3::expr &A, const z3::expr &B) {
+                    return Z3::same(A, B);
+                }), Vec.end());
+                auto Guard = Vec[0];
+                for (unsigned I = 1; I < Vec.size(); ++I) Guard = Guard || Vec[I];
+                Edges[K].emplace_back(J.first, Guard);
+            }
+        }
+        return std::make_shared<CompactFSM>(Edges, Names, Exits);
+    }
+};
+} // namespace
+
+CompactFSMRef minimizeFSM(const CompactFSM &F){
+    // all the checks share the encoding of the guards
+    Z3Solver::push();
+    CompactFSMRef Minimal;
+    {
+        FSMMinimizer Minimizer(F);
+        Minimal = Minimizer.minimize();
+        Minimizer.report(*Minimal);
+    }
+    Z3Solver::pop();
+    return Minimal;
+}
@@ -0,0 +1,389 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <llvm/ADT/APInt.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "BNF/FSM.h"
+#include "BNF/GuardIndex.h"
+#include "Support/FlatHash.h"
+#include "Support/Z3.h"
+
+#define DEBUG_TYPE "FSMPartition"
+
+namespace {
+/// the union of two FSMs and the coarsest bisimulation over it, the states of the second FSM follow those of the first
+///
+/// the guards are numbered once, guards with the same canonical form share a number, and each guard is encoded once in the solver.
+/// a transition is labelled by a representative of the guards equivalent to it, the representatives are
+/// kept per target block and source rank, so that a guard is only compared with guards it may be matched to.
+///
+/// the initial partition groups the nodes by rank, i.e., the longest distance to a node without transitions,
+/// which bisimilar nodes share in an acyclic FSM. then the blocks are split by the signatures of their nodes,
+/// i.e., the set of (label, target block) of the transitions, rank by rank from the bottom, until nothing splits.
+/// if the FSMs have a cycle, all nodes start in one block.
+///
+/// before a pair of guards is compared by the solver, they are evaluated on some sample messages,
+/// and guards with different values on a message cannot be equal.
+class FSMPartition {
+    struct Transition {
+        unsigned Guard;
+        unsigned Target;
+    };
+
+    typedef std::vector<std::pair<unsigned, unsigned>> Signature;
+
+    const CompactFSM &F1;
+    const CompactFSM &F2;
+
+    /// the id of the first state of the second FSM, and the number of nodes
+    unsigned Offset2;
+    unsigned NumNodes;
+
+    /// the feasible transitions of each node, in the order of its edges
+    std::vector<std::vector<Transition>> Succs;
+
+    /// the guards are numbered by their canonical forms, Guards keeps the first guard of each number
+    GuardIndex Index;
+    std::vector<z3::expr> Guards;
+    std::vector<z3::expr> Proxies;
+    std::unordered_map<unsigned, unsigned> GuardIDs;
+    std::map<std::pair<unsigned, unsigned>, bool> EqualGuards;
+
+    /// the values of the guards on the samples, one bit per sample, and whether all the values are known
+    /// @{
+    std::vector<uint64_t> Fingerprints;
+    std::vector<bool> Evaluated;
+    /// @}
+
+    std::vector<unsigned> Ranks;
+    std::vector<unsigned> BlockOf;
+    unsigned NumBlocks = 0;
+
+    /// the representatives of guard classes, keyed by the target block and the source rank
+    std::map<std::pair<unsigned, unsigned>, std::vector<unsigned>> Representatives;
+
+public:
+    FSMPartition(const CompactFSM &F1, const CompactFSM &F2)
+            : F1(F1), F2(F2), Offset2(F1.numStates()), NumNodes(F1.numStates() + F2.numStates()) {
+        std::vector<std::vector<std::pair<unsigned, unsigned>>> AllSuccs;
+        for (unsigned Offset: {0u, Offset2}) {
+            auto &F = Offset ? F2 : F1;
+            // the guard table of an FSM is numbered once
+            std::vector<unsigned> GuardIDsOfF;
+            for (auto &G: F.guards()) GuardIDsOfF.push_back(guard(G));
+            for (uint32_t S = 0; S < F.numStates(); ++S) {
+                AllSuccs.emplace_back();
+                for (auto E = F.edgeBegin(S); E < F.edgeEnd(S); ++E) {
+                    AllSuccs.back().emplace_back(GuardIDsOfF[F.guardOf(E)], Offset + F.target(E));
+                }
+            }
+        }
+        sample();
+
+        for (auto &Ts: AllSuccs) {
+            Succs.emplace_back();
+            for (auto &T: Ts) {
+                // an infeasible transition is never taken, neither matched nor reported,
+                // and a guard true on a sample is feasible
+                bool Feasible = Fingerprints[T.first] || Index.feasible(Guards[T.first], [&](const z3::expr &) {
+                    return Z3Solver::checkIncremental(Proxies[T.first]);
+                });
+                if (Feasible) Succs.back().push_back({T.first, T.second});
+            }
+        }
+    }
+
+    unsigned refine() {
+        std::vector<std::vector<unsigned>> Layers;
+        if (rank()) {
+            BlockOf = Ranks;
+            for (unsigned I = 0; I < NumNodes; ++I) {
+                if (Ranks[I] >= Layers.size()) Layers.resize(Ranks[I] + 1);
+                Layers[Ranks[I]].push_back(I);
+            }
+            NumBlocks = Layers.size();
+        } else {
+            errs() << "the FSMs have cycles, start the refinement with one block\n";
+            Ranks.assign(NumNodes, 0);
+            BlockOf.assign(NumNodes, 0);
+            Layers.emplace_back();
+            for (unsigned I = 0; I < NumNodes; ++I) Layers[0].push_back(I);
+            NumBlocks = 1;
+        }
+
+        unsigned Rounds = 0;
+        bool Changed = true;
+        while (Changed) {
+            Changed = false;
+            ++Rounds;
+            for (auto &Layer: Layers) {
+                // the signatures in a layer are computed before any of its nodes moves to a new block
+                std::vector<Signature> Signatures;
+                for (auto U: Layer) Signatures.push_back(signature(U));
+
+                // the first group of a block keeps its number
+                std::map<std::pair<unsigned, Signature>, unsigned> Groups;
+                std::set<unsigned> Kept;
+                for (unsigned I = 0; I < Layer.size(); ++I) {
+                    unsigned Old = BlockOf[Layer[I]];
+                    auto It = Groups.emplace(std::make_pair(Old, std::move(Signatures[I])), Old);
+                    if (It.second && !Kept.insert(Old).second) {
+                        It.first->second = NumBlocks++;
+                        Changed = true;
+                    }
+                    BlockOf[Layer[I]] = It.first->second;
+                }
+            }
+        }
+        return Rounds;
+    }
+
+    unsigned numBlocks() const { return NumBlocks; }
+
+    unsigned numGuards() const { return Guards.size(); }
+
+    const GuardIndex &index() const { return Index; }
+
+    /// report the transitions without an equal counterpart in the pairs of nodes reachable by equal transitions,
+    /// the pairs in the same block are bisimilar and skipped
+    void report() {
+        std::set<std::pair<unsigned, unsigned>> Visited;
+        report(CompactFSM::Entry, Offset2 + CompactFSM::Entry, Visited);
+    }
+
+private:
+    /// the id of an FSM node in the output
+    int name(unsigned U) const { return U < Offset2 ? F1.name(U) : F2.name(U - Offset2); }
+
+    unsigned guard(const z3::expr &E) {
+        auto &Canonical = Index.canonical(E);
+        auto It = GuardIDs.emplace(Z3::id(Canonical), Guards.size());
+        if (It.second) {
+            Guards.push_back(E);
+            Proxies.push_back(Z3Solver::proxy(Canonical));
+        }
+        return It.first->second;
+    }
+
+    static bool isFreeConstant(const z3::expr &E) {
+        return E.is_const() && E.decl().decl_kind() == Z3_OP_UNINTERPRETED;
+    }
+
+    /// a random value of the sort, an array is a random default byte updated at the first indices
+    static z3::expr randomValue(const z3::sort &S, std::mt19937_64 &RNG) {
+        if (S.is_bool()) return Z3::bool_val(RNG() & 1);
+        if (S.is_bv()) return Z3::bv_val((uint64_t) RNG(), S.bv_size());
+        assert(S.is_array() && S.array_domain().is_bv());
+        auto Array = z3::const_array(S.array_domain(), randomValue(S.array_range(), RNG));
+        for (unsigned I = 0; I < 16; ++I) {
+            Array = z3::store(Array, Z3::bv_val(I, S.array_domain().bv_size()), randomValue(S.array_range(), RNG));
+        }
+        return Array;
+    }
+
+    /// the values of the constants on a message, constants other than the message and its length are random
+    static z3::expr_vector valuesOf(const z3::expr_vector &Constants, const std::vector<uint8_t> &Message,
+                                    std::mt19937_64 &RNG) {
+        z3::expr_vector Values = Z3::vec();
+        for (auto C: Constants) {
+            auto S = C.get_sort();
+            if (Z3::is_length(C)) {
+                Values.push_back(Z3::bv_val((uint64_t) Message.size(), S.bv_size()));
+            } else if (S.is_array() && C.decl().name().str() == BYTE_ARRAY) {
+                auto Array = z3::const_array(S.array_domain(), randomValue(S.array_range(), RNG));
+                for (unsigned I = 0; I < Message.size(); ++I) {
+                    Array = z3::store(Array, Z3::bv_val(I, S.array_domain().bv_size()),
+                                      Z3::bv_val(Message[I], S.array_range().bv_size()));
+                }
+                Values.push_back(Array);
+            } else {
+                Values.push_back(randomValue(S, RNG));
+            }
+        }
+        return Values;
+    }
+
+    /// evaluate all the guards on a sample at once, so that the exprs they share are evaluated once
+    void evaluate(z3::expr AllGuards, const z3::expr_vector &Constants, const z3::expr_vector &Values,
+                  unsigned Sample) {
+        auto V = AllGuards.substitute(Constants, Values).simplify();
+        if (!V.is_numeral()) {
+            for (unsigned G = 0; G < Guards.size(); ++G) Evaluated[G] = false;
+            return;
+        }
+        APInt Bits(Guards.size(), Z3_get_numeral_string(V.ctx(), V), 10);
+        for (unsigned G = 0; G < Guards.size(); ++G) {
+            // the first guard is the most significant bit
+            if (Bits[Guards.size() - 1 - G]) Fingerprints[G] |= 1ULL << Sample;
+        }
+    }
+
+    /// some samples are random, the others are messages taking the guards never taken by the samples before
+    void sample() {
+        z3::expr_vector Constants = Z3::vec();
+        z3::expr_vector Bits = Z3::vec();
+        FlatIDSet Visited;
+        for (auto &G: Guards) {
+            for (auto C: Z3::find_all(G, false, isFreeConstant)) {
+                if (Visited.insert(Z3::id(C))) Constants.push_back(C);
+            }
+            Bits.push_back(z3::ite(G, Z3::bv_val(1, 1), Z3::bv_val(0, 1)));
+        }
+        Fingerprints.assign(Guards.size(), 0);
+        Evaluated.assign(Guards.size(), true);
+        // neither FSM has a transition, so there is nothing to sample
+        if (Guards.empty()) return;
+        auto AllGuards = Bits.size() == 1 ? Bits[0] : z3::concat(Bits);
+
+        std::mt19937_64 RNG(0x9e3779b97f4a7c15ULL);
+        unsigned Sample = 0;
+        for (; Sample < 16; ++Sample) {
+            std::vector<uint8_t> Message(RNG() % 64);
+            for (auto &Byte: Message) Byte = RNG();
+            evaluate(AllGuards, Constants, valuesOf(Constants, Message, RNG), Sample);
+        }
+        for (unsigned G = 0; G < Guards.size() && Sample < 32; ++G) {
+            std::vector<uint8_t> Message;
+            if (Fingerprints[G] || !Z3Solver::check(Guards[G], Message)) continue;
+            evaluate(AllGuards, Constants, valuesOf(Constants, Message, RNG), Sample++);
+        }
+    }
+
+    bool equal(unsigned G1, unsigned G2) {
+        if (G1 == G2) return true;
+        if (Evaluated[G1] && Evaluated[G2] && Fingerprints[G1] != Fingerprints[G2]) return false;
+        auto It = EqualGuards.emplace(std::make_pair(std::min(G1, G2), std::max(G1, G2)), false);
+        if (It.second) {
+            It.first->second = Index.equal(Guards[G1], Guards[G2], [&](const z3::expr &, const z3::expr &) {
+                return !Z3Solver::checkIncremental(Proxies[G1] != Proxies[G2]);
+            });
+        }
+        return It.first->second;
+    }
+
+    unsigned label(unsigned G, unsigned TargetBlock, unsigned SourceRank) {
+        auto &Reps = Representatives[{TargetBlock, SourceRank}];
+        for (auto R: Reps) {
+            if (equal(G, R)) return R;
+        }
+        Reps.push_back(G);
+        return G;
+    }
+
+    Signature signature(unsigned U) {
+        Signature Sig;
+        for (auto &T: Succs[U]) Sig.emplace_back(BlockOf[T.Target], label(T.Guard, BlockOf[T.Target], Ranks[U]));
+        std::sort(Sig.begin(), Sig.end());
+        Sig.erase(std::unique(Sig.begin(), Sig.end()), Sig.end());
+        return Sig;
+    }
+
+    /// return false if a cycle is found
+    bool rank() {
+        enum { Unvisited, Visiting, Done };
+        std::vector<unsigned> States(NumNodes, Unvisited);
+        Ranks.assign(NumNodes, 0);
+        std::vector<std::pair<unsigned, unsigned>> Stack;
+        for (unsigned Root = 0; Root < NumNodes; ++Root) {
+            if (States[Root] != Unvisited) continue;
+            States[Root] = Visiting;
+            Stack.emplace_back(Root, 0);
+            while (!Stack.empty()) {
+                auto &Top = Stack.back();
+                auto U = Top.first;
+                if (Top.second == Succs[U].size()) {
+                    States[U] = Done;
+                    Stack.pop_back();
+                    if (!Stack.empty()) {
+                        auto P = Stack.back().first;
+                        Ranks[P] = std::max(Ranks[P], Ranks[U] + 1);
+                    }
+                    continue;
+                }
+                auto V = Succs[U][Top.second++].Target;
+                if (States[V] == Visiting) return false;
+                if (States[V] == Done) {
+                    Ranks[U] = std::max(Ranks[U], Ranks[V] + 1);
+                    continue;
+                }
+                States[V] = Visiting;
+                Stack.emplace_back(V, 0);
+            }
+        }
+        return true;
+    }
+
+    void report(unsigned U1, unsigned U2, std::set<std::pair<unsigned, unsigned>> &Visited) {
+        if (BlockOf[U1] == BlockOf[U2] || !Visited.insert({U1, U2}).second) return;
+
+        auto N1 = name(U1);
+        auto N2 = name(U2);
+        errs()<<"start new group:\n";
+        std::vector<std::pair<unsigned, unsigned>> Matched;
+        std::vector<bool> Matched2(Succs[U2].size(), false);
+        for (auto &T1: Succs[U1]) {
+            // prefer the counterpart leading to a bisimilar node
+            int Match = -1;
+            for (unsigned K = 0; K < Succs[U2].size(); ++K) {
+                auto &T2 = Succs[U2][K];
+                if (!equal(T1.Guard, T2.Guard)) continue;
+                if (Match < 0) Match = K;
+                if (BlockOf[T1.Target] == BlockOf[T2.Target]) {
+                    Match = K;
+                    break;
+                }
+            }
+            if (Match < 0) {
+                errs()<<"diff: in F1 not in F2:  while compair "<<"state_"<<N1<<" and state_"<< N2<< ": state_" << N1 << " -> state_"<<name(T1.Target)<<":"<<Guards[T1.Guard] <<"\n";
+                continue;
+            }
+            Matched2[Match] = true;
+            Matched.emplace_back(T1.Target, Succs[U2][Match].Target);
+        }
+        for (unsigned K = 0; K < Succs[U2].size(); ++K) {
+            if (Matched2[K]) continue;
+            auto &T2 = Succs[U2][K];
+            errs()<<"diff: in F2 not in F1:  while compair "<<"state_"<<N1<<" and state_"<< N2<< ": state_" << N2<< " -> state_"<<name(T2.Target)<<":"<<Guards[T2.Guard]<<"\n";
+        }
+        for (auto &Pair: Matched) report(Pair.first, Pair.second, Visited);
+    }
+};
+} // namespace
+
+void partitionRefinement(FSMRef f1, FSMRef f2){
+    partitionRefinement(*f1->freeze(), *f2->freeze());
+}
+
+void partitionRefinement(const CompactFSM &F1, const CompactFSM &F2){
+    // all the checks share the encoding of the guards
+    Z3Solver::push();
+    {
+        FSMPartition Partition(F1, F2);
+        unsigned Rounds = Partition.refine();
+        errs()<<"Guard num: "<<Partition.numGuards()<<"\n";
+        Partition.index().report("FSM diff");
+        errs()<<"Block num after refinement: "<<Partition.numBlocks()<<" ("<<Rounds<<" rounds)\n";
+        Partition.report();
+    }
+    Z3Solver::pop();
+}
@@ -0,0 +1,169 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <vector>
+#include "BNF/GuardIndex.h"
+
+#define DEBUG_TYPE "GuardIndex"
+
+static bool isCommutative(Z3_decl_kind Kind) {
+    switch (Kind) {
+        case Z3_OP_EQ:
+        case Z3_OP_AND:
+        case Z3_OP_OR:
+        case Z3_OP_BADD:
+        case Z3_OP_BMUL:
+        case Z3_OP_BAND:
+        case Z3_OP_BOR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isConstant(const z3::expr &E) {
+    return E.is_numeral() || E.is_true() || E.is_false();
+}
+
+const z3::expr &GuardIndex::normalize(const z3::expr &E) {
+    auto It = Normals.find(Z3::id(E));
+    if (It != Normals.end()) return It->second.second;
+
+    // post order with an explicit stack, the flag tells if the operands of the expr are pushed already
+    std::vector<std::pair<z3::expr, bool>> Stack;
+    Stack.emplace_back(E, false);
+    while (!Stack.empty()) {
+        auto Top = Stack.back().first;
+        if (Normals.count(Z3::id(Top))) {
+            Stack.pop_back();
+            continue;
+        }
+        if (!Stack.back().second && Top.is_app() && Top.num_args() > 0) {
+            Stack.back().second = true;
+            for (unsigned I = 0; I < Top.num_args(); ++I) {
+                auto Arg = Top.arg(I);
+                if (!Normals.count(Z3::id(Arg))) Stack.emplace_back(Arg, false);
+            }
+            continue;
+        }
+        Stack.pop_back();
+
+        auto Normal = Top;
+        if (Top.is_app() && Top.num_args() > 0) {
+            std::vector<z3::expr> Args;
+            bool Constant = true;
+            for (unsigned I = 0; I < Top.num_args(); ++I) {
+                Args.push_back(Normals.at(Z3::id(Top.arg(I))).second);
+                Constant = Constant && isConstant(Args.back());
+            }
+            auto Kind = Top.decl().decl_kind();
+            if (isCommutative(Kind)) std::sort(Args.begin(), Args.end(), Z3::less_than());
+            z3::expr_vector Vec = Z3::vec();
+            for (auto &A: Args) Vec.push_back(A);
+            Normal = Top.decl()(Vec);
+            // z3's own simplifier evaluates an interpreted operator over constants, which is an equivalence
+            if (Constant && Kind != Z3_OP_UNINTERPRETED) {
+                auto Folded = Normal.simplify();
+                if (isConstant(Folded)) Normal = Folded;
+            }
+        }
+        Normals.emplace(Z3::id(Top), std::make_pair(Top, Normal));
+    }
+    return Normals.at(Z3::id(E)).second;
+}
+
+const z3::expr &GuardIndex::canonical(const z3::expr &G) {
+    auto It = Canonicals.find(Z3::id(G));
+    if (It != Canonicals.end()) return It->second.second;
+
+    // normalize the conjuncts, order them by their ids, and drop the duplicated and the true ones. they are joined by
+    // z3 itself, since Z3::simplify and Z3::make_and drop the free conjuncts, i.e., are not equivalences
+    std::vector<z3::expr> Conjuncts;
+    bool False = false;
+    for (auto C: Z3::find_consecutive_ops(G, Z3_OP_AND)) {
+        auto N = normalize(C);
+        if (N.is_false()) False = true;
+        if (!N.is_true()) Conjuncts.push_back(N);
+    }
+    std::sort(Conjuncts.begin(), Conjuncts.end(), Z3::less_than());
+    Conjuncts.erase(std::unique(Conjuncts.begin(), Conjuncts.end(), [](const z3::expr &A, const z3::expr &B) {
+        return Z3::same(A, B);
+    }), Conjuncts.end());
+    // a false conjunct makes the whole guard false
+    z3::expr Canonical = Z3::bool_val(!False);
+    if (!False && Conjuncts.size() == 1) {
+        Canonical = Conjuncts[0];
+    } else if (!False && Conjuncts.size() > 1) {
+        z3::expr_vector Vec = Z3::vec();
+        for (auto &C: Conjuncts) Vec.push_back(C);
+        Canonical = z3::mk_and(Vec);
+    }
+    return Canonicals.emplace(Z3::id(G), std::make_pair(G, Canonical)).first->second.second;
+}
+
+bool GuardIndex::equal(const z3::expr &G1, const z3::expr &G2, SolveFn Solve) {
+    const auto &C1 = canonical(G1);
+    const auto &C2 = canonical(G2);
+    if (Z3::same(C1, C2)) {
+        ++NumByIndex;
+        return true;
+    }
+
+    auto Key = std::make_pair(std::min(Z3::id(C1), Z3::id(C2)), std::max(Z3::id(C1), Z3::id(C2)));
+    auto It = Solved.find(Key);
+    if (It != Solved.end()) {
+        ++NumByIndex;
+        return It->second;
+    }
+
+    auto Decided = ByteDomain::equivalent(domain(C1), domain(C2));
+    if (Decided != ByteDomain::Unknown) {
+        ++NumByDomain;
+        return Solved[Key] = Decided == ByteDomain::Yes;
+    }
+    ++NumBySolver;
+    return Solved[Key] = Solve(C1, C2);
+}
+
+bool GuardIndex::feasible(const z3::expr &G, FeasibleFn Solve) {
+    const auto &C = canonical(G);
+    auto It = Feasible.find(Z3::id(C));
+    if (It != Feasible.end()) return It->second;
+
+    auto Decided = domain(C).satisfiable();
+    if (Decided != ByteDomain::Unknown) {
+        ++NumFeasibleByDomain;
+        return Feasible[Z3::id(C)] = Decided == ByteDomain::Yes;
+    }
+    ++NumFeasibleBySolver;
+    return Feasible[Z3::id(C)] = Solve(C);
+}
+
+const ByteDomain &GuardIndex::domain(const z3::expr &Canonical) {
+    auto It = Domains.find(Z3::id(Canonical));
+    if (It != Domains.end()) return It->second;
+    return Domains.emplace(Z3::id(Canonical), ByteDomain(Canonical)).first->second;
+}
+
+void GuardIndex::report(StringRef Name) const {
+    errs() << Name << ": " << Canonicals.size() << " guards indexed, " << NumByIndex
+           << " equalities decided by the index, " << NumByDomain << " by the byte domain, " << NumBySolver
+           << " by the solver; " << NumFeasibleByDomain << " feasibilities decided by the byte domain, "
+           << NumFeasibleBySolver << " by the solver\n";
+}
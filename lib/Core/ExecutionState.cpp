@@ -21,20 +21,20 @@
 #include <llvm/IR/GlobalIFunc.h>
 #include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/Instructions.h>
-#include <llvm/Support/ManagedStatic.h>
 
 #include "Core/ExecutionState.h"
+#include "Core/FunctionSummary.h"
 #include "Support/PushPop.h"
 
 using namespace llvm;
 
 typedef std::map<Value *, std::shared_ptr<AbstractValue>> RegisterSpace;
 
-static ManagedStatic<RegisterSpace> RegisterMem; // constant memory space
-static MessageBuffer *MessageMem = nullptr; // constant memory space
-static std::vector<GlobalMemoryBlock *> GlobalMem; // constant memory space, we only handle constant global now
-static std::vector<HeapMemoryBlock *> HeapMem; // variable memory space
-static PushPopVector<StackMemoryBlock *> StackMem; // variable memory space
+static thread_local RegisterSpace RegisterMem; // constant memory space
+static thread_local MessageBuffer *MessageMem = nullptr; // constant memory space
+static thread_local std::vector<GlobalMemoryBlock *> GlobalMem; // constant memory space, we only handle constant global now
+static thread_local std::vector<HeapMemoryBlock *> HeapMem; // variable memory space
+static thread_local PushPopVector<StackMemoryBlock *> StackMem; // variable memory space
 
 ExecutionState::ExecutionState() = default;
 
@@ -54,7 +54,7 @@ ExecutionState *ExecutionState::fork(BasicBlock *B, unsigned I, bool LoopExiting
     Ret->ForkBlockBr = I;
 #endif
     if (!Z3::is_free(Cond) && !Cond.is_true() && !Cond.is_false()) {
-        Ret->PC.push_back(Cond);
+        Ret->pushPC(Cond);
     }
     return Ret;
 }
@@ -151,7 +151,7 @@ void ExecutionState::merge(
     }
 }
 
-static unsigned subset(std::vector<z3::expr> &V1, std::vector<z3::expr> &V2) {
+static unsigned subset(const PersistentVector<z3::expr> &V1, const PersistentVector<z3::expr> &V2) {
     // return 1 if V1 < V2
     // return -1 if V1 > V2
     // return 0 if V1 = V2
@@ -229,7 +229,7 @@ void ExecutionState::merge(BasicBlock *B, unsigned MergeID, std::vector<Executio
                     break;
                 }
             }
-            if (AllSame) PC.push_back(FirstES->PC[CommonPrefixLen++]);
+            if (AllSame) pushPC(FirstES->PC[CommonPrefixLen++]);
             else break;
         }
         assert(CommonPrefixLen == PC.size());
@@ -270,40 +270,47 @@ void ExecutionState::merge(BasicBlock *B, unsigned MergeID, std::vector<Executio
 
     // to merge memory values from different states
     std::map<AbstractValue *, std::vector<std::pair<AbstractValue *, unsigned>>> MergeMap;
+    std::set<AbstractValue *> Visited;
     for (unsigned I = 0; I < ESVec.size(); ++I) {
         if (MergeCond[I].is_false()) continue;
         auto *ES = ESVec[I];
         assert(ES);
-        for (auto &It: ES->AbsValRevisionMap) {
-            MergeMap[It.first]; //.emplace_back(It.second, I);
-        }
-    }
-    for (auto &It: MergeMap) {
-        for (unsigned I = 0; I < ESVec.size(); ++I) {
-            if (MergeCond[I].is_false()) continue;
-            auto *ES = ESVec[I];
-            assert(ES);
-            It.second.emplace_back(ES->getValue(It.first, false), I);
-        }
+        ES->AbsValRevisionMap.forEach([&](AbstractValue *Key, const std::shared_ptr<AbstractValue> &Val) {
+            if (!Visited.insert(Key).second) return;
+            // a value the same in all states is shared, not merged
+            bool Shared = true;
+            for (unsigned J = 0; J < ESVec.size() && Shared; ++J) {
+                if (J == I || MergeCond[J].is_false()) continue;
+                auto *Other = ESVec[J]->AbsValRevisionMap.find(Key);
+                Shared = Other ? Other->get() == Val.get() : Key == Val.get();
+            }
+            if (Shared) {
+                AbsValRevisionMap.set(Key, Val);
+                return;
+            }
+            auto &ValVec = MergeMap[Key];
+            for (unsigned J = 0; J < ESVec.size(); ++J) {
+                if (MergeCond[J].is_false()) continue;
+                ValVec.emplace_back(ESVec[J]->getValue(Key, false), J);
+            }
+        });
     }
     merge(MergeID, MergeMap, MergeCond);
 
     // to merge named byte sets, just compute the set intersection
-    std::set<unsigned> IntersectionResults;
-    std::set<unsigned> *FirstSet = nullptr;
+    bool FirstSet = true;
     for (unsigned I = 0; I < ESVec.size(); ++I) {
         if (MergeCond[I].is_false()) continue;
         auto *ES = ESVec[I];
         assert(ES);
-        if (!FirstSet) {
+        if (FirstSet) {
             NamedByteSet = ES->NamedByteSet;
-            FirstSet = &NamedByteSet;
+            FirstSet = false;
         } else {
             auto &CurrSet = ES->NamedByteSet;
-            std::set_intersection(FirstSet->begin(), FirstSet->end(),
-                                  CurrSet.begin(), CurrSet.end(),
-                                  std::inserter(IntersectionResults, IntersectionResults.end()));
-            NamedByteSet = std::move(IntersectionResults);
+            std::vector<unsigned> Removed;
+            NamedByteSet.forEach([&CurrSet, &Removed](unsigned ID) { if (!CurrSet.count(ID)) Removed.push_back(ID); });
+            for (auto ID: Removed) NamedByteSet.erase(ID);
         }
     }
 
@@ -315,16 +322,16 @@ void ExecutionState::merge(BasicBlock *B, unsigned MergeID, std::vector<Executio
         auto NewPCExpr = MergeCondZ3Vec[0].simplify();
         assert(!NewPCExpr.is_false());
         if (!NewPCExpr.is_true() && !Z3::is_free(NewPCExpr))
-            PC.push_back(NewPCExpr);
+            pushPC(NewPCExpr);
     } else {
         if (!Z3::has_phi(MergeID) && !isa<PHINode>(*B->begin())) {
             // if no phi generated, we can use Z3::make_or
             auto NewPCExpr = Z3::make_or(MergeCondZ3Vec);
             assert(!NewPCExpr.is_false());
-            if (!NewPCExpr.is_true() && !Z3::is_free(NewPCExpr)) PC.push_back(NewPCExpr);
+            if (!NewPCExpr.is_true() && !Z3::is_free(NewPCExpr)) pushPC(NewPCExpr);
         } else {
             auto NewPCExpr = z3::mk_or(MergeCondZ3Vec);
-            if (!NewPCExpr.is_true() && !Z3::is_free(NewPCExpr)) PC.push_back(NewPCExpr);
+            if (!NewPCExpr.is_true() && !Z3::is_free(NewPCExpr)) pushPC(NewPCExpr);
         }
     }
 
@@ -399,7 +406,7 @@ MemoryBlock *ExecutionState::stackAllocate(Function *F, Type *Ty, unsigned int N
     while (auto *AbsVal = Mem->at(Offset)) {
         // the value is not managed by shared_ptr but class Memory, do not delete automatically
         std::shared_ptr<AbstractValue> SharedAbsVal(AbsVal, [](AbstractValue *) {});
-        AbsValRevisionMap[AbsVal] = SharedAbsVal;
+        AbsValRevisionMap.set(AbsVal, SharedAbsVal);
         Offset += AbsVal->bytewidth();
     }
     return Mem;
@@ -412,7 +419,7 @@ MemoryBlock *ExecutionState::heapAllocate(Type *Ty, unsigned int Num) {
     while (auto *AbsVal = Mem->at(Offset)) {
         // the value is not managed by shared_ptr but class Memory, do not delete automatically
         std::shared_ptr<AbstractValue> SharedAbsVal(AbsVal, [](AbstractValue *) {});
-        AbsValRevisionMap[AbsVal] = SharedAbsVal;
+        AbsValRevisionMap.set(AbsVal, SharedAbsVal);
         Offset += AbsVal->bytewidth();
     }
     return Mem;
@@ -429,19 +436,19 @@ MemoryBlock *ExecutionState::messageAllocate(Type *Ty, unsigned int Num) {
 }
 
 AbstractValue *ExecutionState::bindValue(Value *V, Value *OldV) {
-    auto VBIt = RegisterMem->find(OldV);
-    if (VBIt == RegisterMem->end()) {
+    auto VBIt = RegisterMem.find(OldV);
+    if (VBIt == RegisterMem.end()) {
         boundValue(OldV);
     }
-    VBIt = RegisterMem->find(OldV);
-    assert(VBIt != RegisterMem->end());
-    RegisterMem->emplace(V, VBIt->second);
+    VBIt = RegisterMem.find(OldV);
+    assert(VBIt != RegisterMem.end());
+    RegisterMem.emplace(V, VBIt->second);
     return VBIt->second.get();
 }
 
 AbstractValue *ExecutionState::boundValue(Value *V) {
-    auto VBIt = RegisterMem->find(V);
-    if (VBIt != RegisterMem->end()) {
+    auto VBIt = RegisterMem.find(V);
+    if (VBIt != RegisterMem.end()) {
         auto RetAV = VBIt->second;
         assert(RetAV->bytewidth() == DL::getNumBytes(V->getType()));
         return RetAV.get();
@@ -523,27 +530,27 @@ AbstractValue *ExecutionState::createAbstractValue4Constant(Constant *V) {
 }
 
 AbstractValue *ExecutionState::registerAllocate(Value *V) {
-    auto It = RegisterMem->find(V);
-    if (It != RegisterMem->end()) {
+    auto It = RegisterMem.find(V);
+    if (It != RegisterMem.end()) {
         // this should happen only in a loop
         return It->second.get();
     }
 
     if (V->getType()->isPointerTy()) {
-        auto AV = std::make_shared<AddressValue>();
-        RegisterMem->emplace(V, AV);
+        auto AV = std::allocate_shared<AddressValue>(PoolAllocator<AddressValue>());
+        RegisterMem.emplace(V, AV);
         return AV.get();
     } else {
-        auto AV = std::make_shared<ScalarValue>(DL::getNumBytes(V->getType()));
-        RegisterMem->emplace(V, AV);
+        auto AV = std::allocate_shared<ScalarValue>(PoolAllocator<ScalarValue>(), DL::getNumBytes(V->getType()));
+        RegisterMem.emplace(V, AV);
         return AV.get();
     }
 }
 
 void ExecutionState::registerDeallocate(Value *V) {
-    auto It = RegisterMem->find(V);
-    if (It != RegisterMem->end()) {
-        RegisterMem->erase(It);
+    auto It = RegisterMem.find(V);
+    if (It != RegisterMem.end()) {
+        RegisterMem.erase(It);
     }
 }
 
@@ -635,34 +642,27 @@ z3::expr ExecutionState::pc(unsigned I, unsigned N) const {
 AbstractValue *ExecutionState::getValue(AbstractValue *Val, bool Store) {
     if (!Val) return nullptr;
 
+    auto *Revision = AbsValRevisionMap.find(Val);
     if (!Store) {
-        auto It = AbsValRevisionMap.find(Val);
-        if (It != AbsValRevisionMap.end()) {
-            return It->second.get();
+        if (Revision) {
+            return Revision->get();
         }
         // the value has not been revised yet, a read only value, return it directly
         return Val;
     } else {
-        auto It = AbsValRevisionMap.find(Val);
-        if (It == AbsValRevisionMap.end()) {
-            // this should only happen when recovering exiting states from an initial state
-            // the initial state does not contain memory allocated in the loop
-            std::shared_ptr<AbstractValue> SharedAbsVal(Val, [](AbstractValue *) {});
-            It = AbsValRevisionMap.insert(std::begin(AbsValRevisionMap), std::make_pair(Val, SharedAbsVal));
-        }
-        assert(It != AbsValRevisionMap.end());
-        auto CurrentVal = It->second;
+        // this should only happen when recovering exiting states from an initial state
+        // the initial state does not contain memory allocated in the loop
+        AbstractValue *CurrentVal = Revision ? Revision->get() : Val;
+        // the current value may be shared by other states, always write to a new one
+        std::shared_ptr<AbstractValue> NewVal;
         if (Val->getKind() == AbstractValue::AVK_Scalar) {
-            auto NewVal = std::make_shared<ScalarValue>(CurrentVal->bytewidth());
-            if (!CurrentVal->poison()) NewVal->assign(CurrentVal.get());
-            It->second = NewVal;
-            return NewVal.get();
+            NewVal = std::allocate_shared<ScalarValue>(PoolAllocator<ScalarValue>(), CurrentVal->bytewidth());
         } else {
-            auto NewVal = std::make_shared<AddressValue>();
-            if (!CurrentVal->poison()) NewVal->assign(CurrentVal.get());
-            It->second = NewVal;
-            return NewVal.get();
+            NewVal = std::allocate_shared<AddressValue>(PoolAllocator<AddressValue>());
         }
+        if (!CurrentVal->poison()) NewVal->assign(CurrentVal);
+        AbsValRevisionMap.set(Val, NewVal);
+        return NewVal.get();
     }
 }
 
@@ -686,9 +686,9 @@ void ExecutionState::gc(Function *F) {
     for (auto *St: GC) {
         for (auto *Val: *St) {
             if (!Val) return;
-            auto It = AbsValRevisionMap.find(Val);
-            assert(It != AbsValRevisionMap.end());
-            AbsValRevisionMap.erase(It);
+            auto Erased = AbsValRevisionMap.erase(Val);
+            assert(Erased);
+            (void) Erased;
         }
         delete St;
     }
@@ -698,9 +698,94 @@ void ExecutionState::markCall() {
     StackMem.push();
 }
 
+void ExecutionState::releaseMemorySpaces() {
+    RegisterMem.clear();
+    delete MessageMem;
+    MessageMem = nullptr;
+    for (auto *Mem: GlobalMem) delete Mem;
+    GlobalMem.clear();
+    for (auto *Mem: HeapMem) delete Mem;
+    HeapMem.clear();
+    for (auto *Mem: StackMem) delete Mem;
+    StackMem.reset();
+    Pool::release();
+}
+
+/// collect the operands, via which Z3::simplify may find the condition conflicts with another one
+///
+/// each rule of Z3::simplify concluding false needs the two conditions to share an operand, which is not a numeral
+/// unless a condition compares numerals only; return false if the condition may conflict with any condition
+static bool conflictOperands(const z3::expr &E, std::vector<unsigned> &Ops) {
+    // a naming never conflicts, neither does a conjunction
+    if (Z3::is_naming_eq(E) || E.is_and()) return true;
+    if (E.is_or()) {
+        bool Ret = true;
+        for (unsigned K = 0; K < E.num_args(); ++K)
+            if (!conflictOperands(E.arg(K), Ops)) Ret = false;
+        return Ret;
+    }
+
+    auto Cmp = E.is_not() && E.arg(0).num_args() == 2 ? E.arg(0) : E;
+    bool AllNumerals = true;
+    for (unsigned K = 0; K < Cmp.num_args(); ++K) {
+        uint64_t C;
+        if (Z3::is_numeral_u64(Cmp.arg(K), C)) continue;
+        Ops.push_back(Z3::id(Cmp.arg(K)));
+        AllNumerals = false;
+    }
+    return !AllNumerals;
+}
+
+void ExecutionState::pushPC(const z3::expr &E) {
+    unsigned Pos = PC.size();
+    PC.push_back(E);
+
+    std::vector<unsigned> Ops;
+    if (!conflictOperands(E, Ops)) {
+        PCAnyVec.push_back(Pos);
+        return;
+    }
+    std::sort(Ops.begin(), Ops.end());
+    Ops.erase(std::unique(Ops.begin(), Ops.end()), Ops.end());
+    for (auto Op: Ops) {
+        auto *Old = PCOperandMap.find(Op);
+        auto New = Old ? std::make_shared<std::vector<unsigned>>(**Old) : std::make_shared<std::vector<unsigned>>();
+        New->push_back(Pos);
+        PCOperandMap.set(Op, std::move(New));
+    }
+}
+
+unsigned ExecutionState::conflictAt(const z3::expr &E) const {
+    // only the conditions sharing an operand with E may conflict with it, checked in the order of the pc
+    std::vector<unsigned> Candidates;
+    std::vector<unsigned> Ops;
+    if (conflictOperands(E, Ops)) {
+        for (auto Op: Ops)
+            if (auto *Positions = PCOperandMap.find(Op))
+                Candidates.insert(Candidates.end(), (*Positions)->begin(), (*Positions)->end());
+        for (auto Pos: PCAnyVec) Candidates.push_back(Pos);
+        std::sort(Candidates.begin(), Candidates.end());
+        Candidates.erase(std::unique(Candidates.begin(), Candidates.end()), Candidates.end());
+    } else {
+        for (unsigned I = 0; I < PC.size(); ++I) Candidates.push_back(I);
+    }
+
+    for (auto I: Candidates) {
+        if (I >= PC.size()) break;
+        if (Z3::simplify(E, PC[I]).is_false()) return I;
+    }
+    return UINT_MAX;
+}
+
 bool ExecutionState::conflict(const z3::expr &E) {
     if (E.is_false()) return true;
-    return std::any_of(PC.cbegin(), PC.cend(), [&E](const z3::expr &V) { return Z3::simplify(E, V).is_false(); });
+    auto I = conflictAt(E);
+    if (I != UINT_MAX) {
+        FunctionSummary::conflicted(I);
+        return true;
+    }
+    FunctionSummary::checked(E);
+    return false;
 }
 
 void ExecutionState::addPC(const z3::expr &E) {
@@ -718,6 +803,8 @@ void ExecutionState::addPC(const z3::expr &E) {
     }
 
     if (E.is_eq() && Z3::is_naming(E.arg(0))) {
+        // whether the name is added depends on the names given before the call
+        FunctionSummary::unsummarizable();
         auto NamedBytes = Z3::find_all(E.arg(0).arg(0), false,
                                        [](const z3::expr &E) { return E.decl().decl_kind() == Z3_OP_SELECT; });
         bool AllNamed = true;
@@ -728,13 +815,17 @@ void ExecutionState::addPC(const z3::expr &E) {
                 NamedByteSet.insert(NBID);
             }
         }
-        if (!AllNamed) this->PC.push_back(E);
+        if (!AllNamed) pushPC(E);
     } else {
         auto Res = E;
-        for (auto OnePC: PC) {
-            Res = Z3::simplify(OnePC, Res);
+        for (unsigned I = 0; I < PC.size(); ++I) {
+            FunctionSummary::simplified(E, Res, I);
+            Res = Z3::simplify(PC[I], Res);
         }
-        if (!Res.is_true()) this->PC.push_back(Res);
+        FunctionSummary::simplified(E, Res, PC.size());
+        // a pc of a single false is dropped when merging, which depends on the length of the pc before the call
+        if (Res.is_false()) FunctionSummary::unsummarizable();
+        if (!Res.is_true()) pushPC(Res);
     }
 }
 
@@ -743,7 +834,8 @@ void ExecutionState::replacePC(unsigned From, const z3::expr &New) {
     while (PC.size() > From) {
         PC.pop_back();
     }
-    PC.push_back(New);
+    // the index keeps the positions popped, they are filtered or re-checked when used
+    pushPC(New);
 }
 
 bool ExecutionState::optimize(std::vector<std::pair<AddressValue *, z3::expr>> &Vec) {
@@ -815,5 +907,6 @@ ExecutionState::optimize2(std::vector<std::pair<AddressValue *, z3::expr>> &Vec,
         ValVec.push_back(Off);
         CondVec.push_back(Cond);
     }
-    return std::make_shared<AddressValue>(Vec[0].first->base(0), Z3::make_phi(PhiID, ValVec, CondVec));
+    return std::allocate_shared<AddressValue>(PoolAllocator<AddressValue>(),
+                                              Vec[0].first->base(0), Z3::make_phi(PhiID, ValVec, CondVec));
 }
@@ -23,8 +23,10 @@
 #include <list>
 #include <set>
 #include "Core/Executor.h"
+#include "Core/FunctionSummary.h"
 #include "Support/Debug.h"
 #include "Support/DL.h"
+#include "Support/FlatHash.h"
 #include "Support/TimeRecorder.h"
 
 #define DEBUG_TYPE "Executor"
@@ -66,7 +68,7 @@ static cl::opt<bool> EnableNaming(
         cl::init(false));
 
 #ifndef NDEBUG
-static std::map<Value *, unsigned> ValueCounter;
+static thread_local std::map<Value *, unsigned> ValueCounter;
 
 static unsigned getCounter(Value *V) {
     assert(isa<Instruction>(V) || isa<Function>(V));
@@ -190,9 +192,9 @@ static bool isByteSeq(const z3::expr &Expr, z3::expr_vector *Vec = nullptr) {
     return HasByte && AllBytesOrConstant;
 }
 
-unsigned Executor::MergeID = 0;
-unsigned Executor::LoopAnalysisID = 0;
-std::map<Value *, DIType *> Executor::ValueDebugTypeMap;
+thread_local unsigned Executor::MergeID = 0;
+thread_local unsigned Executor::LoopAnalysisID = 0;
+thread_local std::map<Value *, DIType *> Executor::ValueDebugTypeMap;
 
 void Executor::visitBr(BranchInst &I) {
 }
@@ -1010,6 +1012,7 @@ GlobalMemoryBlock *Executor::isConstantString(Value *PtrVal) {
 }
 
 void Executor::recordMemoryWritten(Instruction *I, MemoryBlock *Mem, AbstractValue *Key) {
+    FunctionSummary::written(Mem);
     if (!LoopStack.empty()) LoopStack.back()->recordMemoryRevised(Key);
     if (auto *StackMem = dyn_cast<StackMemoryBlock>(Mem))
         if (!I || StackMem->getFunction() == I->getFunction()) return;
@@ -1144,6 +1147,7 @@ void Executor::visitpardiffMakeNamedObject(CallInst &I) {
 
     auto *NamedObjPtr = ES->registerAllocate(&I);
     auto Addr = ES->globalAllocate(Type::getIntNTy(I.getContext(), Bitwidth));
+    FunctionSummary::unsummarizable();
     ((AddressValue *) NamedObjPtr)->assign(Addr);
     auto *NamedObj = Addr->at(0);
     NamedObj->set(Z3::bv_const(Name.str().c_str(), Bitwidth));
@@ -1249,6 +1253,7 @@ void Executor::visitMemCmp(CallInst &I) {
     auto Off1 = Op1AbsVal->offset(0);
     uint64_t O1;
     if (!isa<MessageBuffer>(M1) && !Z3::is_numeral_u64(Off1, O1)) return;
+    FunctionSummary::read(M1);
     z3::expr_vector Vec1 = Z3::vec();
     for (unsigned K = 0; K < NumBytes2Cmp;) {
         auto A1 = M1->at(Z3::add(Off1, Z3::bv_val(K, Off1.get_sort().bv_size())));
@@ -1274,6 +1279,7 @@ void Executor::visitMemCmp(CallInst &I) {
     auto Off2 = Op2AbsVal->offset(0);
     uint64_t O2;
     if (!isa<MessageBuffer>(M2) && !Z3::is_numeral_u64(Off2, O2)) return;
+    FunctionSummary::read(M2);
     z3::expr_vector Vec2 = Z3::vec();
     for (unsigned K = 0; K < NumBytes2Cmp;) {
         auto A2 = M2->at(Z3::add(Off2, Z3::bv_val(K, Off2.get_sort().bv_size())));
@@ -1443,8 +1449,8 @@ struct CallFrame {
     CallInst *CallSite; // the call site
     unsigned PCSize; // the current length of pc at the call site
 };
-static std::vector<CallFrame> CallStack;
-static std::set<Function *> CalleeSet;
+static thread_local std::vector<CallFrame> CallStack;
+static thread_local std::set<Function *> CalleeSet;
 
 void Executor::visitCallIPA(CallInst &I) {
     // if(CallStack.size>2){
@@ -1475,6 +1481,8 @@ void Executor::visitCallIPA(CallInst &I) {
     assert(Callee);
     if (CalleeSet.count(Callee)) {
         if (!EnableRecursiveCall) {
+            // the callers being recorded would be analyzed differently out of the recursion
+            FunctionSummary::unsummarizable();
             visitCallDefault(I);
             return;
         } else {
@@ -1495,12 +1503,21 @@ void Executor::visitCallIPA(CallInst &I) {
             llvm_unreachable("TODO : function is recursively called!");
         }
     }
-    CalleeSet.insert(Callee);
-    if (I.getType()->isVoidTy()) {
-        CallStack.push_back({nullptr, this, &I, ES->pcLength()});
-    } else {
-        CallStack.push_back({ES->registerAllocate(&I), this, &I, ES->pcLength()});
+
+    // reuse the effect of the callee if it has been analyzed with the same arguments, see FunctionSummary
+    std::vector<AbstractValue *> ActualArgAVs;
+    for (unsigned K = 0; K < Callee->arg_size(); ++K) ActualArgAVs.push_back(ES->boundValue(I.getArgOperand(K)));
+    if (auto *Summary = FunctionSummary::lookup(Callee, ActualArgAVs, ES)) {
+        pardiff_INFO("Summarized " << space(CallStack.size()) << Callee->getName());
+        FunctionSummary::apply(*Summary, ES, I.getType()->isVoidTy() ? nullptr : ES->registerAllocate(&I));
+        return;
     }
+    FunctionSummary::Recorder Recorder(Callee, ActualArgAVs, ES);
+
+    CalleeSet.insert(Callee);
+    AbstractValue *Receiver = nullptr;
+    if (!I.getType()->isVoidTy()) Receiver = ES->registerAllocate(&I);
+    CallStack.push_back({Receiver, this, &I, ES->pcLength()});
 
     Executor CalleeExectuor(DriverPass);
     CalleeExectuor.StateMap[&Callee->getEntryBlock()].push_back(ES);
@@ -1515,6 +1532,7 @@ void Executor::visitCallIPA(CallInst &I) {
     ES->markCall();
     //llvm::slice_Inst.insert(&I); 
     CalleeExectuor.visit(Callee);
+    Recorder.summarize(ES, Receiver, !CalleeExectuor.EscapedMemoryRevision.empty());
 }
 
 void Executor::visitRet(ReturnInst &I) {
@@ -1555,12 +1573,15 @@ void Executor::alloc(MemoryBlock::MemoryKind MemTy, Instruction *Ret, Type *Allo
     switch (MemTy) {
         case MemoryBlock::MK_Stack:
             Addr = ES->stackAllocate(Ret->getFunction(), AllocTy, Num);
+            FunctionSummary::stackAllocated(Addr);
             break;
         case MemoryBlock::MK_Heap:
             Addr = ES->heapAllocate(AllocTy, Num);
+            FunctionSummary::unsummarizable();
             break;
         case MemoryBlock::MK_Message:
             Addr = ES->messageAllocate(AllocTy, Num);
+            FunctionSummary::unsummarizable();
             break;
         default:
             llvm_unreachable("Error : unknown memory type!");
@@ -1921,7 +1942,8 @@ void Executor::beforeVisit(BasicBlock &B) {
                 if (It != StateMap.end()) StateMap.erase(It);
             }
         } else {
-            // a new loop
+            // a new loop, its summary is bound to the loop analysis id and cannot be shared by two calls
+            FunctionSummary::unsummarizable();
             LoopStack.push_back(new LoopSummaryAnalysis(LP, ES, MergeID, ++LoopAnalysisID));
         }
         // increase the trip count, start a new trip/iteration
@@ -2069,6 +2091,7 @@ void Executor::load(LoadInst *Load, AddressValue *Addr, AbstractValue *Result) {
 }
 
 void Executor::_load(LoadInst *LdInst, AbstractValue *Dst, MemoryBlock *Base, const z3::expr &Offset) {
+    FunctionSummary::read(Base);
     uint64_t Off;
     if (!Z3::is_numeral_u64(Offset, Off)) {
         auto *MB = dyn_cast<MessageBuffer>(Base);
@@ -2129,8 +2152,10 @@ void Executor::store(StoreInst *I, AddressValue *Addr, AbstractValue *V2S) {
 void Executor::_store(StoreInst *I, AbstractValue *V2S, MemoryBlock *Base, const z3::expr &Offset, const z3::expr &Cond,
                       bool SU) {
     if (auto *MsgBuff = dyn_cast<MessageBuffer>(Base)) {
-        if (isa<ScalarValue>(V2S))
+        if (isa<ScalarValue>(V2S)) {
             MsgBuff->store(V2S->value(), Offset);
+            FunctionSummary::invalidate();
+        }
         pardiff_WARN("Try to overwrite the data buffer via store!");
         return;
     }
@@ -2267,6 +2292,7 @@ void Executor::memoryCopy(Instruction *I, AddressValue *Dst, AddressValue *Src,
 
     Len = normalizeLen(Dst, Len);
     Len = normalizeLen(Src, Len);
+    FunctionSummary::read(Src->base(0));
 
     auto DstOffset = Dst->offset(0);
     auto SrcOffset = Src->offset(0);
@@ -2385,7 +2411,7 @@ static bool findLen(const z3::expr &Expr) {
         return findLen(Expr.arg(1)) && findLen(Expr.arg(2));
     }
 
-    std::set<unsigned> Visited;
+    FlatIDSet Visited;
     z3::expr_vector Stack = Z3::vec();
     Stack.push_back(Expr);
     while (!Stack.empty()) {
@@ -2908,8 +2934,8 @@ bool Executor::getBytes2Name(const z3::expr &Expr, z3::expr_vector &Vec) {
     // to find a single byte, a concatenation of a few bytes, or some simple ops (cast or binop) on the bytes
     // if the bytes have been named, we do not include them
 
-    std::set<unsigned> Added2Vec;
-    std::set<unsigned> Visited;
+    FlatIDSet Added2Vec;
+    FlatIDSet Visited;
     std::vector<z3::expr> Stack;
     Stack.push_back(Expr);
     while (!Stack.empty()) {
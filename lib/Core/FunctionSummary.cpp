@@ -0,0 +1,214 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <llvm/Support/CommandLine.h>
+#include <atomic>
+#include <map>
+#include "Core/FunctionSummary.h"
+#include "Support/Debug.h"
+
+static cl::opt<bool> EnableFunctionSummary("pardiff-function-summary",
+                                           cl::desc("reuse the effect of a call analyzed before "
+                                                    "if the callee is called again with the same arguments"),
+                                           cl::init(true));
+
+enum ArgumentKind {
+    AK_Poison,
+    AK_Scalar,
+    AK_Address
+};
+
+// summaries hold exprs of the session of their thread, while the statistics are shared by all threads
+static thread_local std::map<FunctionSummary::Key, FunctionSummary::Effect> Summaries;
+static thread_local std::vector<FunctionSummary::Recorder *> Recorders;
+
+static std::atomic<unsigned> NumHits(0);
+static std::atomic<unsigned> NumMisses(0);
+static std::atomic<unsigned> NumSummarized(0);
+
+/// the key refers to exprs by ids, and collects the exprs to \p Inputs
+static bool key(Function *Callee, const std::vector<AbstractValue *> &Args,
+                FunctionSummary::Key &K, std::vector<z3::expr> *Inputs) {
+    K.push_back((uintptr_t) Callee);
+    for (auto *Arg: Args) {
+        if (!Arg) return false;
+        if (Arg->poison()) {
+            K.push_back(AK_Poison);
+        } else if (isa<ScalarValue>(Arg)) {
+            K.push_back(AK_Scalar);
+            K.push_back(Z3::id(Arg->value()));
+            if (Inputs) Inputs->push_back(Arg->value());
+        } else {
+            K.push_back(AK_Address);
+            K.push_back(Arg->size());
+            for (unsigned I = 0; I < Arg->size(); ++I) {
+                K.push_back((uintptr_t) Arg->base(I));
+                K.push_back(Z3::id(Arg->offset(I)));
+                if (Inputs) Inputs->push_back(Arg->offset(I));
+            }
+        }
+    }
+    return true;
+}
+
+/// check if the conditions of a summary are used by the pc of \p ES the same way as they were recorded,
+/// the uses are also told to the calls being recorded, which depend on them now
+static bool valid(const FunctionSummary::Effect &E, ExecutionState *ES) {
+    for (auto &Cond: E.Checked)
+        if (ES->conflictAt(Cond) != UINT_MAX) return false;
+    for (auto &It: E.Simplified) {
+        auto Res = It.first;
+        for (unsigned I = 0; I < ES->pcLength(); ++I) {
+            FunctionSummary::simplified(It.first, Res, I);
+            Res = Z3::simplify(ES->pc(I), Res);
+        }
+        if (!Z3::same(Res, It.second)) return false;
+    }
+    for (auto &Cond: E.Checked) FunctionSummary::checked(Cond);
+    return true;
+}
+
+FunctionSummary::Recorder::Recorder(Function *Callee, const std::vector<AbstractValue *> &Args, ExecutionState *ES)
+        : Summarizable(EnableFunctionSummary.getValue()), Active(Summarizable) {
+    if (!Summarizable) return;
+    Summarizable = key(Callee, Args, K, &E.Inputs);
+    for (unsigned I = 0; I < ES->pcLength(); ++I) EntryPC.push_back(ES->pc(I));
+    Recorders.push_back(this);
+}
+
+FunctionSummary::Recorder::~Recorder() {
+    if (!Active) return;
+    assert(!Recorders.empty() && Recorders.back() == this);
+    Recorders.pop_back();
+}
+
+void FunctionSummary::Recorder::summarize(ExecutionState *ES, AbstractValue *Ret, bool Escaped) {
+    if (!Summarizable || Escaped) return;
+
+    // the callee only appends conditions to the pc
+    if (ES->pcLength() < EntryPC.size()) return;
+    for (unsigned I = 0; I < EntryPC.size(); ++I)
+        if (!Z3::same(ES->pc(I), EntryPC[I])) return;
+    for (unsigned I = EntryPC.size(); I < ES->pcLength(); ++I) E.PC.push_back(ES->pc(I));
+
+    if (Ret) {
+        E.HasReturn = true;
+        E.ReturnPoison = Ret->poison();
+        if (!E.ReturnPoison) {
+            // an address may point to the stack of the caller, which is released later
+            if (!isa<ScalarValue>(Ret)) return;
+            E.Return = Ret->value();
+        }
+    }
+
+    // free variables created by the callee are distinct in every call, thus cannot be shared
+    std::set<unsigned> InputFrees;
+    for (auto &Input: E.Inputs)
+        for (auto Free: Z3::find_all(Input, true, Z3::is_free)) InputFrees.insert(Z3::id(Free));
+    auto Fresh = [&InputFrees](const z3::expr &Expr) {
+        for (auto Free: Z3::find_all(Expr, true, Z3::is_free))
+            if (!InputFrees.count(Z3::id(Free))) return true;
+        return false;
+    };
+    if (E.HasReturn && !E.ReturnPoison && Fresh(E.Return)) return;
+    for (auto &Cond: E.PC)
+        if (Fresh(Cond)) return;
+
+    // a summary invalid at the call site is replaced by the latest one
+    Summaries[K] = std::move(E);
+    ++NumSummarized;
+}
+
+const FunctionSummary::Effect *FunctionSummary::lookup(Function *Callee, const std::vector<AbstractValue *> &Args,
+                                                       ExecutionState *ES) {
+    if (!EnableFunctionSummary.getValue()) return nullptr;
+    Key K;
+    if (!key(Callee, Args, K, nullptr)) return nullptr;
+    auto It = Summaries.find(K);
+    if (It == Summaries.end() || !valid(It->second, ES)) {
+        ++NumMisses;
+        return nullptr;
+    }
+    ++NumHits;
+    return &It->second;
+}
+
+void FunctionSummary::apply(const Effect &E, ExecutionState *ES, AbstractValue *Ret) {
+    if (Ret && E.HasReturn) {
+        if (E.ReturnPoison) Ret->mkpoison();
+        else Ret->set(E.Return);
+    }
+    for (auto &Cond: E.PC) ES->appendPC(Cond);
+}
+
+void FunctionSummary::stackAllocated(MemoryBlock *Block) {
+    // the stack of a callee is also the local memory of its callers being recorded
+    for (auto *R: Recorders) R->LocalBlocks.insert(Block);
+}
+
+void FunctionSummary::read(MemoryBlock *Block) {
+    if (isa<MessageBuffer>(Block)) return;
+    for (auto *R: Recorders)
+        if (!R->LocalBlocks.count(Block)) R->Summarizable = false;
+}
+
+void FunctionSummary::written(MemoryBlock *Block) {
+    if (isa<MessageBuffer>(Block)) {
+        invalidate();
+        return;
+    }
+    for (auto *R: Recorders)
+        if (!R->LocalBlocks.count(Block)) R->Summarizable = false;
+}
+
+void FunctionSummary::unsummarizable() {
+    for (auto *R: Recorders) R->Summarizable = false;
+}
+
+void FunctionSummary::invalidate() {
+    unsummarizable();
+    Summaries.clear();
+}
+
+void FunctionSummary::checked(const z3::expr &Cond) {
+    for (auto *R: Recorders)
+        if (R->CheckedSet.insert(Z3::id(Cond)).second) R->E.Checked.push_back(Cond);
+}
+
+void FunctionSummary::conflicted(unsigned I) {
+    // a conflict with the pc before the call may not happen at another call site
+    for (auto *R: Recorders)
+        if (I < R->EntryPC.size()) R->Summarizable = false;
+}
+
+void FunctionSummary::simplified(const z3::expr &Cond, const z3::expr &Res, unsigned I) {
+    for (auto *R: Recorders)
+        if (I == R->EntryPC.size() && R->SimplifiedSet.insert(Z3::id(Cond)).second)
+            R->E.Simplified.emplace_back(Cond, Res);
+}
+
+void FunctionSummary::release() {
+    Summaries.clear();
+}
+
+void FunctionSummary::report() {
+    unsigned Hits = NumHits, Misses = NumMisses;
+    unsigned Rate = Hits + Misses ? Hits * 100 / (Hits + Misses) : 0;
+    pardiff_INFO("Function summaries: " << Hits << " hits, " << Misses << " misses (" << Rate << "% hit rate), "
+                                        << NumSummarized << " calls summarized");
+}
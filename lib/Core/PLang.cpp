@@ -71,7 +71,7 @@ void PLang::gen(SliceGraphNode *Node, FuncCode &Code, unsigned Ident, bool Enfor
             // gen func code for node, add to FuncCodeVec
             FuncVec.emplace_front();
             auto &FuncCode = FuncVec.front();
-            static unsigned FuncID = 0;
+            static thread_local unsigned FuncID = 0;
 
             // add a call to the map; add the call to Code
             std::string Call = "if (f_" + std::to_string(++FuncID) + "(B) == 0) { return 0; }";
@@ -16,12 +16,14 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseMap.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Debug.h>
-#include <llvm/Support/MD5.h>
 #include "Core/SliceGraph.h"
 #include "Support/ADT.h"
 #include "Support/Debug.h"
+#include "Support/FlatHash.h"
 #include "BNF/BNF.h"
 #include <queue>
 #include <deque>
@@ -34,9 +36,19 @@ static cl::opt<std::string> SimplifyMode("pardiff-slice-mode",
                                          cl::desc("mode: full, name, formula"),
                                          cl::init("full"));
 
-static std::map<unsigned, std::set<unsigned>> ForkMap;
-static std::set<unsigned> PhiCondID;
-static bool OldVersion = false;
+static thread_local std::map<unsigned, std::set<unsigned>> ForkMap;
+static thread_local std::set<unsigned> PhiCondID;
+static thread_local bool OldVersion = false;
+
+/// the finalizer of murmur3
+static uint64_t fmix(uint64_t H) {
+    H ^= H >> 33;
+    H *= 0xff51afd7ed558ccdULL;
+    H ^= H >> 33;
+    H *= 0xc4ceb9fe1a85ec53ULL;
+    H ^= H >> 33;
+    return H;
+}
 
 static bool uselessPhi(const z3::expr &E) {
     assert(Z3::is_phi(E));
@@ -190,7 +202,7 @@ SliceGraph *SliceGraph::get(const z3::expr PC, bool AllExpanded) {
     }
 
     std::map<unsigned, std::vector<z3::expr>> ReferenceMap;
-    std::set<unsigned> Visited;
+    FlatIDSet Visited;
     std::vector<z3::expr> Stack;
     Stack.push_back(PC);
     while (!Stack.empty()) {
@@ -241,21 +253,8 @@ SliceGraph *SliceGraph::get(const z3::expr PC, bool AllExpanded) {
     pardiff_INFO("Slice Size: " << Graph->size());
 
     // each phi condition should be a node in the graph
-    std::vector<SliceGraphNode *> NodeStack;
-    std::set<SliceGraphNode *> NodeVisited;
     std::set<unsigned> CondIDSet;
-    for (auto *En: Graph->Entries)
-        NodeStack.push_back(En);
-    while (!NodeStack.empty()) {
-        auto *Top = NodeStack.back();
-        NodeStack.pop_back();
-        if (NodeVisited.count(Top)) continue;
-        NodeVisited.insert(Top);
-        CondIDSet.insert(Top->getConditionID());
-        for (auto *Ch: Top->Children) {
-            NodeStack.push_back(Ch);
-        }
-    }
+    Graph->dfs([&CondIDSet](SliceGraphNode *N) { CondIDSet.insert(N->getConditionID()); });
     for (auto CID: PhiCondID) {
         assert(CondIDSet.count(CID));
     }
@@ -266,27 +265,87 @@ SliceGraph *SliceGraph::get(const z3::expr PC, bool AllExpanded) {
     return Graph;
 }
 
-SliceGraph::~SliceGraph() {
-    std::vector<SliceGraphNode *> GCStack;
-    std::set<SliceGraphNode *> Visited;
-    for (auto *En: Entries)
-        GCStack.push_back(En);
-    while (!GCStack.empty()) {
-        auto *Top = GCStack.back();
-        GCStack.pop_back();
-        if (Visited.count(Top)) continue;
-        Visited.insert(Top);
+SliceGraphLayout::SliceGraphLayout(const std::set<SliceGraphNode *> &Entries) {
+    // the same order as the dfs using a stack of pointers, a node is visited iff it has got an index
+    std::vector<SliceGraphNode *> Stack(Entries.begin(), Entries.end());
+    while (!Stack.empty()) {
+        auto *Top = Stack.back();
+        Stack.pop_back();
+        if (contains(Top)) continue;
+        Top->Index = Nodes.size();
+        Nodes.push_back(Top);
         for (auto *Ch: Top->Children) {
-            GCStack.push_back(Ch);
+            Stack.push_back(Ch);
+        }
+    }
+
+    for (auto *En: Entries)
+        EntryIndices.push_back(En->Index);
+    ChildOffsets.reserve(Nodes.size() + 1);
+    ParentOffsets.reserve(Nodes.size() + 1);
+    for (auto *N: Nodes) {
+        ChildOffsets.push_back(ChildIndices.size());
+        for (auto *Ch: N->Children)
+            ChildIndices.push_back(Ch->Index);
+        ParentOffsets.push_back(ParentIndices.size());
+        for (auto *Pa: N->Parents)
+            if (contains(Pa)) ParentIndices.push_back(Pa->Index);
+    }
+    ChildOffsets.push_back(ChildIndices.size());
+    ParentOffsets.push_back(ParentIndices.size());
+}
+
+void SliceGraphLayout::postOrder(std::vector<unsigned> &Ret) const {
+    BitVector Visited(size());
+    // pairs of a node and the position of its next child to visit
+    std::vector<std::pair<unsigned, unsigned>> Stack;
+    for (auto En: EntryIndices) {
+        if (Visited.test(En)) continue;
+        Visited.set(En);
+        Stack.emplace_back(En, 0);
+        while (!Stack.empty()) {
+            auto Top = Stack.back().first;
+            auto Children = children(Top);
+            if (Stack.back().second < Children.size()) {
+                auto Ch = Children[Stack.back().second++];
+                if (Visited.test(Ch)) continue;
+                Visited.set(Ch);
+                Stack.emplace_back(Ch, 0);
+            } else {
+                Ret.push_back(Top);
+                Stack.pop_back();
+            }
         }
-        delete Top;
     }
 }
 
+std::set<SliceGraphNode *> SliceGraphNode::find_exitschild() {
+    std::set<SliceGraphNode *> res;
+    SliceGraphLayout Layout({this});
+    for (auto *N: Layout.nodes()) {
+        if (N->getNumChildren() == 0) {
+            res.insert(N);
+        }
+    }
+    return res;
+}
+
+void SliceGraph::dfs_findexits() {
+    dfs([this](SliceGraphNode *N) {
+        if (N->getNumChildren() == 0) {
+            getExits().insert(N);
+        }
+    });
+}
+
+SliceGraph::~SliceGraph() {
+    SliceGraphLayout Layout(Entries);
+    for (auto *N: Layout.nodes())
+        delete N;
+}
+
 unsigned SliceGraph::size() const {
-    unsigned Size = 0;
-    dfs([&Size](SliceGraphNode *N) { Size++; });
-    return Size;
+    return layout().size();
 }
 
 void SliceGraph::dot(std::string &File, const char *NameSuffix) const {
@@ -337,21 +396,9 @@ void SliceGraph::dot(std::string &File, const char *NameSuffix) const {
 
     unsigned X = 0;
     DotStream << "digraph slice {\n";
-    std::vector<SliceGraphNode *> DotStack;
-    std::set<SliceGraphNode *> Visited;
-    // errs()<<"entries size: "<<Entries.size()<<"\n";
-    for (auto *En: Entries)
-        DotStack.push_back(En);
-    while (!DotStack.empty()) {
-        auto *Top = DotStack.back();
-        DotStack.pop_back();
-        if (Visited.count(Top)) continue;
-        Visited.insert(Top);
-        DotNode(Top, DotStream);
+    for (auto *N: layout().nodes()) {
+        DotNode(N, DotStream);
         if (++X > 1000) break;
-        for (auto *Ch: Top->Children) {
-            DotStack.push_back(Ch);
-        }
     }
     DotStream << "}\n";
     pardiff_INFO(RealFileNameStr << " dotted!");
@@ -440,59 +487,45 @@ void SliceGraph::simplifyByRemoving() {
         return Selects.empty();
     };
 
-    std::set<SliceGraphNode *> Visited;
-    dfs([&Visited](SliceGraphNode *N) {
-        Visited.insert(N);
-    });
+    auto Layout = layout();
+    std::vector<SliceGraphNode *> Visited;
+    for (auto I: Layout.addressOrder()) Visited.push_back(Layout.node(I));
 
     // remove false nodes.
     std::set<SliceGraphNode *> Deleted;
-    auto It = Visited.begin();
-    while (It != Visited.end()) {
-        auto *N = *It;
-        if (Deleted.count(N)) {
-            It = Visited.erase(It);
-            continue;
-        }
-        if (!N->getCondition().is_false()) {
-            It++;
+    for (auto *N: Visited) {
+        if (Deleted.count(N) || !N->getCondition().is_false())
             continue;
-        }
-
         remove(N, false, &Deleted);
-        It = Visited.erase(It);
     }
-    for (auto *Del: Deleted)
-        Visited.erase(Del);
-    Deleted.clear();
+    Visited.erase(std::remove_if(Visited.begin(), Visited.end(),
+                                 [&Deleted](SliceGraphNode *N) { return Deleted.count(N); }),
+                  Visited.end());
 
     // remove not related nodes.
-    It = Visited.begin();
-    while (It != Visited.end()) {
-        auto *N = *It;
-        if (!NotRelated(N)) {
-            It++;
+    BitVector Removed(Visited.size());
+    for (unsigned I = 0; I < Visited.size(); ++I) {
+        if (!NotRelated(Visited[I]))
             continue;
-        }
-
-        remove(N, true);
-        It = Visited.erase(It);
+        remove(Visited[I], true);
+        Removed.set(I);
     }
 
     // do some check
-    for (auto *Node: Visited) validate(Node);
+    for (unsigned I = 0; I < Visited.size(); ++I)
+        if (!Removed.test(I)) validate(Visited[I]);
 }
 
 void SliceGraph::simplifyByMerging() {
     std::set<SliceGraphNode *> Deleted;
-    std::set<SliceGraphNode *> Visited;
-    dfs([&Visited](SliceGraphNode *N) {
-        Visited.insert(N);
-    });
+    auto Layout = layout();
+    auto Visited = Layout.addressOrder();
+    BitVector Removed(Layout.size());
 
     // remove equivalent nodes, preserving one only
-    std::set<SliceGraphNode *> ToRemove;
-    for (auto *N: Visited) {
+    BitVector ToRemove(Layout.size());
+    for (auto NIdx: Visited) {
+        auto *N = Layout.node(NIdx);
         auto ChIt = N->Children.begin();
         while (ChIt != N->Children.end()) {
             auto *Ch = *ChIt;
@@ -506,26 +539,28 @@ void SliceGraph::simplifyByMerging() {
                     NextCh->getConditionID() /*Z3::same(Ch->getCondition(), NextCh->getCondition())*/
                     && Ch->Parents == NextCh->Parents
                     && Ch->Children == NextCh->Children) {
-                    ToRemove.insert(Ch);
+                    ToRemove.set(Layout.index(Ch));
                     break;
                 }
             }
         }
     }
-    for (auto *TR: ToRemove) {
-        remove(TR, false, &Deleted);
+    for (auto TR: ToRemove.set_bits()) {
+        remove(Layout.node(TR), false, &Deleted);
         assert(Deleted.size() == 1);
         Deleted.clear();
-        Visited.erase(TR);
     }
+    Removed |= ToRemove;
 
     // do some check
-    for (auto *Node: Visited) validate(Node);
+    for (auto V: Visited)
+        if (!Removed.test(V)) validate(Layout.node(V));
 
     // for merge
-    ToRemove.clear();
+    ToRemove.reset();
     std::vector<SliceGraphNode *> Stack;
-    for (auto *V: Visited) Stack.push_back(V);
+    for (auto V: Visited)
+        if (!Removed.test(V)) Stack.push_back(Layout.node(V));
     while (!Stack.empty()) {
         auto N = Stack.back();
         Stack.pop_back();
@@ -566,7 +601,7 @@ void SliceGraph::simplifyByMerging() {
             }
 
             if (ChMerged) {
-                ToRemove.insert(Ch);
+                ToRemove.set(Layout.index(Ch));
                 ChIt = N->Children.erase(ChIt);
                 // make Ch a single node
                 for (auto P: Ch->Parents)
@@ -580,49 +615,58 @@ void SliceGraph::simplifyByMerging() {
             }
         }
     }
-    for (auto *TR: ToRemove) {
-        remove(TR, false, &Deleted);
+    for (auto TR: ToRemove.set_bits()) {
+        remove(Layout.node(TR), false, &Deleted);
         assert(Deleted.size() == 1);
         Deleted.clear();
-        Visited.erase(TR);
     }
+    Removed |= ToRemove;
 
     // do some check
-    for (auto *Node: Visited) validate(Node);
+    for (unsigned I = 0; I < Layout.size(); ++I)
+        if (!Removed.test(I)) validate(Layout.node(I));
 }
 
 void SliceGraph::simplifyByHashConsing() {
-    std::vector<SliceGraphNode *> Topo;
-    topoOrder(Topo);
-
-    // bottom-up to compute hash and merge those having the same hash
-    std::map<SliceGraphNode *, std::string> NodeHashMap;
-    std::map<std::string, SliceGraphNode *> HashNodeMap;
-    std::set<std::string> Children;
+    auto Layout = layout();
+    std::vector<unsigned> Topo;
+    topoOrder(Layout, Topo);
+
+    // bottom-up to compute hash and merge those having the same structure, i.e., the same condition and,
+    // as the children have been merged, the same children
+    std::vector<uint64_t> NodeHashVec(Layout.size());
+    DenseMap<uint64_t, SliceGraphNode *> HashNodeMap;
+    std::vector<uint64_t> ChildHashVec;
     for (unsigned I = Topo.size(); I > 0; --I) {
-        auto *N = Topo[I - 1];
+        auto *N = Layout.node(Topo[I - 1]);
 
-        std::string Str = std::to_string(N->getConditionID());
-        Children.clear();
+        ChildHashVec.clear();
         for (auto *Ch: N->Children) {
-            Children.insert(NodeHashMap[Ch]);
-        }
-        for (auto &Ch: Children) {
-            Str.append(".").append(Ch);
+            ChildHashVec.push_back(NodeHashVec[Layout.index(Ch)]);
+        }
+        std::sort(ChildHashVec.begin(), ChildHashVec.end());
+        auto Hash = fmix(N->getConditionID());
+        for (auto ChHash: ChildHashVec) {
+            Hash = fmix(Hash ^ ChHash) + 0x9e3779b97f4a7c15ULL;
+        }
+
+        // two different structures colliding, the latter moves to the next hash
+        SliceGraphNode *SameHashNode = nullptr;
+        while (true) {
+            // the largest two are reserved by the dense map
+            if (Hash >= DenseMapInfo<uint64_t>::getTombstoneKey()) Hash = 0;
+            auto It = HashNodeMap.try_emplace(Hash, N);
+            if (It.second) break;
+            auto *X = It.first->second;
+            if (X->getConditionID() == N->getConditionID() && X->Children == N->Children) {
+                SameHashNode = X;
+                break;
+            }
+            ++Hash;
         }
-
-        MD5 Hash;
-        Hash.update(Str);
-        MD5::MD5Result Res;
-        Hash.final(Res);
-        auto Digest = Res.digest().str().str();
-        NodeHashMap[N] = Digest;
-        auto It = HashNodeMap.find(Digest);
-        if (It == HashNodeMap.end()) {
-            HashNodeMap[Digest] = N;
-        } else {
+        NodeHashVec[Topo[I - 1]] = Hash;
+        if (SameHashNode) {
             // merge, N's all parents should connect to SameHashNode
-            auto *SameHashNode = It->second;
             for (auto *NParent: N->Parents) {
                 NParent->Children.insert(SameHashNode);
                 SameHashNode->Parents.insert(NParent);
@@ -652,17 +696,14 @@ static bool isFree(const z3::expr &E) {
 
 void SliceGraph::simplifyBeforeSymbolicExecution() {
     // step 1
-    std::set<SliceGraphNode *> Visited;
-    dfs([&Visited](SliceGraphNode *N) {
-        Visited.insert(N);
-    });
-    std::set<SliceGraphNode *> ToRemove;
-    for (auto N: Visited) {
+    auto Layout = layout();
+    std::vector<SliceGraphNode *> ToRemove;
+    for (auto I: Layout.addressOrder()) {
+        auto *N = Layout.node(I);
         if (isFree(N->getCondition())) {
-            ToRemove.insert(N);
-        }
-        if (N->getCondition().is_true() && N->getConditionID() == Z3::id(N->getCondition())) {
-            ToRemove.insert(N);
+            ToRemove.push_back(N);
+        } else if (N->getCondition().is_true() && N->getConditionID() == Z3::id(N->getCondition())) {
+            ToRemove.push_back(N);
         }
     }
     for (auto *X: ToRemove) remove(X, true);
@@ -721,49 +762,38 @@ z3::expr SliceGraph::simplify(const z3::expr &Expr) const {
     }
 }
 
-void SliceGraph::postOrder(SliceGraphNode *N, std::set<SliceGraphNode *> &Visited, std::vector<SliceGraphNode *> &Ret) {
-    if (Visited.count(N)) return;
-    Visited.insert(N);
-
-    for (auto *Ch: N->Children) {
-        postOrder(Ch, Visited, Ret);
-    }
-    Ret.push_back(N);
-}
-
-void SliceGraph::postOrder(std::vector<SliceGraphNode *> &Ret) {
-    std::set<SliceGraphNode *> Visited;
-    for (auto *Entry: Entries) {
-        postOrder(Entry, Visited, Ret);
-    }
+std::vector<unsigned> SliceGraphLayout::addressOrder() const {
+    std::vector<unsigned> Ret(size());
+    for (unsigned I = 0; I < size(); ++I) Ret[I] = I;
+    std::sort(Ret.begin(), Ret.end(), [this](unsigned A, unsigned B) { return Nodes[A] < Nodes[B]; });
+    return Ret;
 }
 
-void SliceGraph::topoOrder(std::vector<SliceGraphNode *> &Ret) {
-    std::map<SliceGraphNode *, unsigned> IndegreeMap;
-    dfs([&IndegreeMap](SliceGraphNode *N) { IndegreeMap[N] = N->Parents.size(); });
+void SliceGraph::topoOrder(const SliceGraphLayout &Layout, std::vector<unsigned> &Ret) const {
+    std::vector<unsigned> Indegree(Layout.size());
+    for (unsigned I = 0; I < Layout.size(); ++I)
+        Indegree[I] = Layout.parents(I).size();
 
-    std::set<SliceGraphNode *> WorkList;
-    for (auto *Entry: Entries) {
-        WorkList.insert(Entry);
+    // like addressOrder, the work list pops the node with the least address first
+    auto Later = [&Layout](unsigned A, unsigned B) { return Layout.node(A) > Layout.node(B); };
+    std::priority_queue<unsigned, std::vector<unsigned>, decltype(Later)> WorkList(Later);
+    for (auto Entry: Layout.entries()) {
+        WorkList.push(Entry);
     }
     while (!WorkList.empty()) {
-        auto *Begin = *WorkList.begin();
-        WorkList.erase(Begin);
+        auto Begin = WorkList.top();
+        WorkList.pop();
         Ret.push_back(Begin);
 
         // update indegree and worklist
-        for (auto *Ch: Begin->Children) {
-            auto XIt = IndegreeMap.find(Ch);
-            assert(XIt != IndegreeMap.end());
-            XIt->second--;
-            if (XIt->second == 0) {
-                WorkList.insert(Ch);
+        for (auto Ch: Layout.children(Begin)) {
+            assert(Indegree[Ch]);
+            if (--Indegree[Ch] == 0) {
+                WorkList.push(Ch);
             }
         }
     }
-    for (auto &It: IndegreeMap) {
-        assert(!It.second);
-    }
+    assert(Ret.size() == Layout.size());
 }
 
 static std::vector<z3::expr> tryMerge(std::vector<std::vector<z3::expr>> &CondVec,
@@ -849,33 +879,35 @@ z3::expr SliceGraph::pc() {
     Exits.insert(Exit);
 
     // compute the reverse post order vector
-    std::vector<SliceGraphNode *> ReversePostOrder;
-    postOrder(ReversePostOrder);
+    auto Layout = layout();
+    std::vector<unsigned> ReversePostOrder;
+    Layout.postOrder(ReversePostOrder);
     std::reverse(ReversePostOrder.begin(), ReversePostOrder.end());
 
     // traverse the post order vector, when merging, pull the common prefix out
     typedef std::vector<z3::expr> PrevCondition;
-    std::map<SliceGraphNode *, std::vector<PrevCondition>> InVec;
-    for (auto *Entry: Entries) {
+    std::vector<std::vector<PrevCondition>> InVec(Layout.size());
+    for (auto Entry: Layout.entries()) {
         auto &Vec = InVec[Entry];
         Vec.emplace_back();
         Vec.back().push_back(Z3::bool_val(true));
     }
-    for (auto *Node: ReversePostOrder) {
+    for (auto NodeIdx: ReversePostOrder) {
+        auto *Node = Layout.node(NodeIdx);
         //errs()<< "node: "<< Node->getCondition() << " Entries.count(Node) = "<< Entries.count(Node)<<" . Node->getNumParents() = " << Node->getNumParents() << " InVec[Node].size() = "<<InVec[Node].size()<<"\n";
         // for(std::set<SliceGraphNode *>::const_iterator i = Node->parent_begin(); i!=Node->parent_end();i++){
         //     errs() << "parent node condition: " << (*i)->getCondition()<<"\n";
         // }
-        assert(Entries.count(Node) || Node->getNumParents() == InVec[Node].size());
-        auto &PrevCondVec = InVec[Node];
+        assert(Entries.count(Node) || Node->getNumParents() == InVec[NodeIdx].size());
+        auto &PrevCondVec = InVec[NodeIdx];
         PrevCondition PrevCond = merge(PrevCondVec);
-        for (auto *Ch: Node->Children) {
+        for (auto Ch: Layout.children(NodeIdx)) {
             auto &ChInVec = InVec[Ch];
             ChInVec.push_back(PrevCond);
             ChInVec.back().push_back(Node->getCondition());
         }
 
-        if (Node == ReversePostOrder.back()) {
+        if (NodeIdx == ReversePostOrder.back()) {
             // the last node, we need return;
             assert(Node == Exit);
 //            // @{
@@ -18,7 +18,12 @@
 
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Debug.h>
+#include <atomic>
+#include <climits>
+#include <thread>
+#include <tuple>
 #include "Core/SymbolicExecution.h"
+#include "Support/FlatHash.h"
 #include "Support/TimeRecorder.h"
 
 #define DEBUG_TYPE "SymbolicExecution"
@@ -27,6 +32,32 @@ using namespace llvm;
 
 static cl::opt<bool> SEDefense("pardiff-enable-safe-se", cl::desc("enable safe se"), cl::init(false));
 
+static cl::opt<bool> SEStreaming("pardiff-se-streaming",
+                                 cl::desc("prune infeasible and unrelated tree nodes as soon as their subtrees "
+                                          "are executed, so that the unpruned tree is never kept"),
+                                 cl::init(true));
+
+static cl::opt<unsigned> SEThreads("pardiff-se-threads",
+                                   cl::desc("the number of threads executing on the slice, 0 means one per core"),
+                                   cl::init(1));
+
+static cl::opt<unsigned> SETaskSize("pardiff-se-task-size",
+                                    cl::desc("a branch with at most this number of paths in the slice is executed "
+                                             "as a task in another thread"),
+                                    cl::init(64));
+
+namespace {
+/// a thread executing tasks, which has its own z3 session holding the exprs translated for the tasks
+struct SymbolicExecutionWorker {
+    std::unique_ptr<Z3Session> Session;
+    std::vector<z3::expr> Exprs;
+    SymbolicExecution Executor;
+    /// the index of a task and the root of its subtree
+    std::vector<std::pair<unsigned, SymbolicExecutionTreeNode *>> Results;
+    std::exception_ptr Error;
+};
+} // namespace
+
 static void select(std::map<unsigned, std::vector<unsigned>>::iterator It,
                    std::map<unsigned, std::vector<unsigned>>::iterator End,
                    PushPopVector<PhiPointer> &Combo,
@@ -50,11 +81,77 @@ static void select(std::map<unsigned, std::vector<unsigned>>::iterator It,
     Combo.pop();
 }
 
+/// collect the phis, the ids queried, and the atoms in an expr, see SliceReach
+///
+/// the exprs are visited in pre-order with an explicit stack, so that a deep expr does not overflow the call stack
+static void collect(const z3::expr &Expr, FlatIDSet &Visited, SliceReach &R) {
+    z3::expr_vector Stack = Z3::vec();
+    Stack.push_back(Expr);
+    while (!Stack.empty()) {
+        auto E = Stack.back();
+        Stack.pop_back();
+        if (!Visited.insert(Z3::id(E)) || !E.is_app()) continue;
+        if (Z3::is_phi(E)) {
+            auto PhiID = Z3::phi_id(E);
+            R.Phis.push_back(PhiID);
+            for (unsigned I = 0; I < E.num_args(); ++I) R.Queries.push_back(Z3::phi_cond_id(PhiID, I));
+        } else if (E.decl().decl_kind() == Z3_OP_SELECT) {
+            R.Queries.push_back(Z3::id(E.arg(1)));
+            R.Atoms.push_back(Z3::id(E));
+        } else if (E.num_args() == 0 && !E.is_numeral() && !E.is_array()) {
+            R.Atoms.push_back(Z3::id(E));
+        }
+        for (unsigned I = E.num_args(); I > 0; --I) Stack.push_back(E.arg(I - 1));
+    }
+}
+
+/// an assertion a tree node can be removed for, see SymbolicExecutionTree::compressOffsprings
+static bool notRelated(const z3::expr &E) {
+    return E.is_false() || E.is_true() || Z3::is_free(E);
+}
+
+static void unique(std::vector<unsigned> &Vec) {
+    std::sort(Vec.begin(), Vec.end());
+    Vec.erase(std::unique(Vec.begin(), Vec.end()), Vec.end());
+}
+
+static void merge(std::vector<unsigned> &Vec, const std::vector<unsigned> &Other) {
+    std::vector<unsigned> Ret;
+    Ret.reserve(Vec.size() + Other.size());
+    std::set_union(Vec.begin(), Vec.end(), Other.begin(), Other.end(), std::back_inserter(Ret));
+    Vec.swap(Ret);
+}
+
+static bool intersect(const std::vector<unsigned> &Vec1, const std::vector<unsigned> &Vec2) {
+    auto It1 = Vec1.begin(), It2 = Vec2.begin();
+    while (It1 != Vec1.end() && It2 != Vec2.end()) {
+        if (*It1 < *It2) ++It1;
+        else if (*It2 < *It1) ++It2;
+        else return true;
+    }
+    return false;
+}
+
 SymbolicExecutionTree *SymbolicExecution::run(const z3::expr &PC, SliceGraph &SG) {
     findDupPhiVal(PC);
     auto *FakeRoot = new SymbolicExecutionTreeNode();
     auto *Tree = new SymbolicExecutionTree(FakeRoot);
 
+    unsigned NumThreads = SEThreads ? SEThreads : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<SymbolicExecutionTask> TaskVec;
+    if (NumThreads > 1) {
+        Tasks = &TaskVec;
+        // the named elements a task may look up are the phi conditions, and the select indices named on the way
+        SG.dfs([this](SliceGraphNode *N) {
+            if (N->getConditionID() == Z3::id(N->getCondition()))
+                NamedExprMap.emplace(N->getConditionID(), N->getCondition());
+            auto Phis = Z3::find_all(N->getCondition(), true, [](const z3::expr &E) { return Z3::is_phi(E); });
+            for (auto Phi: Phis) {
+                for (auto Cond: Z3::phi_cond(Z3::phi_id(Phi))) NamedExprMap.emplace(Z3::id(Cond), Cond);
+            }
+        });
+    }
+
     std::vector<std::pair<SliceGraphNode *, std::vector<PhiPointer>>> EntryStateVec;
     for (auto EntryIt = SG.entry_begin(), E = SG.entry_end(); EntryIt != E; ++EntryIt) {
         auto *Entry = *EntryIt;
@@ -67,20 +164,244 @@ SymbolicExecutionTree *SymbolicExecution::run(const z3::expr &PC, SliceGraph &SG
     }
 
     for (auto &State: EntryStateVec) {
-        doSymbolicExecutionDFS(FakeRoot, State.first, State.second);
+        doSymbolicExecution(FakeRoot, State.first, State.second);
     }
 
     PhiSelectorStack.reset();
     BNFExecutionPath.reset();
     NamedElementStack.reset();
     PathCondStack.reset();
+    if (!TaskVec.empty()) runInParallel(SG, TaskVec, NumThreads);
+    pardiff_INFO("Symbolic Execution: " << NumTreeNodes << " tree nodes, " << NumSharedSubtrees << " shared subtrees, "
+                                        << TaskVec.size() << " tasks");
+    Tasks = nullptr;
+    SubtreeMap.clear();
+    ReachMap.clear();
+    PathCondAtomMap.clear();
+    NamedExprMap.clear();
+    PathNumMap.clear();
     return Tree;
 }
 
+void SymbolicExecution::doSymbolicExecution(SymbolicExecutionTreeNode *PrevTreeNode, SliceGraphNode *CurrGraphNode,
+                                            std::vector<PhiPointer> &PhiSelectors) {
+    if (Tasks && pathNum(CurrGraphNode) <= SETaskSize) {
+        fork(PrevTreeNode, CurrGraphNode, PhiSelectors);
+    } else {
+        doSymbolicExecutionDFS(PrevTreeNode, CurrGraphNode, PhiSelectors);
+    }
+}
+
+void SymbolicExecution::fork(SymbolicExecutionTreeNode *PrevTreeNode, SliceGraphNode *CurrGraphNode,
+                             std::vector<PhiPointer> &PhiSelectors) {
+    Tasks->emplace_back();
+    auto &Task = Tasks->back();
+    Task.Parent = PrevTreeNode;
+    Task.Node = CurrGraphNode;
+    Task.Selectors = PhiSelectors;
+    Task.PhiSelectors = PhiSelectorStack.get();
+    for (auto ID: NamedElementStack.get()) {
+        // an element without an expr is never looked up, see run
+        auto It = NamedExprMap.find(ID);
+        if (It != NamedExprMap.end()) Task.Named.push_back(It->second);
+    }
+    Task.PathConds = PathCondStack.get();
+}
+
+void SymbolicExecution::runInParallel(SliceGraph &SG, std::vector<SymbolicExecutionTask> &TaskVec,
+                                      unsigned NumThreads) {
+    // collect the exprs the tasks need, so that they are translated for a thread at once
+    std::vector<z3::expr> Exprs;
+    std::unordered_map<unsigned, unsigned> PosMap;
+    auto Pos = [&Exprs, &PosMap](const z3::expr &E) -> unsigned {
+        auto It = PosMap.find(Z3::id(E));
+        if (It != PosMap.end()) return It->second;
+        PosMap[Z3::id(E)] = Exprs.size();
+        Exprs.push_back(E);
+        return Exprs.size() - 1;
+    };
+    // a slice node, the position of its condition, and the position of the expr it names
+    std::vector<std::tuple<SliceGraphNode *, unsigned, unsigned>> Conditions;
+    std::set<unsigned> PhiIDs;
+    SG.dfs([this, &Pos, &Conditions, &PhiIDs](SliceGraphNode *N) {
+        auto It = NamedExprMap.find(N->getConditionID());
+        Conditions.emplace_back(N, Pos(N->getCondition()), It == NamedExprMap.end() ? UINT_MAX : Pos(It->second));
+        auto Phis = Z3::find_all(N->getCondition(), true, [](const z3::expr &E) { return Z3::is_phi(E); });
+        for (auto Phi: Phis) PhiIDs.insert(Z3::phi_id(Phi));
+    });
+    for (auto &Task: TaskVec) {
+        for (auto &E: Task.Named) Task.NamedPos.push_back(Pos(E));
+        for (auto &E: Task.PathConds) Task.PathCondPos.push_back(Pos(E));
+    }
+
+    std::vector<std::unique_ptr<SymbolicExecutionWorker>> Workers;
+    for (unsigned I = 0; I < std::min<size_t>(NumThreads, TaskVec.size()); ++I) {
+        Workers.emplace_back(new SymbolicExecutionWorker);
+        auto &W = *Workers.back();
+        W.Session = std::make_unique<Z3Session>(&Z3Session::current());
+        Z3::translate(Exprs, *W.Session, W.Exprs);
+        Z3::translate_phis(PhiIDs, *W.Session);
+        W.Executor.PhiID2DupValIDMap = PhiID2DupValIDMap;
+        for (auto &C: Conditions) {
+            auto NamedPos = std::get<2>(C);
+            auto ID = NamedPos == UINT_MAX ? UINT_MAX : Z3::id(W.Exprs[NamedPos]);
+            W.Executor.ConditionMap.emplace(std::get<0>(C), std::make_pair(W.Exprs[std::get<1>(C)], ID));
+        }
+    }
+
+    // the largest tasks go first, so that the threads finish at about the same time
+    std::vector<unsigned> Order(TaskVec.size());
+    for (unsigned K = 0; K < Order.size(); ++K) Order[K] = K;
+    std::stable_sort(Order.begin(), Order.end(), [this, &TaskVec](unsigned X, unsigned Y) {
+        return pathNum(TaskVec[X].Node) > pathNum(TaskVec[Y].Node);
+    });
+
+    std::atomic<unsigned> Next{0};
+    auto Work = [&TaskVec, &Order, &Next](SymbolicExecutionWorker &W) {
+        Z3Session::Scope EnterSession(*W.Session);
+        try {
+            for (unsigned K = Next++; K < Order.size(); K = Next++) {
+                W.Results.emplace_back(Order[K], W.Executor.runTask(TaskVec[Order[K]], W.Exprs));
+            }
+        } catch (...) {
+            W.Error = std::current_exception();
+        }
+    };
+    std::vector<std::thread> Threads;
+    for (unsigned I = 1; I < Workers.size(); ++I) Threads.emplace_back(Work, std::ref(*Workers[I]));
+    Work(*Workers[0]);
+    for (auto &T: Threads) T.join();
+    for (auto &W: Workers) {
+        if (W->Error) std::rethrow_exception(W->Error);
+    }
+
+    // translate the subtrees back, and put them under the tree nodes they are forked from
+    for (auto &W: Workers) {
+        std::vector<SymbolicExecutionTreeNode *> Nodes;
+        std::set<SymbolicExecutionTreeNode *> Visited;
+        std::vector<SymbolicExecutionTreeNode *> Stack;
+        for (auto &Result: W->Results) {
+            Stack.insert(Stack.end(), Result.second->getChildren().begin(), Result.second->getChildren().end());
+        }
+        while (!Stack.empty()) {
+            auto *Top = Stack.back();
+            Stack.pop_back();
+            if (!Visited.insert(Top).second) continue;
+            Nodes.push_back(Top);
+            Stack.insert(Stack.end(), Top->getChildren().begin(), Top->getChildren().end());
+        }
+
+        std::vector<z3::expr> NodeExprs, Translated;
+        for (auto *Node: Nodes) NodeExprs.push_back(Node->getExpr());
+        Z3::translate(NodeExprs, Z3Session::current(), Translated);
+        for (unsigned I = 0; I < Nodes.size(); ++I) Nodes[I]->setExpr(Translated[I]);
+
+        for (auto &Result: W->Results) {
+            for (auto *Ch: Result.second->getChildren()) TaskVec[Result.first].Parent->addChild(Ch);
+            delete Result.second;
+        }
+        NumTreeNodes += W->Executor.NumTreeNodes;
+        NumSharedSubtrees += W->Executor.NumSharedSubtrees;
+    }
+}
+
+SymbolicExecutionTreeNode *SymbolicExecution::runTask(const SymbolicExecutionTask &Task,
+                                                      const std::vector<z3::expr> &Exprs) {
+    PhiSelectorStack.push();
+    NamedElementStack.push();
+    PathCondStack.push();
+    for (auto &Selector: Task.PhiSelectors) PhiSelectorStack.add(Selector);
+    for (auto Pos: Task.NamedPos) NamedElementStack.add(Z3::id(Exprs[Pos]));
+    for (auto Pos: Task.PathCondPos) PathCondStack.push_back(Exprs[Pos]);
+
+    auto *Root = new SymbolicExecutionTreeNode;
+    auto Selectors = Task.Selectors;
+    doSymbolicExecutionDFS(Root, Task.Node, Selectors);
+
+    PathCondStack.pop();
+    NamedElementStack.pop();
+    PhiSelectorStack.pop();
+    return Root;
+}
+
+uint64_t SymbolicExecution::pathNum(SliceGraphNode *Node) {
+    auto It = PathNumMap.find(Node);
+    if (It != PathNumMap.end()) return It->second;
+
+    uint64_t Num = Node->getNumChildren() ? 0 : 1;
+    for (auto ChIt = Node->child_begin(), ChE = Node->child_end(); ChIt != ChE; ++ChIt) {
+        Num = std::min<uint64_t>(Num + pathNum(*ChIt), UINT32_MAX);
+    }
+    return PathNumMap[Node] = Num;
+}
+
+z3::expr SymbolicExecution::condition(SliceGraphNode *Node) const {
+    if (ConditionMap.empty()) return Node->getCondition();
+    return ConditionMap.at(Node).first;
+}
+
+unsigned SymbolicExecution::conditionID(SliceGraphNode *Node) const {
+    if (ConditionMap.empty()) return Node->getConditionID();
+    return ConditionMap.at(Node).second;
+}
+
+const SliceReach &SymbolicExecution::reach(SliceGraphNode *Node) {
+    auto It = ReachMap.find(Node);
+    if (It != ReachMap.end()) return It->second;
+
+    // the slice graph is a dag, so the reach of a node is its own plus its children's
+    SliceReach R;
+    FlatIDSet Visited;
+    collect(condition(Node), Visited, R);
+    unique(R.Phis);
+    unique(R.Queries);
+    unique(R.Atoms);
+    for (auto ChIt = Node->child_begin(), ChE = Node->child_end(); ChIt != ChE; ++ChIt) {
+        auto &ChR = reach(*ChIt);
+        merge(R.Phis, ChR.Phis);
+        merge(R.Queries, ChR.Queries);
+        merge(R.Atoms, ChR.Atoms);
+    }
+    return ReachMap[Node] = std::move(R);
+}
+
+std::vector<uint64_t> SymbolicExecution::subtreeKey(SliceGraphNode *Node) {
+    // the executions from a node only depend on
+    //   1. the selectors of the phis they meet,
+    //   2. the named elements they look up,
+    //   3. the path conditions that may simplify their conditions, see doSymbolicExecutionEliminateConflict.
+    // exprs in the path conditions are kept alive by PathCondAtomMap, thus their ids are not reused
+    auto &R = reach(Node);
+    std::vector<uint64_t> Key;
+    Key.push_back((uint64_t) (uintptr_t) Node);
+    for (auto PhiID: R.Phis) {
+        auto It = PhiSelectorStack.find({PhiID, 0});
+        if (It != PhiSelectorStack.end()) Key.push_back(((uint64_t) PhiID << 32) | It->Selected);
+    }
+    Key.push_back(UINT64_MAX);
+    for (auto ID: R.Queries) {
+        if (NamedElementStack.contains(ID)) Key.push_back(ID);
+    }
+    Key.push_back(UINT64_MAX);
+    for (auto &C: PathCondStack) {
+        if (Z3::is_naming_eq(C)) continue;
+        auto It = PathCondAtomMap.find(Z3::id(C));
+        if (It == PathCondAtomMap.end()) {
+            SliceReach CR;
+            FlatIDSet Visited;
+            collect(C, Visited, CR);
+            unique(CR.Atoms);
+            It = PathCondAtomMap.emplace(Z3::id(C), std::make_pair(C, std::move(CR.Atoms))).first;
+        }
+        if (intersect(It->second.second, R.Atoms)) Key.push_back(Z3::id(C));
+    }
+    return Key;
+}
+
 void SymbolicExecution::evaluatePhi(SliceGraphNode *Node, std::map<unsigned int, std::vector<unsigned int>> &Ret) {
-    std::set<unsigned> Visited;
+    FlatIDSet Visited;
     std::vector<z3::expr> Stack;
-    Stack.push_back(Node->getCondition());
+    Stack.push_back(condition(Node));
     while (!Stack.empty()) {
         auto Top = Stack.back();
         Stack.pop_back();
@@ -147,16 +468,30 @@ void SymbolicExecution::doSymbolicExecutionDFS(SymbolicExecutionTreeNode *PrevTr
     BNFExecutionPath.push();
     NamedElementStack.push();
     PathCondStack.push();
-    LLVM_DEBUG(dbgs() << "[SE] Visit: " << CurrGraphNode->getCondition() << "\n");
+    LLVM_DEBUG(dbgs() << "[SE] Visit: " << condition(CurrGraphNode) << "\n");
 
-    auto *CurrTreeNode = new SymbolicExecutionTreeNode;
-    PrevTreeNode->addChild(CurrTreeNode);
     BNFExecutionPath.push_back(CurrGraphNode);
-    NamedElementStack.add(CurrGraphNode->getConditionID());
+    NamedElementStack.add(conditionID(CurrGraphNode));
     for (auto &Selector: PhiSelectors) PhiSelectorStack.add(Selector);
 
+    auto Key = subtreeKey(CurrGraphNode);
+    auto SubtreeIt = SubtreeMap.find(Key);
+    if (SubtreeIt != SubtreeMap.end()) {
+        LLVM_DEBUG(dbgs() << "[SE] \tShared: " << SubtreeIt->second.size() << " nodes\n");
+        for (auto *Node: SubtreeIt->second) PrevTreeNode->addChild(Node);
+        ++NumSharedSubtrees;
+        PathCondStack.pop();
+        NamedElementStack.pop();
+        PhiSelectorStack.pop();
+        BNFExecutionPath.pop();
+        return;
+    }
+
+    auto *CurrTreeNode = new SymbolicExecutionTreeNode;
+    ++NumTreeNodes;
+
     // simplify and eliminate phi according to phi selectors
-    auto SimplifiedExpr = doSymbolicExecutionSimplify(CurrGraphNode->getCondition());
+    auto SimplifiedExpr = doSymbolicExecutionSimplify(condition(CurrGraphNode));
     PathCondStack.push_back(SimplifiedExpr);
     LLVM_DEBUG(dbgs() << "[SE] \tSimplified: " << SimplifiedExpr << "\n");
 
@@ -164,10 +499,12 @@ void SymbolicExecution::doSymbolicExecutionDFS(SymbolicExecutionTreeNode *PrevTr
     CurrTreeNode->setExpr(SimplifiedExpr);
 
     // check feasibility and continue
+    auto NumTasks = Tasks ? Tasks->size() : 0;
     if (!SimplifiedExpr.is_false()) {
         if (CurrGraphNode->getNumChildren() == 0) {
             auto *FakeExit = new SymbolicExecutionTreeNode;
             CurrTreeNode->addChild(FakeExit);
+            ++NumTreeNodes;
         } else {
             std::vector<std::pair<SliceGraphNode *, std::vector<PhiPointer>>> ChildStateVec;
             for (auto ChIt = CurrGraphNode->child_begin(), ChE = CurrGraphNode->child_end(); ChIt != ChE; ++ChIt) {
@@ -181,13 +518,30 @@ void SymbolicExecution::doSymbolicExecutionDFS(SymbolicExecutionTreeNode *PrevTr
             }
 
             for (auto &ChState: ChildStateVec) {
-                doSymbolicExecutionDFS(CurrTreeNode, ChState.first, ChState.second);
+                doSymbolicExecution(CurrTreeNode, ChState.first, ChState.second);
             }
         }
     } else {
         CurrTreeNode->setExpr(Z3::bool_val(false));
     }
 
+    // the slice graph is a dag, so the subtree cannot be met again when executing itself
+    auto &Subtree = SubtreeMap[Key];
+    if (!SEStreaming || (Tasks && Tasks->size() != NumTasks)) {
+        // the branches forked as tasks in this subtree are not executed yet, so it cannot be pruned now
+        Subtree.push_back(CurrTreeNode);
+    } else if (CurrTreeNode->getExpr().is_false() || CurrTreeNode->getChildren().empty()) {
+        // all paths are infeasible, see SymbolicExecutionTree::compressInfeasiblePaths
+        delete CurrTreeNode;
+    } else if (notRelated(CurrTreeNode->getExpr())) {
+        // lift the children, see SymbolicExecutionTree::compressOffsprings
+        Subtree.assign(CurrTreeNode->getChildren().begin(), CurrTreeNode->getChildren().end());
+        delete CurrTreeNode;
+    } else {
+        Subtree.push_back(CurrTreeNode);
+    }
+    for (auto *Node: Subtree) PrevTreeNode->addChild(Node);
+
     PathCondStack.pop();
     NamedElementStack.pop();
     PhiSelectorStack.pop();
@@ -268,6 +622,9 @@ z3::expr SymbolicExecution::doSymbolicExecutionEliminateUselessNaming(const z3::
         } else {
             for (auto Elmt: Elements)
                 NamedElementStack.add(Elmt);
+            if (Tasks) {
+                for (auto Select: Selects) NamedExprMap.emplace(Z3::id(Select.arg(1)), Select.arg(1));
+            }
         }
     }
     return Expr;
@@ -25,7 +25,6 @@ using namespace llvm;
 
 void SymbolicExecutionTreeNode::addChild(SymbolicExecutionTreeNode *E) {
     Children.insert(E);
-    E->Parent = this;
 }
 
 SymbolicExecutionTree::~SymbolicExecutionTree() {
@@ -58,10 +57,10 @@ void SymbolicExecutionTree::dot(std::string &File, const char *NameSuffix) const
         return;
     }
 
-    auto DotNode = [](SymbolicExecutionTreeNode *Node, raw_ostream &OS) {
+    auto DotNode = [this](SymbolicExecutionTreeNode *Node, raw_ostream &OS) {
         const char *EntryExitStyle = R"(shape=record,color="#3d50c3ff", style=filled, fillcolor="#abc8fd70")";
         const char *OtherStyle = R"(shape=record,color="#b70d28ff", style=filled, fillcolor="#b70d2870")";
-        bool RootOrLeaves = Node->Parent == nullptr || Node->Children.empty();
+        bool RootOrLeaves = Node == Root || Node->Children.empty();
         OS << "\ta" << Node << "[" << (RootOrLeaves ? EntryExitStyle : OtherStyle) << ", label=\"{";
         auto Str = Z3::to_string(Node->Expr, true);
         if (Str.length() > 100)
@@ -91,128 +90,157 @@ void SymbolicExecutionTree::dot(std::string &File, const char *NameSuffix) const
     pardiff_INFO(RealFileNameStr << " dotted!");
 }
 
+std::set<SymbolicExecutionTreeNode *> SymbolicExecutionTree::nodes() const {
+    std::set<SymbolicExecutionTreeNode *> Ret;
+    dfs([&Ret](SymbolicExecutionTreeNode *Node) { Ret.insert(Node); });
+    return Ret;
+}
+
 void SymbolicExecutionTree::simplify() {
+    auto Before = nodes();
+
     // step 0: remove infeasible paths
-    compressInfeasiblePaths();
+    std::map<SymbolicExecutionTreeNode *, bool> FeasibleMap;
+    compressInfeasiblePaths(Root, FeasibleMap);
 
     // step 1: remove redundant parent-children relations
-    compressOffsprings();
+    std::map<std::pair<SymbolicExecutionTreeNode *, unsigned>, std::set<SymbolicExecutionTreeNode *>> OffspringMap;
+    std::set<SymbolicExecutionTreeNode *> RootChildren;
+    for (auto *Ch: Root->Children) {
+        auto &Offsprings = compressOffsprings(Ch, Root->getExpr(), OffspringMap);
+        RootChildren.insert(Offsprings.begin(), Offsprings.end());
+    }
+    Root->Children = std::move(RootChildren);
 
     // step 2: remove redundant sibling relations
-    compressSiblings();
-}
-
-void SymbolicExecutionTree::compressInfeasiblePaths() {
-    std::vector<SymbolicExecutionTreeNode *> FalseNodeVec;
-    std::stack<SymbolicExecutionTreeNode *> DFSStack;
-    DFSStack.push(Root);
-    while (!DFSStack.empty()) {
-        auto Top = DFSStack.top();
-        DFSStack.pop();
-
-        if (Top->getExpr().is_false()) {
-            assert(Top != Root);
-            assert(Top->Children.empty());
-            FalseNodeVec.push_back(Top);
-        }
-
-        for (auto *Ch: Top->Children) {
-            //if (!Ch->Children.empty())
-                DFSStack.push(Ch);
-        }
+    std::set<SymbolicExecutionTreeNode *> Visited;
+    compressSiblings(Root, Visited);
+
+    // release the nodes that are removed from the tree
+    auto After = nodes();
+    Before.insert(Created.begin(), Created.end());
+    Created.clear();
+    for (auto *Node: Before) {
+        if (!After.count(Node)) delete Node;
     }
+}
 
-    while (!FalseNodeVec.empty()) {
-        auto FalseNode = FalseNodeVec.back();
-        FalseNodeVec.pop_back();
-        assert(FalseNode != Root);
-
-        // remove FalseNode
-        auto *Parent = FalseNode->Parent;
-        Parent->Children.erase(FalseNode);
-        FalseNode->Parent = nullptr;
-        delete FalseNode;
-
-        if (Parent->Children.empty()) {
-            FalseNodeVec.push_back(Parent);
+bool SymbolicExecutionTree::compressInfeasiblePaths(SymbolicExecutionTreeNode *Node,
+                                                    std::map<SymbolicExecutionTreeNode *, bool> &FeasibleMap) {
+    auto It = FeasibleMap.find(Node);
+    if (It != FeasibleMap.end()) return It->second;
+
+    bool Feasible = true;
+    if (Node->getExpr().is_false()) {
+        assert(Node != Root);
+        assert(Node->Children.empty());
+        Feasible = false;
+    } else if (!Node->Children.empty()) {
+        // a node is removed if all its children are removed
+        auto ChIt = Node->Children.begin();
+        while (ChIt != Node->Children.end()) {
+            if (compressInfeasiblePaths(*ChIt, FeasibleMap)) {
+                ++ChIt;
+            } else {
+                ChIt = Node->Children.erase(ChIt);
+            }
         }
+        Feasible = !Node->Children.empty();
     }
+    FeasibleMap[Node] = Feasible;
+    return Feasible;
 }
 
-void SymbolicExecutionTree::compressOffsprings() {
+const std::set<SymbolicExecutionTreeNode *> &
+SymbolicExecutionTree::compressOffsprings(SymbolicExecutionTreeNode *Node, const z3::expr &Ancestor,
+                                          std::map<std::pair<SymbolicExecutionTreeNode *, unsigned>,
+                                                  std::set<SymbolicExecutionTreeNode *>> &OffspringMap) {
     auto NotRelated = [](const z3::expr &E) {
         return E.is_false() || E.is_true() || Z3::is_free(E);
     };
 
-    std::stack<SymbolicExecutionTreeNode *> DFSStack;
-    DFSStack.push(Root);
-    while (!DFSStack.empty()) {
-        auto Top = DFSStack.top();
-        DFSStack.pop();
-        for (auto *Ch: Top->Children) {
-            if (!Ch->Children.empty())
-                DFSStack.push(Ch);
+    auto Key = std::make_pair(Node, Z3::id(Ancestor));
+    auto It = OffspringMap.find(Key);
+    if (It != OffspringMap.end()) return It->second;
+
+    std::set<SymbolicExecutionTreeNode *> Ret;
+    if (Node->Children.empty()) {
+        Ret.insert(Node);
+    } else if (NotRelated(Node->getExpr()) || Z3::same(Node->getExpr(), Ancestor)) {
+        // remove the node, and its children are lifted to the ancestor
+        for (auto *Ch: Node->Children) {
+            auto &Offsprings = compressOffsprings(Ch, Ancestor, OffspringMap);
+            Ret.insert(Offsprings.begin(), Offsprings.end());
         }
-
-        if (Top == Root) continue;
-
-        auto *TopParent = Top->Parent;
-        if (NotRelated(Top->getExpr()) || Z3::same(Top->getExpr(), TopParent->getExpr())) {
-            TopParent->Children.erase(Top);
-            for (auto *Ch: Top->Children) {
-                TopParent->Children.insert(Ch);
-                Ch->Parent = TopParent;
-            }
-            delete Top;
+    } else {
+        std::set<SymbolicExecutionTreeNode *> Children;
+        for (auto *Ch: Node->Children) {
+            auto &Offsprings = compressOffsprings(Ch, Node->getExpr(), OffspringMap);
+            Children.insert(Offsprings.begin(), Offsprings.end());
+        }
+        if (Children == Node->Children) {
+            Ret.insert(Node);
+        } else {
+            // the node may be reached from other ancestors, where its children are kept, so we copy it
+            auto *Copy = new SymbolicExecutionTreeNode(Node->getExpr());
+            Copy->Children = std::move(Children);
+            Created.push_back(Copy);
+            Ret.insert(Copy);
         }
     }
+    return OffspringMap[Key] = std::move(Ret);
 }
 
-void SymbolicExecutionTree::compressSiblings() {
-    std::stack<SymbolicExecutionTreeNode *> DFSStack;
-    DFSStack.push(Root);
-    while (!DFSStack.empty()) {
-        auto Top = DFSStack.top();
-        DFSStack.pop();
-
-        auto IIt = Top->Children.begin();
-        while (IIt != Top->Children.end()) {
-            auto *I = *IIt;
-
-            auto JIt = IIt;
-            ++JIt;
-            while (JIt != Top->Children.end()) {
-                auto *J = *JIt;
-                if (Z3::same(I->getExpr(), J->getExpr())) {
-                    for (auto *JCh: J->Children) {
-                        I->Children.insert(JCh);
-                        JCh->Parent = I;
-                    }
-                    delete J;
-                    JIt = Top->Children.erase(JIt);
-                } else {
-                    JIt++;
-                }
-            }
-            IIt++;
+void SymbolicExecutionTree::compressSiblings(SymbolicExecutionTreeNode *Node,
+                                             std::set<SymbolicExecutionTreeNode *> &Visited) {
+    if (!Visited.insert(Node).second) return;
+
+    // group the children by their assertions
+    std::vector<std::vector<SymbolicExecutionTreeNode *>> Groups;
+    std::map<unsigned, unsigned> GroupIndexMap;
+    for (auto *Ch: Node->Children) {
+        auto It = GroupIndexMap.find(Z3::id(Ch->getExpr()));
+        if (It == GroupIndexMap.end()) {
+            GroupIndexMap[Z3::id(Ch->getExpr())] = Groups.size();
+            Groups.push_back({Ch});
+        } else {
+            Groups[It->second].push_back(Ch);
         }
+    }
 
-        for (auto *Ch: Top->Children) {
-            DFSStack.push(Ch);
+    std::set<SymbolicExecutionTreeNode *> Children;
+    for (auto &Group: Groups) {
+        auto *I = Group[0];
+        if (Group.size() > 1) {
+            // the siblings may have other parents, so we merge them to a new node
+            I = new SymbolicExecutionTreeNode(Group[0]->getExpr());
+            Created.push_back(I);
+            for (auto *J: Group) I->Children.insert(J->Children.begin(), J->Children.end());
         }
+        Children.insert(I);
+    }
+    Node->Children = std::move(Children);
+
+    for (auto *Ch: Node->Children) {
+        compressSiblings(Ch, Visited);
     }
 }
 
 z3::expr SymbolicExecutionTree::pc() const {
-    return pc(Root);
+    std::map<SymbolicExecutionTreeNode *, z3::expr> PCMap;
+    return pc(Root, PCMap);
 }
 
-z3::expr SymbolicExecutionTree::pc(SymbolicExecutionTreeNode *Node) const {
+z3::expr SymbolicExecutionTree::pc(SymbolicExecutionTreeNode *Node,
+                                   std::map<SymbolicExecutionTreeNode *, z3::expr> &PCMap) const {
+    auto It = PCMap.find(Node);
+    if (It != PCMap.end()) return It->second;
+
     z3::expr_vector Vec = Z3::vec();
     for (auto *Ch: Node->Children) {
-        Vec.push_back(pc(Ch));
+        Vec.push_back(pc(Ch, PCMap));
     }
-    if (Vec.empty())
-        return Node->getExpr();
-    return Node->getExpr() && z3::mk_or(Vec);
+    auto Ret = Vec.empty() ? Node->getExpr() : Node->getExpr() && z3::mk_or(Vec);
+    PCMap.emplace(Node, Ret);
+    return Ret;
 }
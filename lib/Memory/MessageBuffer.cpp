@@ -27,10 +27,7 @@ MessageBuffer::MessageBuffer(Type *Ty, unsigned Num) : MemoryBlock(Ty, Num, MK_M
     assert(Ty->isIntOrIntVectorTy(8));
 }
 
-MessageBuffer::~MessageBuffer() {
-    for (auto *AbsVal: VarIDAbsVal)
-        delete AbsVal;
-}
+MessageBuffer::~MessageBuffer() = default;
 
 AbstractValue *MessageBuffer::at(size_t ID) {
     if (ID >= Mem.size()) {
@@ -89,19 +86,15 @@ AbstractValue *MessageBuffer::at(const z3::expr &ID) {
         return at(Const);
     }
 
-    auto *Ret = new ScalarValue(1);
     z3::expr Result = Z3::bool_val(true);
     if (!hasStored(ID, Result)) {
         Result = Z3::byte_array_element(data(), ID);
     }
-    Ret->set(Result);
-    VarIDAbsVal.push_back(Ret);
-    return Ret;
+    VarIDAbsVal.emplace_back(1, Result);
+    return &VarIDAbsVal.back();
 }
 
 void MessageBuffer::gc() {
-    for (auto *AbsVal: VarIDAbsVal)
-        delete AbsVal;
     VarIDAbsVal.clear();
 }
 
@@ -122,16 +115,16 @@ void MessageBuffer::store(const z3::expr &Val, const z3::expr Offset) {
         if (Z3::is_numeral_u64(RealOffset, Const)) {
             at(Const)->set(RealValue);
         } else {
-            VariableOffsetStore.insert(std::make_pair(RealOffset, RealValue));
+            VariableOffsetStore.insert(Z3::id(RealOffset), std::make_pair(RealOffset, RealValue));
         }
         LLVM_DEBUG(dbgs() << "store " << RealValue << " to " << RealOffset << "\n");
     }
 }
 
 bool MessageBuffer::hasStored(const z3::expr &Offset, z3::expr &Result) {
-    auto It = VariableOffsetStore.find(Offset);
-    if (It == VariableOffsetStore.end()) return false;
-    Result = It->second;
+    auto *Stored = VariableOffsetStore.find(Z3::id(Offset));
+    if (!Stored) return false;
+    Result = Stored->second;
     LLVM_DEBUG(dbgs() << "load " << Result << " from " << Offset << "\n");
     return true;
 }
@@ -0,0 +1,318 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "Support/ByteDomain.h"
+#include "Z3Macro.h"
+
+static uint64_t maxOf(unsigned Width) {
+    return Width >= 64 ? UINT64_MAX : (1ULL << Width) - 1;
+}
+
+/// collect the constant indices of the bytes concatenated by \p E, the most significant first
+static bool bytesOf(const z3::expr &E, std::vector<uint64_t> &Bytes) {
+    if (!E.is_app()) return false;
+    auto Kind = E.decl().decl_kind();
+    if (Kind == Z3_OP_SELECT) {
+        auto Array = E.arg(0);
+        uint64_t Index;
+        if (!Array.is_const() || Array.decl().name().str() != BYTE_ARRAY) return false;
+        if (!Z3::is_numeral_u64(E.arg(1), Index)) return false;
+        Bytes.push_back(Index);
+        return true;
+    }
+    if (Kind == Z3_OP_CONCAT) {
+        for (unsigned I = 0; I < E.num_args(); ++I) {
+            if (!bytesOf(E.arg(I), Bytes)) return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+/// the comparison after swapping its operands
+static Z3_decl_kind swapped(Z3_decl_kind Kind) {
+    switch (Kind) {
+        case Z3_OP_ULEQ: return Z3_OP_UGEQ;
+        case Z3_OP_UGEQ: return Z3_OP_ULEQ;
+        case Z3_OP_ULT: return Z3_OP_UGT;
+        case Z3_OP_UGT: return Z3_OP_ULT;
+        case Z3_OP_SLEQ: return Z3_OP_SGEQ;
+        case Z3_OP_SGEQ: return Z3_OP_SLEQ;
+        case Z3_OP_SLT: return Z3_OP_SGT;
+        case Z3_OP_SGT: return Z3_OP_SLT;
+        default: return Kind;
+    }
+}
+
+/// the unsigned interval of the values v with (v Kind Val) != Neg, return false if it is empty
+static bool interval(Z3_decl_kind Kind, bool Neg, uint64_t Val, uint64_t Max, uint64_t &Lo, uint64_t &Hi) {
+    Lo = 0;
+    Hi = Max;
+    if (Neg) {
+        switch (Kind) {
+            case Z3_OP_ULEQ: Kind = Z3_OP_UGT; break;
+            case Z3_OP_ULT: Kind = Z3_OP_UGEQ; break;
+            case Z3_OP_UGEQ: Kind = Z3_OP_ULT; break;
+            case Z3_OP_UGT: Kind = Z3_OP_ULEQ; break;
+            default: return true;
+        }
+    }
+    switch (Kind) {
+        case Z3_OP_EQ: Lo = Hi = Val; return true;
+        case Z3_OP_ULEQ: Hi = Val; return true;
+        case Z3_OP_UGEQ: Lo = Val; return true;
+        case Z3_OP_ULT: Hi = Val - 1; return Val != 0;
+        case Z3_OP_UGT: Lo = Val + 1; return Val != Max;
+        default: return true;
+    }
+}
+
+/// the least value >= Lo with the known bits, return false if there is none
+static bool leastMatching(uint64_t Lo, uint64_t Zero, uint64_t One, uint64_t &V) {
+    if (!(Lo & Zero) && (Lo & One) == One) {
+        V = Lo;
+        return true;
+    }
+    // keep the bits of Lo above a zero bit of Lo, set the zero bit, and take the known ones below it;
+    // the lower the bit, the less the value
+    for (unsigned I = 0; I < 64; ++I) {
+        uint64_t Bit = 1ULL << I;
+        if ((Lo & Bit) || (Zero & Bit)) continue;
+        uint64_t Above = I == 63 ? 0 : ~((Bit << 1) - 1);
+        if ((Lo & Above & Zero) || (~Lo & Above & One)) continue;
+        V = (Lo & Above) | Bit | (One & (Bit - 1));
+        return true;
+    }
+    return false;
+}
+
+static bool matches(uint64_t V, uint64_t Zero, uint64_t One, const std::vector<uint64_t> &Excluded) {
+    return !(V & Zero) && (V & One) == One && std::find(Excluded.begin(), Excluded.end(), V) == Excluded.end();
+}
+
+/// the least value of a term, return false if the term has no value
+template<typename TermT>
+static bool least(const TermT &T, uint64_t &V) {
+    uint64_t From = T.Lo;
+    while (true) {
+        if (!leastMatching(From, T.Zero, T.One, V) || V > T.Hi) return false;
+        if (std::find(T.Excluded.begin(), T.Excluded.end(), V) == T.Excluded.end()) return true;
+        if (V == T.Hi) return false;
+        From = V + 1;
+    }
+}
+
+static bool isFreeConstant(const z3::expr &E) {
+    return E.is_const() && E.decl().decl_kind() == Z3_OP_UNINTERPRETED;
+}
+
+ByteDomain::ByteDomain(const z3::expr &Cond) : Cond(Cond) {
+    if (Cond.is_false()) {
+        Empty = true;
+        return;
+    }
+    for (auto C: Z3::find_consecutive_ops(Cond, Z3_OP_AND)) {
+        constrain(C);
+        if (Empty) return;
+    }
+    for (auto &T: Terms) {
+        uint64_t V;
+        if (!least(T, V)) {
+            Empty = true;
+            return;
+        }
+    }
+    // the bounds of the length are often implied by the byte indices, try the least and the greatest length
+    HasWitness = (witness(false, Message) && evaluate(Message) == Yes) ||
+                 (witness(true, Message) && evaluate(Message) == Yes);
+}
+
+ByteDomain::Term *ByteDomain::term(const z3::expr &E) {
+    for (auto &T: Terms) {
+        if (T.ID == Z3::id(E)) return &T;
+    }
+    if (!E.is_bv() || E.get_sort().bv_size() > 64) return nullptr;
+
+    Term T;
+    T.ID = Z3::id(E);
+    T.Width = E.get_sort().bv_size();
+    T.Lo = 0;
+    T.Hi = maxOf(T.Width);
+    if (E.is_app() && E.decl().decl_kind() == Z3_OP_ZERO_EXT) {
+        if (!bytesOf(E.arg(0), T.Bytes)) return nullptr;
+        T.Hi = maxOf(E.arg(0).get_sort().bv_size());
+    } else if (!Z3::is_length(E) && !bytesOf(E, T.Bytes)) {
+        return nullptr;
+    }
+    Terms.push_back(std::move(T));
+    return &Terms.back();
+}
+
+void ByteDomain::constrain(const z3::expr &Conjunct) {
+    bool Neg = false;
+    auto C = Conjunct;
+    while (C.is_not()) {
+        Neg = !Neg;
+        C = C.arg(0);
+    }
+    if (!C.is_app() || C.num_args() != 2 || !C.arg(0).is_bv()) return;
+    auto Kind = C.decl().decl_kind();
+    if (Kind == Z3_OP_DISTINCT) {
+        Kind = Z3_OP_EQ;
+        Neg = !Neg;
+    }
+
+    auto L = C.arg(0);
+    uint64_t Val;
+    if (Z3::is_numeral_u64(L, Val)) {
+        L = C.arg(1);
+        Kind = swapped(Kind);
+    } else if (!Z3::is_numeral_u64(C.arg(1), Val)) {
+        return;
+    }
+
+    // the known bits of a term, from (t & mask) == c or extract(h, l, t) == c
+    if (Kind == Z3_OP_EQ && !Neg && L.is_app() &&
+        (L.decl().decl_kind() == Z3_OP_BAND || L.decl().decl_kind() == Z3_OP_EXTRACT)) {
+        Term *T = nullptr;
+        uint64_t Mask, Bits;
+        if (L.decl().decl_kind() == Z3_OP_BAND) {
+            if (L.num_args() != 2) return;
+            if (Z3::is_numeral_u64(L.arg(1), Mask)) {
+                T = term(L.arg(0));
+            } else if (Z3::is_numeral_u64(L.arg(0), Mask)) {
+                T = term(L.arg(1));
+            }
+            if (!T) return;
+            if (Val & ~Mask) {
+                Empty = true;
+                return;
+            }
+            Bits = Val;
+        } else {
+            T = term(L.arg(0));
+            if (!T) return;
+            unsigned High = Z3_get_decl_int_parameter(L.ctx(), L.decl(), 0);
+            unsigned Low = Z3_get_decl_int_parameter(L.ctx(), L.decl(), 1);
+            Mask = maxOf(High - Low + 1) << Low;
+            Bits = Val << Low;
+        }
+        T->One |= Bits & Mask;
+        T->Zero |= ~Bits & Mask;
+        if (T->One & T->Zero) Empty = true;
+        return;
+    }
+
+    auto *T = term(L);
+    if (!T) return;
+    if (Kind == Z3_OP_EQ && Neg) {
+        T->Excluded.push_back(Val);
+        return;
+    }
+
+    uint64_t Max = maxOf(T->Width);
+    uint64_t Lo, Hi;
+    bool Signed = Kind == Z3_OP_SLEQ || Kind == Z3_OP_SGEQ || Kind == Z3_OP_SLT || Kind == Z3_OP_SGT;
+    if (Signed) {
+        // flipping the sign bit maps the signed order to the unsigned one, the interval is kept
+        // only if it does not wrap around after flipping back
+        uint64_t SignBit = 1ULL << (T->Width - 1);
+        Kind = Kind == Z3_OP_SLEQ ? Z3_OP_ULEQ : Kind == Z3_OP_SGEQ ? Z3_OP_UGEQ : Kind == Z3_OP_SLT ? Z3_OP_ULT : Z3_OP_UGT;
+        if (!interval(Kind, Neg, Val ^ SignBit, Max, Lo, Hi)) {
+            Empty = true;
+            return;
+        }
+        if ((Lo < SignBit) != (Hi < SignBit)) return;
+        Lo ^= SignBit;
+        Hi ^= SignBit;
+    } else if (!interval(Kind, Neg, Val, Max, Lo, Hi)) {
+        Empty = true;
+        return;
+    }
+    T->Lo = std::max(T->Lo, Lo);
+    T->Hi = std::min(T->Hi, Hi);
+    if (T->Lo > T->Hi) Empty = true;
+}
+
+bool ByteDomain::witness(bool MaxLength, Witness &W) const {
+    W = Witness();
+    bool HasLength = false;
+    for (auto &T: Terms) {
+        uint64_t V;
+        if (MaxLength && T.Bytes.empty()) {
+            V = T.Hi;
+            if (!matches(V, T.Zero, T.One, T.Excluded)) return false;
+        } else if (!least(T, V)) {
+            return false;
+        }
+        if (T.Bytes.empty()) {
+            if (HasLength && W.Length != V) return false;
+            HasLength = true;
+            W.Length = V;
+            continue;
+        }
+        for (unsigned K = 0; K < T.Bytes.size(); ++K) {
+            uint8_t Byte = V >> (8 * (T.Bytes.size() - 1 - K));
+            auto It = W.Bytes.emplace(T.Bytes[K], Byte);
+            // overlapping terms taking different values
+            if (!It.second && It.first->second != Byte) return false;
+        }
+    }
+    if (!HasLength) W.Length = MaxLength ? UINT64_MAX : 0;
+    return true;
+}
+
+ByteDomain::Answer ByteDomain::evaluate(const Witness &W) const {
+    z3::expr_vector From = Z3::vec();
+    z3::expr_vector To = Z3::vec();
+    for (auto C: Z3::find_all(Cond, false, isFreeConstant)) {
+        auto S = C.get_sort();
+        if (Z3::is_length(C)) {
+            To.push_back(Z3::bv_val(W.Length & maxOf(S.bv_size()), S.bv_size()));
+        } else if (S.is_array() && S.array_domain().is_bv() && S.array_range().is_bv() &&
+                   C.decl().name().str() == BYTE_ARRAY) {
+            auto Array = z3::const_array(S.array_domain(), Z3::bv_val((uint64_t) 0, S.array_range().bv_size()));
+            for (auto &B: W.Bytes) {
+                Array = z3::store(Array, Z3::bv_val(B.first, S.array_domain().bv_size()),
+                                  Z3::bv_val((uint64_t) B.second, S.array_range().bv_size()));
+            }
+            To.push_back(Array);
+        } else {
+            // the message does not decide other constants
+            return Unknown;
+        }
+        From.push_back(C);
+    }
+    z3::expr V = Cond;
+    if (!From.empty()) V = V.substitute(From, To);
+    V = V.simplify();
+    return V.is_true() ? Yes : V.is_false() ? No : Unknown;
+}
+
+ByteDomain::Answer ByteDomain::satisfiable() const {
+    if (Empty) return No;
+    return HasWitness ? Yes : Unknown;
+}
+
+ByteDomain::Answer ByteDomain::equivalent(const ByteDomain &A, const ByteDomain &B) {
+    if (A.Empty && B.Empty) return Yes;
+    if (A.HasWitness && (B.Empty || B.evaluate(A.Message) == No)) return No;
+    if (B.HasWitness && (A.Empty || A.evaluate(B.Message) == No)) return No;
+    return Unknown;
+}
@@ -19,8 +19,8 @@
 
 #include "Support/DL.h"
 
-static const DataLayout *Layout = nullptr;
-static unsigned PointerBytewidth = 0;
+static thread_local const DataLayout *Layout = nullptr;
+static thread_local unsigned PointerBytewidth = 0;
 
 void DL::initialize(const DataLayout &D) {
     Layout = &D;
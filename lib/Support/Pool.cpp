@@ -0,0 +1,91 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "Support/Pool.h"
+
+static const size_t Align = 16;
+static const size_t MaxSize = 256;
+static const size_t ChunkSize = 64 * 1024;
+
+namespace {
+struct FreeBlock {
+    FreeBlock *Next;
+};
+
+struct ThreadPool {
+    std::vector<char *> Chunks;
+    char *Cur = nullptr;
+    char *End = nullptr;
+    FreeBlock *FreeLists[MaxSize / Align] = {};
+    size_t Live = 0;
+
+    ~ThreadPool() { release(); }
+
+    void release() {
+        // a block still in use lives in a chunk, which must not be freed
+        if (Live) return;
+        for (auto *Chunk: Chunks) std::free(Chunk);
+        Chunks.clear();
+        Cur = End = nullptr;
+        for (auto &List: FreeLists) List = nullptr;
+    }
+};
+} // namespace
+
+static thread_local ThreadPool Local;
+
+void *Pool::allocate(size_t Size) {
+    if (Size == 0 || Size > MaxSize) return ::operator new(Size);
+    auto Class = (Size - 1) / Align;
+    ++Local.Live;
+    if (auto *Block = Local.FreeLists[Class]) {
+        Local.FreeLists[Class] = Block->Next;
+        return Block;
+    }
+    auto Rounded = (Class + 1) * Align;
+    if (Local.Cur + Rounded > Local.End) {
+        auto *Chunk = static_cast<char *>(std::aligned_alloc(Align, ChunkSize));
+        if (!Chunk) throw std::bad_alloc();
+        Local.Chunks.push_back(Chunk);
+        Local.Cur = Chunk;
+        Local.End = Chunk + ChunkSize;
+    }
+    auto *Ret = Local.Cur;
+    Local.Cur += Rounded;
+    return Ret;
+}
+
+void Pool::deallocate(void *P, size_t Size) {
+    if (!P) return;
+    if (Size == 0 || Size > MaxSize) {
+        ::operator delete(P);
+        return;
+    }
+    auto Class = (Size - 1) / Align;
+    auto *Block = static_cast<FreeBlock *>(P);
+    Block->Next = Local.FreeLists[Class];
+    Local.FreeLists[Class] = Block;
+    --Local.Live;
+}
+
+void Pool::release() {
+    Local.release();
+}
@@ -16,126 +16,175 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <llvm/ADT/StringExtras.h>
+#include <unordered_map>
 #include "Support/Debug.h"
+#include "Support/FlatHash.h"
 #include "Support/Z3.h"
 #include "Z3Macro.h"
-
-static z3::context Ctx;
-static z3::solver Solver(Ctx);
-static z3::goal goal(Ctx);
-static z3::expr_vector SolverAssumptions(Ctx);
-static z3::expr Len(Ctx);
-static z3::tactic t(Ctx, "split-clause");
-static z3::tactic skip(Ctx, "skip");
-static z3::tactic simply(Ctx, "simplify");
+#include "Z3Session.h"
+#include "Z3SolverCache.h"
 
 void Z3::initialize() {
     pardiff_INFO("Z3 version: " << Z3_get_full_version());
 }
 
+void Z3::translate(const std::vector<z3::expr> &From, Z3Session &To, std::vector<z3::expr> &Ret) {
+    if (From.empty()) return;
+    auto &Ctx = To.context();
+    // translate the exprs as a whole, so that the subexprs they share are translated once
+    z3::expr_vector Vec(From[0].ctx());
+    for (auto &E: From) Vec.push_back(E);
+    // the reference counting of the target context is not thread-safe, so copying the exprs is also guarded
+    std::lock_guard<std::mutex> Lock(To.S->TranslateMutex);
+    z3::expr_vector Translated(Ctx, Z3_ast_vector_translate(Vec.ctx(), Vec, Ctx));
+    for (unsigned I = 0; I < Translated.size(); ++I) Ret.push_back(Translated[I]);
+}
+
 z3::expr Z3::bv_val(unsigned V, unsigned Size) {
-    return Ctx.bv_val(V, Size);
+    return state().Ctx.bv_val(V, Size);
 }
 
 z3::expr Z3::bv_val(int V, unsigned Size) {
-    return Ctx.bv_val(V, Size);
+    return state().Ctx.bv_val(V, Size);
 }
 
 z3::expr Z3::bv_val(uint64_t V, unsigned Size) {
-    return Ctx.bv_val(V, Size);
+    return state().Ctx.bv_val(V, Size);
 }
 
 z3::expr Z3::bv_val(int64_t V, unsigned Size) {
-    return Ctx.bv_val(V, Size);
+    return state().Ctx.bv_val(V, Size);
 }
 
 z3::expr Z3::bv_const(const char *Name, unsigned int Size) {
-    return Ctx.bv_const(Name, Size);
+    return state().Ctx.bv_const(Name, Size);
 }
 
 z3::expr Z3::bool_val(bool B) {
-    return Ctx.bool_val(B);
+    return state().Ctx.bool_val(B);
 }
 
 z3::expr Z3::bool_const(const char *Name) {
-    return Ctx.bool_const(Name);
+    return state().Ctx.bool_const(Name);
 }
 z3::expr Z3::int_const(const char * Name){
-    return Ctx.int_const(Name);
+    return state().Ctx.int_const(Name);
+}
+
+/// kinds of the symbols of uninterpreted constants
+enum SymbolKind {
+    SK_Free = 1,
+    SK_IndexVar = 1 << 1,
+    SK_Length = 1 << 2,
+    SK_Base = 1 << 3,
+    SK_TripCount = 1 << 4,
+};
+
+/// symbols are interned by z3 for all contexts and never released, thus can be keyed by their address;
+/// the fresh constants are recorded at creation, the others, e.g., named objects, when they are first classified
+static thread_local std::unordered_map<Z3_symbol, unsigned> SymbolKindMap;
+
+static unsigned classify(const char *Name) {
+    StringRef Str(Name);
+    unsigned Kinds = 0;
+    if (Str.contains(FREE_VAR)) Kinds |= SK_Free;
+    if (Str.contains(INDEX_VAR)) Kinds |= SK_IndexVar;
+    if (Str == LENGTH) Kinds |= SK_Length;
+    if (Str.startswith(BASE)) Kinds |= SK_Base;
+    if (Str.startswith(TRIP_COUNT)) Kinds |= SK_TripCount;
+    return Kinds;
+}
+
+static z3::expr record(const z3::expr &E, unsigned Kinds) {
+    SymbolKindMap[Z3_get_decl_name(E.ctx(), Z3_get_app_decl(E.ctx(), Z3_to_app(E.ctx(), E)))] = Kinds;
+    return E;
+}
+
+/// the kinds of \p E if it is an uninterpreted constant, without printing it
+static unsigned kinds(const z3::expr &E) {
+    auto &Ctx = E.ctx();
+    if (!E.is_app()) return 0;
+    auto App = Z3_to_app(Ctx, E);
+    if (Z3_get_app_num_args(Ctx, App) != 0) return 0;
+    auto Decl = Z3_get_app_decl(Ctx, App);
+    if (Z3_get_decl_kind(Ctx, Decl) != Z3_OP_UNINTERPRETED) return 0;
+    auto Symbol = Z3_get_decl_name(Ctx, Decl);
+    auto It = SymbolKindMap.find(Symbol);
+    if (It != SymbolKindMap.end()) return It->second;
+    return SymbolKindMap[Symbol] = classify(Z3_get_symbol_string(Ctx, Symbol));
 }
 
 z3::expr Z3::free_bool() {
-    static unsigned I = 0;
-    std::string Name(FREE_VAR);
-    Name.append(std::to_string(I++));
-    return Ctx.bool_const(Name.c_str());
+    std::string Name(state().Fresh->Prefix);
+    Name.append(FREE_VAR).append(std::to_string(state().Fresh->FreeBools++));
+    return record(state().Ctx.bool_const(Name.c_str()), SK_Free);
 }
 
 z3::expr Z3::free_bv(unsigned Bitwidth) {
-    static unsigned K = 0;
-    std::string Name(FREE_VAR);
-    Name.append(std::to_string(K++));
-    return Ctx.bv_const(Name.c_str(), Bitwidth);
+    std::string Name(state().Fresh->Prefix);
+    Name.append(FREE_VAR).append(std::to_string(state().Fresh->FreeBvs++));
+    return record(state().Ctx.bv_const(Name.c_str(), Bitwidth), SK_Free);
 }
 
 bool Z3::is_free(const z3::expr &E) {
-    return E.is_const() && E.to_string().find(FREE_VAR) != std::string::npos;
+    return kinds(E) & SK_Free;
 }
 
 z3::expr Z3::index_var() {
-    static unsigned J = 0;
-    std::string Name(INDEX_VAR);
-    Name.append(std::to_string(J++));
-    return Ctx.bv_const(Name.c_str(), 64);
+    std::string Name(state().Fresh->Prefix);
+    Name.append(INDEX_VAR).append(std::to_string(state().Fresh->IndexVars++));
+    return record(state().Ctx.bv_const(Name.c_str(), 64), SK_IndexVar);
 }
 
 bool Z3::is_index_var(const z3::expr &E) {
-    return E.is_bv() && E.is_const() && E.to_string().find(INDEX_VAR) != std::string::npos;
+    return (kinds(E) & SK_IndexVar) && E.is_bv();
 }
 
 z3::expr Z3::length(unsigned Bitwidth) {
-    static unsigned K = 0;
-    if (K == 0) {
-        K++;
+    auto &S = state();
+    if (!S.HasLength) {
+        S.HasLength = true;
         assert(Bitwidth != UINT32_MAX);
-        Len = Z3::bv_const(LENGTH, Bitwidth);
-        return Len;
+        S.Len = record(Z3::bv_const(LENGTH, Bitwidth), SK_Length);
+        return S.Len;
     } else {
-        assert((Bitwidth == UINT32_MAX || Len.get_sort().bv_size() == Bitwidth) &&
+        assert((Bitwidth == UINT32_MAX || S.Len.get_sort().bv_size() == Bitwidth) &&
                "Bitwidth of length cannot be changed!");
-        return Len;
+        return S.Len;
     }
 }
 
 bool Z3::is_length(const z3::expr &E) {
-    return E.is_bv() && E.is_const() && E.to_string() == LENGTH;
+    return (kinds(E) & SK_Length) && E.is_bv();
 }
 
 z3::expr Z3::base(unsigned K) {
     std::string Name(BASE);
     Name.append(std::to_string(K));
-    return Z3::bv_const(Name.c_str(), 64);
+    return record(Z3::bv_const(Name.c_str(), 64), SK_Base);
 }
 
 bool Z3::is_base(const z3::expr &E) {
-    return E.is_bv() && E.is_const() && E.to_string().find(BASE) == 0;
+    return (kinds(E) & SK_Base) && E.is_bv();
 }
 
 z3::expr Z3::trip_count(unsigned K) {
     std::string Name(TRIP_COUNT);
     Name.append(std::to_string(K));
-    return Z3::bv_const(Name.c_str(), 64);
+    return record(Z3::bv_const(Name.c_str(), 64), SK_TripCount);
 }
 
 bool Z3::is_trip_count(const z3::expr &E) {
-    return E.is_bv() && E.is_const() && E.to_string().find(TRIP_COUNT) == 0;
+    return (kinds(E) & SK_TripCount) && E.is_bv();
 }
 
 z3::expr_vector Z3::vec() {
-    return {Ctx};
+    return {state().Ctx};
 }
 
 z3::expr Z3::packing(const char *Name, const z3::expr_vector &Args, unsigned Ret) {
+    auto &Ctx = state().Ctx;
     z3::sort_vector SortVec(Ctx);
     for (auto E: Args)
         SortVec.push_back(E.get_sort());
@@ -162,11 +211,11 @@ bool Z3::is_naming_eq(const z3::expr &E) {
 }
 
 unsigned Z3::id(const z3::expr &E) {
-    return Z3_get_ast_id(Ctx, E);
+    return Z3_get_ast_id(E.ctx(), E);
 }
 
 bool Z3::same(const z3::expr &E1, const z3::expr &E2) {
-    return Z3_get_ast_id(Ctx, E1) == Z3_get_ast_id(Ctx, E2);
+    return Z3_get_ast_id(E1.ctx(), E1) == Z3_get_ast_id(E2.ctx(), E2);
 }
 
 bool Z3::is_numeral_i64(const z3::expr &E, int64_t &R) {
@@ -193,7 +242,7 @@ bool Z3::is_zero(const z3::expr &E) {
 }
 
 bool Z3::find(const z3::expr &Expr, const z3::expr &SubExpr) {
-    std::set<unsigned> Visited;
+    FlatIDSet Visited;
     z3::expr_vector Stack = vec();
     Stack.push_back(Expr);
     while (!Stack.empty()) {
@@ -216,32 +265,100 @@ bool Z3::find(const z3::expr &Expr, const z3::expr &SubExpr) {
     return false;
 }
 
+/// the kinds of the cached traversals
+enum TraversalKind {
+    TK_Find,
+    TK_FindByteIndex,
+    TK_FindAll,
+    TK_FindAllRecursive,
+    TK_ConsecutiveOps,
+    TK_ConsecutiveOpsAllowRep,
+    TK_ConsecutiveKinds,
+    TK_ConsecutiveKindsAllowRep,
+};
+
+/// the cache is dropped as a whole when it grows too large
+static const size_t MaxTraversals = 1 << 20;
+
+/// the cached result of a traversal on \p Expr, or null if it is not traversed yet or belongs to another session
+static Z3TraversalResult *traversed(const z3::expr &Expr, uintptr_t Query, unsigned Kind) {
+    auto &S = state();
+    if ((Z3_context) Expr.ctx() != (Z3_context) S.Ctx) return nullptr;
+    auto It = S.Traversals.find({Z3::id(Expr), Query, Kind});
+    return It == S.Traversals.end() ? nullptr : &It->second;
+}
+
+static void traverse(const z3::expr &Expr, uintptr_t Query, unsigned Kind, bool Found,
+                     std::vector<z3::expr> Exprs = {}) {
+    auto &S = state();
+    if ((Z3_context) Expr.ctx() != (Z3_context) S.Ctx) return;
+    if (S.Traversals.size() >= MaxTraversals) S.Traversals.clear();
+    S.Traversals.emplace(Z3TraversalKey{Z3::id(Expr), Query, Kind},
+                         Z3TraversalResult{Expr, Found, std::move(Exprs)});
+}
+
+static z3::expr_vector vec(const std::vector<z3::expr> &Exprs) {
+    z3::expr_vector Ret = Z3::vec();
+    for (auto &E: Exprs) Ret.push_back(E);
+    return Ret;
+}
+
+static std::vector<z3::expr> exprs(const z3::expr_vector &Vec) {
+    std::vector<z3::expr> Ret;
+    for (unsigned I = 0; I < Vec.size(); ++I) Ret.push_back(Vec[I]);
+    return Ret;
+}
+
+/// the result of each sub-expr is cached, so that a sub-expr shared by many queries is visited only once,
+/// the walk keeps its own stack so that a deep expr does not overflow the call stack
 bool Z3::find(const z3::expr & Expr, bool(*P)(const z3::expr &)){
-    std::set<unsigned> Visited;
-    z3::expr_vector Stack = Z3::vec();
-    Stack.push_back(Expr);
+    if (auto *R = traversed(Expr, (uintptr_t) P, TK_Find)) return R->Found;
+    // the flag tells if the arguments of the expr are pushed, the exprs below such an expr in the stack are its ancestors
+    std::vector<std::pair<z3::expr, bool>> Stack;
+    FlatIDSet NotFound;
+    Stack.emplace_back(Expr, false);
     while (!Stack.empty()) {
-        auto Top = Stack.back();
-        Stack.pop_back();
+        auto Top = Stack.back().first;
         auto TopID = id(Top);
-        if (Visited.count(TopID)) {
+        if (NotFound.count(TopID)) {
+            Stack.pop_back();
             continue;
         }
-        Visited.insert(TopID);
-        if (P(Top)) {
-           return true;
+        if (Stack.back().second) {
+            // none of the arguments contains P, otherwise the walk has returned
+            Stack.pop_back();
+            NotFound.insert(TopID);
+            traverse(Top, (uintptr_t) P, TK_Find, false);
+            continue;
         }
-
+        auto *R = traversed(Top, (uintptr_t) P, TK_Find);
+        if (R && !R->Found) {
+            Stack.pop_back();
+            NotFound.insert(TopID);
+            continue;
+        }
+        if (R || P(Top)) {
+            // the expr and its ancestors contain P
+            traverse(Top, (uintptr_t) P, TK_Find, true);
+            for (auto &Item: Stack) {
+                if (Item.second) traverse(Item.first, (uintptr_t) P, TK_Find, true);
+            }
+            return true;
+        }
+        Stack.back().second = true;
         auto NumArgs = Top.num_args();
         for (unsigned I = 0; I < NumArgs; ++I) {
-            Stack.push_back(Top.arg(I));
+            auto Arg = Top.arg(I);
+            if (!NotFound.count(id(Arg))) Stack.emplace_back(Arg, false);
         }
     }
     return false;
 }
 
 bool Z3::find_byte_index(const z3::expr &Expr, int (*P)(const z3::expr &)){
-    std::set<unsigned> Visited;
+    if (auto *R = traversed(Expr, (uintptr_t) P, TK_FindByteIndex)) return R->Found;
+    bool Found = false;
+    FlatIDSet Visited;
     z3::expr_vector Stack = vec();
     Stack.push_back(Expr);
     while (!Stack.empty()) {
@@ -253,7 +370,8 @@ bool Z3::find_byte_index(const z3::expr &Expr, int (*P)(const z3::expr &)){
         }
         Visited.insert(TopID);
         if (P(Top) == 2) {
-            return true;
+            Found = true;
+            break;
         }
         else if(P(Top) == 1){
             continue;
@@ -263,13 +381,16 @@ bool Z3::find_byte_index(const z3::expr &Expr, int (*P)(const z3::expr &)){
             Stack.push_back(Top.arg(I));
         }
     }
-    return false;
+    traverse(Expr, (uintptr_t) P, TK_FindByteIndex, Found);
+    return Found;
 }
 
 z3::expr_vector Z3::find_all(const z3::expr &Expr, bool Recursive, bool (*P)(const z3::expr &)) {
-    z3::expr_vector Result = vec();
+    auto Kind = Recursive ? TK_FindAllRecursive : TK_FindAll;
+    if (auto *R = traversed(Expr, (uintptr_t) P, Kind)) return ::vec(R->Exprs);
 
-    std::set<unsigned> Visited;
+    std::vector<z3::expr> Result;
+    FlatIDSet Visited;
     z3::expr_vector Stack = vec();
     Stack.push_back(Expr);
     while (!Stack.empty()) {
@@ -290,7 +411,9 @@ z3::expr_vector Z3::find_all(const z3::expr &Expr, bool Recursive, bool (*P)(con
             Stack.push_back(Top.arg(I));
         }
     }
-    return Result;
+    auto Ret = ::vec(Result);
+    traverse(Expr, (uintptr_t) P, Kind, !Result.empty(), std::move(Result));
+    return Ret;
 }
 
 //given a expr vector V, return a expr vector which contains all the expr in V satisfied P
@@ -304,7 +427,7 @@ z3::expr_vector Z3::find_all(const z3::expr_vector &vec, bool (*P)(const z3::exp
 }
 
 template<typename OpKind>
-static void postVisit(const z3::expr &Expr, OpKind P, z3::expr_vector Ret, std::set<unsigned> *Visited) {
+static void postVisit(const z3::expr &Expr, OpKind P, z3::expr_vector Ret, FlatIDSet *Visited) {
     if (Visited) {
         if (Visited->count(Z3::id(Expr)))
             return;
@@ -322,25 +445,31 @@ static void postVisit(const z3::expr &Expr, OpKind P, z3::expr_vector Ret, std::
 }
 
 z3::expr_vector Z3::find_consecutive_ops(const z3::expr &Expr, bool (*P)(const z3::expr &), bool AllowRep) {
+    auto Kind = AllowRep ? TK_ConsecutiveOpsAllowRep : TK_ConsecutiveOps;
+    if (auto *R = traversed(Expr, (uintptr_t) P, Kind)) return ::vec(R->Exprs);
     z3::expr_vector Result = vec();
     if (!AllowRep) {
-        std::set<unsigned> Visited;
+        FlatIDSet Visited;
         postVisit(Expr, P, Result, &Visited);
     } else {
         postVisit(Expr, P, Result, nullptr);
     }
+    traverse(Expr, (uintptr_t) P, Kind, !Result.empty(), exprs(Result));
     return Result;
 }
 
 z3::expr_vector Z3::find_consecutive_ops(const z3::expr &Expr, Z3_decl_kind OpKind, bool AllowRep) {
+    auto Kind = AllowRep ? TK_ConsecutiveKindsAllowRep : TK_ConsecutiveKinds;
+    if (auto *R = traversed(Expr, OpKind, Kind)) return ::vec(R->Exprs);
     auto P = [OpKind](const z3::expr &E) { return E.decl().decl_kind() == OpKind; };
     z3::expr_vector Result = vec();
     if (!AllowRep) {
-        std::set<unsigned> Visited;
+        FlatIDSet Visited;
         postVisit(Expr, P, Result, &Visited);
     } else {
         postVisit(Expr, P, Result, nullptr);
     }
+    traverse(Expr, OpKind, Kind, !Result.empty(), exprs(Result));
     return Result;
 }
 
@@ -348,7 +477,7 @@ z3::expr_vector Z3::find_consecutive_ops(const z3::expr &Expr, const char *OpNam
     auto P = [OpName](const z3::expr &E) { return E.decl().name().str() == OpName; };
     z3::expr_vector Result = vec();
     if (!AllowRep) {
-        std::set<unsigned> Visited;
+        FlatIDSet Visited;
         postVisit(Expr, P, Result, &Visited);
     } else {
         postVisit(Expr, P, Result, nullptr);
@@ -389,7 +518,7 @@ static std::string to_string_default(const z3::expr &Expr) {
      }
 
      bool Phi = Z3::is_phi(Expr);
-    unsigned NumParams = Z3_get_decl_num_parameters(Ctx, Decl);
+    unsigned NumParams = Z3_get_decl_num_parameters(Decl.ctx(), Decl);
     unsigned NumArgs = Expr.num_args();
     if (NumParams + NumArgs > 0) {
         Ret.append("(");
@@ -403,10 +532,10 @@ static std::string to_string_default(const z3::expr &Expr) {
                     Ret.append("$").append(std::to_string(CondID));
                 }
             } else {
-                auto ParamKind = Z3_get_decl_parameter_kind(Ctx, Decl, I - NumArgs);
+                auto ParamKind = Z3_get_decl_parameter_kind(Decl.ctx(), Decl, I - NumArgs);
                 switch (ParamKind) {
                     case Z3_PARAMETER_INT:
-                        Ret.append(std::to_string(Z3_get_decl_int_parameter(Ctx, Decl, I - NumArgs)));
+                        Ret.append(std::to_string(Z3_get_decl_int_parameter(Decl.ctx(), Decl, I - NumArgs)));
                         break;
                     case Z3_PARAMETER_DOUBLE:
                     case Z3_PARAMETER_RATIONAL:
@@ -580,7 +709,7 @@ std::string Z3::to_string(const z3::expr &Expr, bool Easy) {
     }
 }
 
-static Z3::Z3Format PrintFormat = Z3::ZF_Easy;
+static thread_local Z3::Z3Format PrintFormat = Z3::ZF_Easy;
 
 raw_ostream &operator<<(llvm::raw_ostream &O, const Z3::Z3Format &F) {
     PrintFormat = F;
@@ -596,7 +725,7 @@ raw_ostream &operator<<(llvm::raw_ostream &O, const z3::expr &E) {
             O << Z3::to_string(E);
             break;
         case Z3::ZF_SMTLib:
-            O << Z3_benchmark_to_smtlib_string(Ctx, 0, 0, 0, 0, 0, 0, E);
+            O << Z3_benchmark_to_smtlib_string(E.ctx(), 0, 0, 0, 0, 0, 0, E);
             break;
     }
     PrintFormat = Z3::ZF_Easy; // reset
@@ -604,19 +733,26 @@ raw_ostream &operator<<(llvm::raw_ostream &O, const z3::expr &E) {
 }
 
 void Z3Solver::addAssumption(const z3::expr &A) {
-    SolverAssumptions.push_back(A);
+    state().SolverAssumptions.push_back(A);
 }
 
 void Z3Solver::clearAssumptions() {
-    SolverAssumptions = Z3::vec();
+    state().SolverAssumptions = Z3::vec();
 }
 
 bool Z3Solver::check(const z3::expr &A, std::vector<uint8_t> &Ret) {
+    auto &Solver = state().Solver;
+    // the model depends on the initial size of Ret
+    auto Key = Z3SolverCache::combine(Z3SolverCache::key(A), {UINT64_MAX, Ret.size()});
+    bool Sat;
+    if (Z3SolverCache::lookup(Key, Sat, Ret)) return Sat;
+
     Solver.reset();
     Solver.add(A);
     auto Result = Solver.check();
     if (Result != z3::sat) {
         Ret.clear();
+        if (Result == z3::unsat) Z3SolverCache::insert(Key, false, Ret);
         return false;
     }
     auto Model = Solver.get_model();
@@ -663,32 +799,57 @@ bool Z3Solver::check(const z3::expr &A, std::vector<uint8_t> &Ret) {
             }
         }
     }
+    Z3SolverCache::insert(Key, true, Ret);
     return true;
 }
 
 bool Z3Solver::check(const z3::expr &A) {
+    auto &Solver = state().Solver;
+    auto Key = Z3SolverCache::key(A);
+    bool Sat;
+    if (Z3SolverCache::lookup(Key, Sat)) return Sat;
+
     Solver.reset();
     Solver.add(A);
-    return Solver.check() == z3::sat;
+    auto Result = Solver.check();
+    if (Result != z3::unknown) Z3SolverCache::insert(Key, Result == z3::sat);
+    return Result == z3::sat;
 }
 
 bool Z3Solver::check(const std::vector<z3::expr> &V) {
+    auto &Solver = state().Solver;
+    auto Key = Z3SolverCache::key(V);
+    bool Sat;
+    if (Z3SolverCache::lookup(Key, Sat)) return Sat;
+
     Solver.reset();
     for (auto &E: V) Solver.add(E);
     auto Result = Solver.check();
     assert(Result != z3::unknown);
+    Z3SolverCache::insert(Key, Result == z3::sat);
     return Result == z3::sat;
 }
 
 bool Z3Solver::check(const z3::expr_vector &V) {
+    auto &Solver = state().Solver;
+    auto Key = Z3SolverCache::key(V);
+    bool Sat;
+    if (Z3SolverCache::lookup(Key, Sat)) return Sat;
+
     Solver.reset();
     for (auto E: V) Solver.add(E);
     auto Result = Solver.check();
     assert(Result != z3::unknown);
+    Z3SolverCache::insert(Key, Result == z3::sat);
     return Result == z3::sat;
 }
 
 void Z3Solver::getmodel(const z3::expr &A, const z3::expr &F1, const z3::expr &F2){
+    auto &S = state();
+    auto &Solver = S.Solver;
+    auto &goal = S.Goal;
+    auto &t = S.SplitClause;
+    auto &skip = S.Skip;
     
     Solver.reset();
     Solver.add(A);
@@ -884,3 +1045,65 @@ void Z3Solver::getmodel(const z3::expr &A, const z3::expr &F1, const z3::expr &F
     
 }
 
+void Z3Solver::push() {
+    auto &S = state();
+    S.IncrementalSolver.push();
+    S.AssertionsKeyStack.push_back(S.AssertionsKey);
+}
+
+void Z3Solver::pop() {
+    auto &S = state();
+    assert(!S.AssertionsKeyStack.empty());
+    S.IncrementalSolver.pop();
+    S.AssertionsKey = S.AssertionsKeyStack.back();
+    S.AssertionsKeyStack.pop_back();
+}
+
+void Z3Solver::add(const z3::expr &E) {
+    auto &S = state();
+    S.IncrementalSolver.add(E);
+    S.AssertionsKey = Z3SolverCache::merge(S.AssertionsKey, Z3SolverCache::key(E));
+}
+
+z3::expr Z3Solver::proxy(const z3::expr &E) {
+    assert(E.is_bool());
+    if (E.is_const()) return E;
+
+    // name the proxy by the structure of the expr, so that the cached queries over it
+    // do not depend on the order in which the proxies are created
+    auto Key = Z3SolverCache::key(E);
+    std::string Name(PROXY);
+    Name.append(llvm::utohexstr(Key.H1)).append("_").append(llvm::utohexstr(Key.H2));
+    auto Proxy = state().Ctx.bool_const(Name.c_str());
+    add(Proxy == E);
+    return Proxy;
+}
+
+bool Z3Solver::checkIncremental(const z3::expr &E) {
+    auto &IncrementalSolver = state().IncrementalSolver;
+    // the query is keyed by all the assertions in the solver together with the given expr
+    auto Key = Z3SolverCache::combine(state().AssertionsKey, Z3SolverCache::key(E));
+    bool Sat;
+    if (Z3SolverCache::lookup(Key, Sat)) return Sat;
+
+    z3::check_result Result;
+    if (E.is_true()) {
+        Result = IncrementalSolver.check();
+    } else if (E.is_const() || (E.is_not() && E.arg(0).is_const())) {
+        // a literal, just assume it without opening a scope
+        z3::expr_vector Assumptions = Z3::vec();
+        Assumptions.push_back(E);
+        Result = IncrementalSolver.check(Assumptions);
+    } else {
+        IncrementalSolver.push();
+        IncrementalSolver.add(E);
+        Result = IncrementalSolver.check();
+        IncrementalSolver.pop();
+    }
+    if (Result != z3::unknown) Z3SolverCache::insert(Key, Result == z3::sat);
+    return Result == z3::sat;
+}
+
+void Z3Solver::reportCache() {
+    Z3SolverCache::report();
+}
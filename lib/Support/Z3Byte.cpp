@@ -44,12 +44,8 @@ static int truncLessThan(const z3::expr_vector &V1, const z3::expr_vector &V2) {
     // 1 - true
     // 0 - false
     // -1 - unknown
-    for (auto E: V1){
-        dbgs()<<E<<"\n";
-    }
-    for (auto E: V2){
-        dbgs()<<E<<"\n";
-    }
+    LLVM_DEBUG(for (auto E: V1) dbgs() << E << "\n");
+    LLVM_DEBUG(for (auto E: V2) dbgs() << E << "\n");
     //dbgs()<< "v1: "<<V1<<" and V2: " <<V2<<"\n";
     unsigned Bits2Remove = 0;
     bool flag = false;
@@ -33,5 +33,6 @@
 #define BYTE_ARRAY_RANGE "Brange"
 #define BASE "O"
 #define TRIP_COUNT "K"
+#define PROXY "px"
 
 #endif //SUPPORT_Z3MACRO_H
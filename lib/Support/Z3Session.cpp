@@ -0,0 +1,52 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "Z3Session.h"
+
+static thread_local Z3Session *CurrentSession = nullptr;
+static thread_local std::unique_ptr<Z3Session> DefaultSession;
+
+static std::shared_ptr<Z3FreshCounters> freshCounters(Z3Session::State *Parent, const std::string &Namespace) {
+    if (Parent && Namespace.empty()) return Parent->Fresh;
+    return std::make_shared<Z3FreshCounters>(Parent ? Parent->Fresh->Prefix + Namespace : Namespace);
+}
+
+Z3Session::Z3Session(Z3Session *Parent, const std::string &Namespace)
+        : S(std::make_unique<State>(freshCounters(Parent ? Parent->S.get() : nullptr, Namespace))) {}
+
+Z3Session::~Z3Session() = default;
+
+z3::context &Z3Session::context() {
+    return S->Ctx;
+}
+
+Z3Session &Z3Session::current() {
+    if (!CurrentSession) {
+        if (!DefaultSession) DefaultSession = std::make_unique<Z3Session>();
+        CurrentSession = DefaultSession.get();
+    }
+    return *CurrentSession;
+}
+
+Z3Session::Scope::Scope(Z3Session &Session) : Prev(CurrentSession) {
+    CurrentSession = &Session;
+}
+
+Z3Session::Scope::~Scope() {
+    CurrentSession = Prev;
+}
@@ -0,0 +1,117 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SUPPORT_Z3SESSION_H
+#define SUPPORT_Z3SESSION_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Support/Z3.h"
+#include "Z3SolverCache.h"
+
+/// fresh-variable counters, shared by a session and its children, and the prefix of the fresh names
+struct Z3FreshCounters {
+    const std::string Prefix;
+    std::atomic<unsigned> FreeBools{0};
+    std::atomic<unsigned> FreeBvs{0};
+    std::atomic<unsigned> IndexVars{0};
+
+    explicit Z3FreshCounters(std::string Prefix) : Prefix(std::move(Prefix)) {}
+};
+
+/// a traversal of an expr, i.e., the id of the expr, the predicate or the operator looked for, and the kind of the traversal
+struct Z3TraversalKey {
+    unsigned ID;
+    uintptr_t Query;
+    unsigned Kind;
+
+    bool operator==(const Z3TraversalKey &K) const { return ID == K.ID && Query == K.Query && Kind == K.Kind; }
+};
+
+struct Z3TraversalKeyHash {
+    size_t operator()(const Z3TraversalKey &K) const {
+        return std::hash<uint64_t>()(((uint64_t) K.ID << 32 | K.Kind) ^ (uint64_t) K.Query * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+/// the result of a traversal, which holds the traversed expr so that its id is not reused by another expr
+struct Z3TraversalResult {
+    z3::expr Expr;
+    bool Found;
+    std::vector<z3::expr> Exprs;
+};
+
+/// the structural key of an expr, which holds the expr so that its id is not reused by another expr
+struct Z3SolverKeyEntry {
+    z3::expr Expr;
+    Z3SolverCache::Key Key;
+};
+
+/// everything a session owns, the context must be the first member so that it is destroyed last
+struct Z3Session::State {
+    z3::context Ctx;
+
+    /// solvers, see Z3Solver
+    /// @{
+    z3::solver Solver;
+    z3::solver IncrementalSolver;
+    Z3SolverCache::Key AssertionsKey = {0, 0};
+    std::vector<Z3SolverCache::Key> AssertionsKeyStack;
+    std::unordered_map<unsigned, Z3SolverKeyEntry> SolverKeys; // the keys of the queried exprs and their sub-exprs
+    z3::expr_vector SolverAssumptions;
+    z3::goal Goal;
+    z3::tactic SplitClause;
+    z3::tactic Skip;
+    z3::tactic Simplify;
+    /// @}
+
+    std::shared_ptr<Z3FreshCounters> Fresh;
+
+    /// the length of the message, created at its first use
+    z3::expr Len;
+    bool HasLength = false;
+
+    /// phi bookkeeping, see Z3Ternary.cpp
+    /// @{
+    std::map<unsigned, z3::expr_vector> PhiID2CondMap;
+    std::map<unsigned, std::pair<BasicBlock *, std::vector<BasicBlock *>>> PhiID2BlockMap;
+    /// @}
+
+    /// results of the traversals, see Z3::find and Z3::find_all
+    std::unordered_map<Z3TraversalKey, Z3TraversalResult, Z3TraversalKeyHash> Traversals;
+
+    /// serialize the translations into this session from other threads
+    std::mutex TranslateMutex;
+
+    explicit State(std::shared_ptr<Z3FreshCounters> Fresh)
+            : Solver(Ctx), IncrementalSolver(Ctx), SolverAssumptions(Ctx), Goal(Ctx),
+              SplitClause(Ctx, "split-clause"), Skip(Ctx, "skip"), Simplify(Ctx, "simplify"),
+              Fresh(std::move(Fresh)), Len(Ctx) {}
+};
+
+/// the state of the current session of the calling thread
+inline Z3Session::State &state() {
+    return *Z3Session::current().S;
+}
+
+#endif //SUPPORT_Z3SESSION_H
@@ -0,0 +1,359 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <llvm/Support/FileSystem.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "Support/Debug.h"
+#include "Z3Session.h"
+#include "Z3SolverCache.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> SolverCacheFile("pardiff-solver-cache",
+                                            cl::desc("persist the results of the solver in this file, "
+                                                     "and reuse them in later runs"),
+                                            cl::init(""), cl::value_desc("filename"));
+
+/// the layout of the cache file is the magic followed by a sequence of records,
+/// each record is a header optionally followed by the bytes of a model
+static const char Magic[8] = {'P', 'D', 'Z', '3', 'Q', 'C', '0', '1'};
+
+namespace {
+struct Record {
+    uint64_t H1;
+    uint64_t H2;
+    uint32_t Sat;
+    uint32_t ModelSize;
+};
+
+struct Entry {
+    bool Sat;
+    bool HasModel;
+    std::vector<uint8_t> Model;
+};
+
+struct KeyHash {
+    size_t operator()(const Z3SolverCache::Key &K) const { return K.H1; }
+};
+
+typedef std::unordered_map<unsigned, Z3SolverKeyEntry> KeyMemo;
+} // namespace
+
+static const uint32_t NoModel = UINT32_MAX;
+
+// the cache is shared by all threads
+static std::mutex CacheMutex;
+static std::unordered_map<Z3SolverCache::Key, Entry, KeyHash> Cache;
+static std::unique_ptr<raw_fd_ostream> CacheOut;
+static bool CacheLoaded = false;
+
+static unsigned NumHits = 0;
+static unsigned NumMisses = 0;
+static unsigned NumLoaded = 0;
+static std::chrono::steady_clock::duration MissTime(0);
+static thread_local std::chrono::steady_clock::time_point MissBegin;
+
+static uint64_t fmix(uint64_t H) {
+    H ^= H >> 33;
+    H *= 0xff51afd7ed558ccdULL;
+    H ^= H >> 33;
+    H *= 0xc4ceb9fe1a85ec53ULL;
+    H ^= H >> 33;
+    return H;
+}
+
+static void mix(Z3SolverCache::Key &K, uint64_t V) {
+    K.H1 = fmix(K.H1 ^ V) + 0x9e3779b97f4a7c15ULL;
+    K.H2 = fmix(K.H2 + V * 0x100000001b3ULL) ^ (K.H2 >> 29);
+}
+
+static uint64_t hashString(const char *Str) {
+    uint64_t H = 0xcbf29ce484222325ULL;
+    for (; *Str; ++Str) {
+        H ^= (uint8_t) *Str;
+        H *= 0x100000001b3ULL;
+    }
+    return H;
+}
+
+static Z3SolverCache::Key seed(uint64_t V) {
+    Z3SolverCache::Key K = {0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL};
+    mix(K, V);
+    return K;
+}
+
+static bool isCommutative(Z3_decl_kind Kind) {
+    switch (Kind) {
+        case Z3_OP_AND:
+        case Z3_OP_OR:
+        case Z3_OP_XOR:
+        case Z3_OP_EQ:
+        case Z3_OP_DISTINCT:
+        case Z3_OP_ADD:
+        case Z3_OP_MUL:
+        case Z3_OP_BADD:
+        case Z3_OP_BMUL:
+        case Z3_OP_BAND:
+        case Z3_OP_BOR:
+        case Z3_OP_BXOR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void mixSort(Z3SolverCache::Key &K, const z3::sort &S) {
+    mix(K, S.sort_kind());
+    if (S.is_bv()) mix(K, S.bv_size());
+}
+
+/// the key of an expr whose arguments are keyed in \p Memo
+static Z3SolverCache::Key keyOf(const z3::expr &E, const KeyMemo &Memo) {
+    Z3SolverCache::Key K;
+    if (E.is_numeral()) {
+        K = seed(Z3_OP_BNUM);
+        mixSort(K, E.get_sort());
+        mix(K, hashString(Z3_get_numeral_string(E.ctx(), E)));
+    } else if (E.is_app()) {
+        auto Decl = E.decl();
+        auto Kind = Decl.decl_kind();
+        K = seed(Kind);
+        if (Kind == Z3_OP_UNINTERPRETED) mix(K, hashString(Z3_get_symbol_string(E.ctx(), Z3_get_decl_name(E.ctx(), Decl))));
+        unsigned NumParams = Z3_get_decl_num_parameters(E.ctx(), Decl);
+        for (unsigned I = 0; I < NumParams; ++I) {
+            auto ParamKind = Z3_get_decl_parameter_kind(E.ctx(), Decl, I);
+            mix(K, ParamKind);
+            if (ParamKind == Z3_PARAMETER_INT) mix(K, (uint64_t) Z3_get_decl_int_parameter(E.ctx(), Decl, I));
+        }
+        mixSort(K, E.get_sort());
+
+        std::vector<Z3SolverCache::Key> Args;
+        Args.reserve(E.num_args());
+        for (unsigned I = 0; I < E.num_args(); ++I) Args.push_back(Memo.at(Z3::id(E.arg(I))).Key);
+        if (isCommutative(Kind)) std::sort(Args.begin(), Args.end());
+        for (auto &A: Args) {
+            mix(K, A.H1);
+            mix(K, A.H2);
+        }
+    } else {
+        // quantifiers and variables do not appear in our queries, fall back to the text
+        K = seed(E.kind());
+        mix(K, hashString(E.to_string().c_str()));
+    }
+    return K;
+}
+
+/// keys the sub-exprs in post order with an explicit stack, so that deep exprs do not overflow the call stack
+static Z3SolverCache::Key key(const z3::expr &E, KeyMemo &Memo) {
+    auto It = Memo.find(Z3::id(E));
+    if (It != Memo.end()) return It->second.Key;
+
+    // the flag tells if the arguments of the expr are pushed already
+    std::vector<std::pair<z3::expr, bool>> Stack;
+    Stack.emplace_back(E, false);
+    while (!Stack.empty()) {
+        auto Top = Stack.back().first;
+        auto TopID = Z3::id(Top);
+        if (Memo.count(TopID)) {
+            Stack.pop_back();
+            continue;
+        }
+        if (!Stack.back().second && Top.is_app() && Top.num_args() > 0) {
+            Stack.back().second = true;
+            for (unsigned I = 0; I < Top.num_args(); ++I) {
+                auto Arg = Top.arg(I);
+                if (!Memo.count(Z3::id(Arg))) Stack.emplace_back(Arg, false);
+            }
+            continue;
+        }
+        Stack.pop_back();
+        auto K = keyOf(Top, Memo);
+        Memo.emplace(TopID, Z3SolverKeyEntry{Top, K});
+    }
+    return Memo.at(Z3::id(E)).Key;
+}
+
+/// the memo is dropped as a whole when it grows too large
+static const size_t MaxSolverKeys = 1 << 20;
+
+/// the keys memoized by the current session, which live across queries, or \p Local for the exprs of another session
+static KeyMemo &memo(const z3::expr &E, KeyMemo &Local) {
+    auto &S = state();
+    if ((Z3_context) E.ctx() != (Z3_context) S.Ctx) return Local;
+    if (S.SolverKeys.size() >= MaxSolverKeys) S.SolverKeys.clear();
+    return S.SolverKeys;
+}
+
+Z3SolverCache::Key Z3SolverCache::key(const z3::expr &E) {
+    KeyMemo Local;
+    return ::key(E, memo(E, Local));
+}
+
+template<class VectorTy>
+static Z3SolverCache::Key keyConjunction(const VectorTy &V) {
+    KeyMemo Local;
+    std::vector<Z3SolverCache::Key> Args;
+    for (unsigned I = 0; I < V.size(); ++I) Args.push_back(key(V[I], memo(V[I], Local)));
+    std::sort(Args.begin(), Args.end());
+
+    // keep the same as the key of the and-expr
+    auto K = seed(Z3_OP_AND);
+    mix(K, Z3_BOOL_SORT);
+    for (auto &A: Args) {
+        mix(K, A.H1);
+        mix(K, A.H2);
+    }
+    return K;
+}
+
+Z3SolverCache::Key Z3SolverCache::key(const std::vector<z3::expr> &V) {
+    return keyConjunction(V);
+}
+
+Z3SolverCache::Key Z3SolverCache::key(const z3::expr_vector &V) {
+    return keyConjunction(V);
+}
+
+Z3SolverCache::Key Z3SolverCache::combine(const Key &K1, const Key &K2) {
+    auto K = K1;
+    mix(K, K2.H1);
+    mix(K, K2.H2);
+    return K;
+}
+
+Z3SolverCache::Key Z3SolverCache::merge(const Key &K1, const Key &K2) {
+    return {K1.H1 + K2.H1, K1.H2 + K2.H2};
+}
+
+static void write(const Z3SolverCache::Key &K, const Entry &E) {
+    Record R = {K.H1, K.H2, E.Sat, E.HasModel ? (uint32_t) E.Model.size() : NoModel};
+    CacheOut->write((const char *) &R, sizeof(Record));
+    if (E.HasModel) CacheOut->write((const char *) E.Model.data(), E.Model.size());
+}
+
+static void load() {
+    CacheLoaded = true;
+    if (SolverCacheFile.empty()) return;
+
+    uint64_t Size = 0;
+    bool Valid = false;
+    bool Complete = false;
+    if (!sys::fs::file_size(SolverCacheFile, Size) && Size >= sizeof(Magic)) {
+        auto FD = sys::fs::openNativeFileForRead(SolverCacheFile);
+        if (FD) {
+            std::error_code EC;
+            sys::fs::mapped_file_region Region(*FD, sys::fs::mapped_file_region::readonly, Size, 0, EC);
+            sys::fs::closeFile(*FD);
+            if (!EC && !memcmp(Region.const_data(), Magic, sizeof(Magic))) {
+                Valid = true;
+                const char *Ptr = Region.const_data() + sizeof(Magic);
+                const char *End = Region.const_data() + Size;
+                while (Ptr + sizeof(Record) <= End) {
+                    Record R;
+                    memcpy(&R, Ptr, sizeof(Record));
+                    Ptr += sizeof(Record);
+                    Entry &E = Cache[{R.H1, R.H2}];
+                    E.Sat = R.Sat;
+                    E.HasModel = R.ModelSize != NoModel;
+                    if (E.HasModel) {
+                        // a record truncated by an interrupted run
+                        if (Ptr + R.ModelSize > End) {
+                            Cache.erase({R.H1, R.H2});
+                            break;
+                        }
+                        E.Model.assign(Ptr, Ptr + R.ModelSize);
+                        Ptr += R.ModelSize;
+                    }
+                    ++NumLoaded;
+                }
+                Complete = Ptr == End;
+            }
+        } else {
+            consumeError(FD.takeError());
+        }
+    }
+    if (Size && !Valid) pardiff_WARN("The solver cache " << SolverCacheFile << " is not valid, overwrite it!");
+
+    // records are appended to a complete file, otherwise the file is rewritten with what has been loaded
+    std::error_code EC;
+    CacheOut = std::make_unique<raw_fd_ostream>(SolverCacheFile, EC, Complete ? sys::fs::OF_Append : sys::fs::OF_None);
+    if (EC) {
+        pardiff_WARN("Cannot open the solver cache " << SolverCacheFile << ": " << EC.message());
+        CacheOut.reset();
+        return;
+    }
+    if (!Complete) {
+        CacheOut->write(Magic, sizeof(Magic));
+        for (auto &It: Cache) write(It.first, It.second);
+    }
+}
+
+static bool lookup(const Z3SolverCache::Key &K, bool &Sat, std::vector<uint8_t> *Model) {
+    std::lock_guard<std::mutex> Lock(CacheMutex);
+    if (!CacheLoaded) load();
+    auto It = Cache.find(K);
+    if (It == Cache.end() || (Model && !It->second.HasModel)) {
+        ++NumMisses;
+        MissBegin = std::chrono::steady_clock::now();
+        return false;
+    }
+    ++NumHits;
+    Sat = It->second.Sat;
+    if (Model) *Model = It->second.Model;
+    return true;
+}
+
+static void insert(const Z3SolverCache::Key &K, bool Sat, const std::vector<uint8_t> *Model) {
+    std::lock_guard<std::mutex> Lock(CacheMutex);
+    MissTime += std::chrono::steady_clock::now() - MissBegin;
+    Entry &E = Cache[K];
+    E.Sat = Sat;
+    E.HasModel = Model;
+    if (Model) E.Model = *Model;
+
+    if (CacheOut) write(K, E);
+}
+
+bool Z3SolverCache::lookup(const Key &K, bool &Sat) {
+    return ::lookup(K, Sat, nullptr);
+}
+
+bool Z3SolverCache::lookup(const Key &K, bool &Sat, std::vector<uint8_t> &Model) {
+    return ::lookup(K, Sat, &Model);
+}
+
+void Z3SolverCache::insert(const Key &K, bool Sat) {
+    ::insert(K, Sat, nullptr);
+}
+
+void Z3SolverCache::insert(const Key &K, bool Sat, const std::vector<uint8_t> &Model) {
+    ::insert(K, Sat, &Model);
+}
+
+void Z3SolverCache::report() {
+    std::lock_guard<std::mutex> Lock(CacheMutex);
+    if (CacheOut) CacheOut->flush();
+    auto Mili = std::chrono::duration_cast<std::chrono::milliseconds>(MissTime).count();
+    pardiff_INFO("Solver cache: " << NumHits << " hits, " << NumMisses << " misses ("
+                                  << Mili << "ms solving), " << NumLoaded << " entries loaded");
+}
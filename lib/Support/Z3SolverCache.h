@@ -0,0 +1,72 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SUPPORT_Z3SOLVERCACHE_H
+#define SUPPORT_Z3SOLVERCACHE_H
+
+#include <cstdint>
+#include <vector>
+#include "Support/Z3.h"
+
+/// a cache of solver results used by Z3Solver, see Z3SolverCache.cpp
+///
+/// a query is keyed by a 128-bit structural hash of the asserted expr, which does not depend on
+/// the ids z3 assigns in a run, so that the results persisted to the cache file can be reused by later runs
+class Z3SolverCache {
+public:
+    struct Key {
+        uint64_t H1;
+        uint64_t H2;
+
+        bool operator==(const Key &K) const { return H1 == K.H1 && H2 == K.H2; }
+
+        bool operator<(const Key &K) const { return H1 < K.H1 || (H1 == K.H1 && H2 < K.H2); }
+    };
+
+    /// structural hash of an expr, the operands of commutative operators are hashed in a canonical order
+    static Key key(const z3::expr &);
+
+    /// a vector of exprs is keyed as the conjunction of its elements
+    /// @{
+    static Key key(const std::vector<z3::expr> &);
+
+    static Key key(const z3::expr_vector &);
+    /// @}
+
+    /// the key of a query over a sequence of keys, e.g., the assertions in a solver and an expr checked against them
+    static Key combine(const Key &, const Key &);
+
+    /// the key of a set of keys, which does not depend on the order they are merged
+    static Key merge(const Key &, const Key &);
+
+    /// the time from a missed lookup to the insert of its result is counted as solving time
+    /// @{
+    static bool lookup(const Key &, bool &Sat);
+
+    static bool lookup(const Key &, bool &Sat, std::vector<uint8_t> &Model);
+
+    static void insert(const Key &, bool Sat);
+
+    static void insert(const Key &, bool Sat, const std::vector<uint8_t> &Model);
+    /// @}
+
+    /// write out the new entries and print the statistics of the cache
+    static void report();
+};
+
+#endif //SUPPORT_Z3SOLVERCACHE_H
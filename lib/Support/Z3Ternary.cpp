@@ -18,9 +18,8 @@
 
 #include "Z3Macro.h"
 #include "Support/Z3.h"
+#include "Z3Session.h"
 
-static std::map<unsigned, z3::expr_vector> PhiID2CondMap;
-static std::map<unsigned, std::pair<BasicBlock *, std::vector<BasicBlock *>>> PhiID2BlockMap;
 
 z3::expr Z3::ite(const z3::expr &C, const z3::expr &O1, const z3::expr &O2) {
     if (C.is_not())
@@ -96,6 +95,7 @@ z3::expr Z3::select_phi_arg(unsigned int PhiID, unsigned int ArgID, const z3::ex
 }
 
 z3::expr Z3::make_phi(unsigned ID, const z3::expr_vector &ValVec, const z3::expr_vector &CondVec) {
+    auto &PhiID2CondMap = state().PhiID2CondMap;
     assert(!ValVec.empty());
     assert(ValVec.size() == CondVec.size());
 
@@ -134,7 +134,7 @@ z3::expr Z3::make_phi(unsigned ID, const z3::expr_vector &ValVec, const z3::expr
 }
 
 z3::expr Z3::make_phi(unsigned ID, const z3::expr_vector &ValVec) {
-    return make_phi(ID, ValVec, PhiID2CondMap.at(ID));
+    return make_phi(ID, ValVec, state().PhiID2CondMap.at(ID));
 }
 
 bool Z3::is_phi(const z3::expr &Expr) {
@@ -158,6 +158,7 @@ unsigned Z3::phi_id(const z3::expr &Expr) {
 }
 
 unsigned Z3::phi_cond_id(unsigned PhiID, unsigned K) {
+    auto &PhiID2CondMap = state().PhiID2CondMap;
     auto It = PhiID2CondMap.find(PhiID);
     assert (It != PhiID2CondMap.end());
     auto Cond = It->second[K];
@@ -165,6 +166,7 @@ unsigned Z3::phi_cond_id(unsigned PhiID, unsigned K) {
 }
 
 z3::expr_vector Z3::phi_cond(unsigned PhiID) {
+    auto &PhiID2CondMap = state().PhiID2CondMap;
     auto It = PhiID2CondMap.find(PhiID);
     if (It == PhiID2CondMap.end()) {
         return Z3::vec();
@@ -174,10 +176,36 @@ z3::expr_vector Z3::phi_cond(unsigned PhiID) {
 }
 
 bool Z3::has_phi(unsigned PhiID) {
-    return PhiID2CondMap.count(PhiID);
+    return state().PhiID2CondMap.count(PhiID);
+}
+
+void Z3::translate_phis(const std::set<unsigned> &PhiIDs, Z3Session &To) {
+    auto &From = state();
+    std::vector<z3::expr> Conds;
+    for (auto PhiID: PhiIDs) {
+        auto It = From.PhiID2CondMap.find(PhiID);
+        if (It == From.PhiID2CondMap.end()) continue;
+        for (auto Cond: It->second) Conds.push_back(Cond);
+    }
+    std::vector<z3::expr> Translated;
+    translate(Conds, To, Translated);
+
+    unsigned K = 0;
+    for (auto PhiID: PhiIDs) {
+        auto It = From.PhiID2CondMap.find(PhiID);
+        if (It == From.PhiID2CondMap.end()) continue;
+        z3::expr_vector CondVec(To.context());
+        for (unsigned I = 0; I < It->second.size(); ++I) CondVec.push_back(Translated[K++]);
+        To.S->PhiID2CondMap.erase(PhiID);
+        To.S->PhiID2CondMap.emplace(PhiID, CondVec);
+
+        auto BlockIt = From.PhiID2BlockMap.find(PhiID);
+        if (BlockIt != From.PhiID2BlockMap.end()) To.S->PhiID2BlockMap[PhiID] = BlockIt->second;
+    }
 }
 
 void Z3::bind_phi_id(unsigned PhiID, BasicBlock *MergePoint, const std::vector<BasicBlock *> &Preds) {
+    auto &PhiID2BlockMap = state().PhiID2BlockMap;
     assert(!PhiID2BlockMap.count(PhiID));
     auto &Pair = PhiID2BlockMap[PhiID];
     Pair.first = MergePoint;
@@ -185,6 +213,7 @@ void Z3::bind_phi_id(unsigned PhiID, BasicBlock *MergePoint, const std::vector<B
 }
 
 BasicBlock *Z3::phi_block(unsigned PhiID) {
+    auto &PhiID2BlockMap = state().PhiID2BlockMap;
     auto It = PhiID2BlockMap.find(PhiID);
     if (It != PhiID2BlockMap.end()) {
         return It->second.first;
@@ -193,6 +222,7 @@ BasicBlock *Z3::phi_block(unsigned PhiID) {
 }
 
 const std::vector<BasicBlock *> *Z3::phi_predecessor_blocks(unsigned PhiID) {
+    auto &PhiID2BlockMap = state().PhiID2BlockMap;
     auto It = PhiID2BlockMap.find(PhiID);
     if (It != PhiID2BlockMap.end()) {
         return &It->second.second;
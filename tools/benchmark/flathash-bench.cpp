@@ -0,0 +1,161 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/// compares FlatIDSet and FlatIDMap with std::set and std::map on the ids of z3 exprs shaped like the path
+/// conditions, i.e., built from the selects of the byte array B by +, ^, ite and concat
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/raw_ostream.h>
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+#include <z3++.h>
+#include "Support/FlatHash.h"
+
+using namespace llvm;
+
+static cl::opt<unsigned> NumExprs("exprs", cl::desc("the number of exprs built"), cl::init(20000));
+
+static cl::opt<unsigned> NumRoots("roots", cl::desc("the number of exprs traversed as roots"), cl::init(200));
+
+static cl::opt<unsigned> NumRounds("rounds", cl::desc("the number of rounds inserting and looking up all the ids"),
+                                   cl::init(200));
+
+static cl::opt<unsigned> Seed("seed", cl::desc("the seed of the random exprs"), cl::init(1));
+
+static unsigned id(const z3::expr &E) {
+    return Z3_get_ast_id(E.ctx(), E);
+}
+
+/// random byte-sized exprs, each built from earlier ones, so that they form a dag sharing sub-exprs
+static void build(z3::context &Ctx, std::vector<z3::expr> &Exprs) {
+    std::mt19937 Rand(Seed);
+    auto B = Ctx.constant("B", Ctx.array_sort(Ctx.bv_sort(64), Ctx.bv_sort(8)));
+    for (unsigned I = 0; I < 64; ++I) Exprs.push_back(z3::select(B, Ctx.bv_val(I, 64)));
+    while (Exprs.size() < NumExprs) {
+        auto &X = Exprs[Rand() % Exprs.size()];
+        auto &Y = Exprs[Rand() % Exprs.size()];
+        switch (Rand() % 4) {
+            case 0: Exprs.push_back(X + Y); break;
+            case 1: Exprs.push_back(X ^ Y); break;
+            case 2: Exprs.push_back(z3::ite(X == Y, X, Y + Ctx.bv_val(1, 8))); break;
+            default: Exprs.push_back(z3::concat(X, Y).extract(11, 4)); break;
+        }
+    }
+}
+
+template<class Fn>
+static double measure(Fn F) {
+    auto Begin = std::chrono::steady_clock::now();
+    F();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Begin).count();
+}
+
+static bool insert(std::set<unsigned> &Set, unsigned ID) { return Set.insert(ID).second; }
+
+static bool insert(FlatIDSet &Set, unsigned ID) { return Set.insert(ID); }
+
+/// the visited-set walk of the Z3 traversals from each root, return the number of visits
+template<class SetTy>
+static uint64_t traverse(const std::vector<z3::expr> &Roots) {
+    uint64_t Visits = 0;
+    for (auto &Root: Roots) {
+        SetTy Visited;
+        std::vector<z3::expr> Stack = {Root};
+        while (!Stack.empty()) {
+            auto Top = Stack.back();
+            Stack.pop_back();
+            if (!insert(Visited, id(Top))) continue;
+            ++Visits;
+            for (unsigned I = 0; I < Top.num_args(); ++I) Stack.push_back(Top.arg(I));
+        }
+    }
+    return Visits;
+}
+
+template<class SetTy>
+static uint64_t insertAndCount(const std::vector<unsigned> &IDs) {
+    uint64_t Found = 0;
+    for (unsigned R = 0; R < NumRounds; ++R) {
+        SetTy Set;
+        for (auto ID: IDs) insert(Set, ID);
+        for (auto ID: IDs) Found += Set.count(ID + (R & 1));
+    }
+    return Found;
+}
+
+static uint64_t insertAndFindStd(const std::vector<unsigned> &IDs) {
+    uint64_t Sum = 0;
+    for (unsigned R = 0; R < NumRounds; ++R) {
+        std::map<unsigned, unsigned> Map;
+        for (auto ID: IDs) Map.insert({ID, ID ^ R});
+        for (auto ID: IDs) {
+            auto It = Map.find(ID);
+            if (It != Map.end()) Sum += It->second;
+        }
+    }
+    return Sum;
+}
+
+static uint64_t insertAndFindFlat(const std::vector<unsigned> &IDs) {
+    uint64_t Sum = 0;
+    for (unsigned R = 0; R < NumRounds; ++R) {
+        FlatIDMap<unsigned> Map;
+        for (auto ID: IDs) Map.insert(ID, ID ^ R);
+        for (auto ID: IDs) {
+            if (auto *V = Map.find(ID)) Sum += *V;
+        }
+    }
+    return Sum;
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Compares the flat id containers with the std containers\n");
+
+    z3::context Ctx;
+    std::vector<z3::expr> Exprs;
+    build(Ctx, Exprs);
+    std::vector<z3::expr> Roots(Exprs.end() - std::min<size_t>(NumRoots, Exprs.size()), Exprs.end());
+    std::vector<unsigned> IDs;
+    for (auto &E: Exprs) IDs.push_back(id(E));
+
+    uint64_t R1 = 0, R2 = 0;
+    auto T1 = measure([&]() { R1 = traverse<std::set<unsigned>>(Roots); });
+    auto T2 = measure([&]() { R2 = traverse<FlatIDSet>(Roots); });
+    outs() << "dag traversal of " << Roots.size() << " roots (" << R1 << " visits): std::set "
+           << format("%.1f", T1) << "ms, FlatIDSet " << format("%.1f", T2) << "ms\n";
+    if (R1 != R2) errs() << "error: the visits differ: " << R1 << " vs. " << R2 << "\n";
+
+    T1 = measure([&]() { R1 = insertAndCount<std::set<unsigned>>(IDs); });
+    T2 = measure([&]() { R2 = insertAndCount<FlatIDSet>(IDs); });
+    outs() << "insert + lookup of " << IDs.size() << " ids x" << NumRounds << ": std::set " << format("%.1f", T1)
+           << "ms, FlatIDSet " << format("%.1f", T2) << "ms\n";
+    if (R1 != R2) errs() << "error: the lookups differ: " << R1 << " vs. " << R2 << "\n";
+
+    T1 = measure([&]() { R1 = insertAndFindStd(IDs); });
+    T2 = measure([&]() { R2 = insertAndFindFlat(IDs); });
+    outs() << "insert + find of " << IDs.size() << " ids x" << NumRounds << ": std::map " << format("%.1f", T1)
+           << "ms, FlatIDMap " << format("%.1f", T2) << "ms\n";
+    if (R1 != R2) errs() << "error: the finds differ: " << R1 << " vs. " << R2 << "\n";
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ *  pardiff lifts protocol source code in C to its specification in BNF
+ *  Copyright (C) 2021
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/// compares the hashing loop of SliceGraph::simplifyByHashConsing, i.e., 64-bit structural hashes in a dense map,
+/// with the former one, i.e., md5 digests of decimal strings in a std::map, on random layered dags
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<unsigned> NumNodes("nodes", cl::desc("the sizes of the dags, e.g., -nodes=20000,200000"),
+                                   cl::CommaSeparated);
+
+static cl::opt<unsigned> NumConditions("conditions", cl::desc("the number of distinct condition ids"), cl::init(64));
+
+static cl::opt<unsigned> MaxChildren("children", cl::desc("the maximum number of children of a node"), cl::init(3));
+
+static cl::opt<unsigned> Seed("seed", cl::desc("the seed of the random dags"), cl::init(1));
+
+namespace {
+struct Node {
+    unsigned Condition;
+    std::vector<unsigned> Children;
+};
+} // namespace
+
+/// a layered dag, a node only points to the nodes of the next layer, thus the nodes are in topological order
+static std::vector<Node> build(unsigned Size) {
+    std::mt19937 Rand(Seed);
+    unsigned Width = std::max(1u, (unsigned) std::sqrt((double) Size));
+    std::vector<Node> Nodes(Size);
+    for (unsigned I = 0; I < Size; ++I) {
+        Nodes[I].Condition = Rand() % NumConditions;
+        unsigned NextBegin = (I / Width + 1) * Width;
+        if (NextBegin >= Size) continue;
+        unsigned NextEnd = std::min(Size, NextBegin + Width);
+        unsigned N = Rand() % (MaxChildren + 1);
+        for (unsigned K = 0; K < N; ++K) Nodes[I].Children.push_back(NextBegin + Rand() % (NextEnd - NextBegin));
+        std::sort(Nodes[I].Children.begin(), Nodes[I].Children.end());
+        Nodes[I].Children.erase(std::unique(Nodes[I].Children.begin(), Nodes[I].Children.end()),
+                                Nodes[I].Children.end());
+    }
+    return Nodes;
+}
+
+/// the former loop, return the number of distinct structures
+static unsigned hashByMD5(const std::vector<Node> &Nodes) {
+    std::vector<std::string> NodeHashVec(Nodes.size());
+    std::map<std::string, unsigned> HashNodeMap;
+    std::set<std::string> Children;
+    for (unsigned I = Nodes.size(); I > 0; --I) {
+        auto &N = Nodes[I - 1];
+        std::string Str = std::to_string(N.Condition);
+        Children.clear();
+        for (auto Ch: N.Children) Children.insert(NodeHashVec[Ch]);
+        for (auto &Ch: Children) Str.append(".").append(Ch);
+
+        MD5 Hash;
+        Hash.update(Str);
+        MD5::MD5Result Res;
+        Hash.final(Res);
+        auto Digest = Res.digest().str().str();
+        NodeHashVec[I - 1] = Digest;
+        HashNodeMap.emplace(Digest, I - 1);
+    }
+    return HashNodeMap.size();
+}
+
+static uint64_t fmix(uint64_t H) {
+    H ^= H >> 33;
+    H *= 0xff51afd7ed558ccdULL;
+    H ^= H >> 33;
+    H *= 0xc4ceb9fe1a85ec53ULL;
+    H ^= H >> 33;
+    return H;
+}
+
+/// the current loop, a node is represented by the first node of the same structure, as if merged into it
+static unsigned hashStructurally(const std::vector<Node> &Nodes) {
+    std::vector<uint64_t> NodeHashVec(Nodes.size());
+    std::vector<unsigned> RepVec(Nodes.size());
+    std::vector<std::vector<unsigned>> RepChildrenVec(Nodes.size());
+    DenseMap<uint64_t, unsigned> HashNodeMap;
+    std::vector<uint64_t> ChildHashVec;
+    for (unsigned I = Nodes.size(); I > 0; --I) {
+        auto &N = Nodes[I - 1];
+        auto &RepChildren = RepChildrenVec[I - 1];
+        // the children merged into the same node are one child, as in the children set of a slice node
+        for (auto Ch: N.Children) RepChildren.push_back(RepVec[Ch]);
+        std::sort(RepChildren.begin(), RepChildren.end());
+        RepChildren.erase(std::unique(RepChildren.begin(), RepChildren.end()), RepChildren.end());
+        ChildHashVec.clear();
+        for (auto Ch: RepChildren) ChildHashVec.push_back(NodeHashVec[Ch]);
+        std::sort(ChildHashVec.begin(), ChildHashVec.end());
+        auto Hash = fmix(N.Condition);
+        for (auto ChHash: ChildHashVec) Hash = fmix(Hash ^ ChHash) + 0x9e3779b97f4a7c15ULL;
+
+        RepVec[I - 1] = I - 1;
+        while (true) {
+            if (Hash >= DenseMapInfo<uint64_t>::getTombstoneKey()) Hash = 0;
+            auto It = HashNodeMap.try_emplace(Hash, I - 1);
+            if (It.second) break;
+            auto X = It.first->second;
+            if (Nodes[X].Condition == N.Condition && RepChildrenVec[X] == RepChildren) {
+                RepVec[I - 1] = X;
+                break;
+            }
+            ++Hash;
+        }
+        NodeHashVec[I - 1] = Hash;
+    }
+    return HashNodeMap.size();
+}
+
+template<class Fn>
+static double measure(Fn F) {
+    auto Begin = std::chrono::steady_clock::now();
+    F();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Begin).count();
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Compares the hash-consing loops of the slice graph\n");
+
+    std::vector<unsigned> Sizes(NumNodes.begin(), NumNodes.end());
+    if (Sizes.empty()) Sizes = {20000, 200000, 1000000};
+    for (auto Size: Sizes) {
+        auto Nodes = build(Size);
+        unsigned N1 = 0, N2 = 0;
+        auto T1 = measure([&]() { N1 = hashByMD5(Nodes); });
+        auto T2 = measure([&]() { N2 = hashStructurally(Nodes); });
+        outs() << Size << " nodes (" << N2 << " structures): md5 " << format("%.1f", T1) << "ms, structural "
+               << format("%.1f", T2) << "ms\n";
+        if (N1 != N2) errs() << "error: the structures differ: " << N1 << " vs. " << N2 << "\n";
+    }
+    return 0;
+}
@@ -25,7 +25,9 @@
 #include "BNF/BNF.h"
 #include "Core/DistinctMetadataAnalysis.h"
 #include "Core/DomInformationAnalysis.h"
+#include "Core/ExecutionState.h"
 #include "Core/Executor.h"
+#include "Core/FunctionSummary.h"
 #include "Core/LoopInformationAnalysis.h"
 #include "Core/PLang.h"
 #include "Core/SliceGraph.h"
@@ -64,6 +66,8 @@ void LiftingProtocolFormatPass::getAnalysisUsage(AnalysisUsage &AU) const {
     AU.addRequired<DistinctMetadataAnalysis>();
 }
 
+LiftingProtocolFormatPass::LiftingProtocolFormatPass() : ModulePass(ID), Results(graphsForDiff) {}
+
 bool LiftingProtocolFormatPass::runOnModule(Module &M) {
     DL::initialize(M.getDataLayout());
     Z3::initialize();
@@ -96,6 +100,9 @@ bool LiftingProtocolFormatPass::runOnModule(Module &M) {
         Exe.visit(Entry);
         PC = Exe.getPC();
     }
+    // the abstract values are not used any more, release them with the exprs they hold
+    ExecutionState::releaseMemorySpaces();
+    FunctionSummary::release();
 
     {
         TimeRecorder SETimer("Step 2: Executing on the slice");
@@ -132,7 +139,7 @@ bool LiftingProtocolFormatPass::runOnModule(Module &M) {
             // errs()<<"----print out the size of productions: "<<B->Products.size()<<"\n";
             // SliceGraph *Slice = getGraph(B);
             
-            graphsForDiff.insert(graphsForDiff.end(),NewSlice->pc());
+            Results.insert(Results.end(),NewSlice->pc());
             //errs()<<"***   insert success: \n";
             // if (!Dot.getValue().empty()) 
             //     Slice->dot(Dot.getValue(), "SortedGraph");
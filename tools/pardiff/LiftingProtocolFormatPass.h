@@ -21,6 +21,8 @@
 
 #include <llvm/IR/Module.h>
 #include <llvm/Pass.h>
+#include <vector>
+#include <z3++.h>
 
 using namespace llvm;
 
@@ -28,7 +30,10 @@ class LiftingProtocolFormatPass : public ModulePass {
 public:
     static char ID;
 
-    LiftingProtocolFormatPass() : ModulePass(ID) {}
+    /// the lifted path conditions are appended to the given slot, which is graphsForDiff by default
+    LiftingProtocolFormatPass();
+
+    explicit LiftingProtocolFormatPass(std::vector<z3::expr> &Results) : ModulePass(ID), Results(Results) {}
 
     ~LiftingProtocolFormatPass() override = default;
 
@@ -38,6 +43,8 @@ public:
 
 private:
     void checkBuiltInFunctions(Module &M);
+
+    std::vector<z3::expr> &Results;
 };
 
 #endif /* pardiff_LIFTINGPROTOCOLFORMATPASS_H */
@@ -41,12 +41,14 @@
 #include <llvm/Transforms/Utils/UnifyFunctionExitNodes.h>
 #include "Support/TimeRecorder.h"
 #include <memory>
+#include <thread>
 
 #include "LiftingProtocolFormatPass.h"
 #include "BNF/FSM.h"
 #include "Support/Debug.h"
 #include "Support/InstructionVisitor.h"
 #include "BNF/BNF.h"
+#include "Core/FunctionSummary.h"
 #include "Core/SliceGraph.h"
 #include "Transform/LowerConstantExpr.h"
 #include "Transform/LowerGlobalConstantArraySelect.h"
@@ -87,6 +89,26 @@ static cl::opt<bool> OutputAssembly("S", cl::desc("Write output as LLVM assembly
 static cl::opt<bool> OnlyTransform("t", cl::desc("Only do preprocessing transform without lifting the specifications"),
                                    cl::init(false));
 
+static cl::opt<bool> ParallelLifting("pardiff-parallel",
+                                     cl::desc("Lift the two implementations concurrently, each in its own thread"),
+                                     cl::init(false));
+
+static cl::opt<bool> MinimizeFSM("pardiff-fsm-minimize",
+                                 cl::desc("Minimize the simplified FSMs before printing and comparing them"),
+                                 cl::init(true));
+
+enum DiffEngineKind {
+    DEK_Bisimulation,
+    DEK_PartitionRefinement,
+};
+
+static cl::opt<DiffEngineKind> DiffEngine("pardiff-diff-engine", cl::desc("How to compare the FSMs of the two implementations"),
+                                          cl::values(clEnumValN(DEK_Bisimulation, "bisim",
+                                                                "Match the transitions of the node pairs from the entries"),
+                                                     clEnumValN(DEK_PartitionRefinement, "partition",
+                                                                "Compute the coarsest bisimulation by partition refinement")),
+                                          cl::init(DEK_Bisimulation));
+
 class NotificationPass : public ModulePass {
 private:
     const char *Message;
@@ -112,6 +134,106 @@ char NotificationPass::ID = 0;
 
 //global varaibles for the results of two versions
 
+static void addPreprocessingPasses(legacy::PassManager &Passes) {
+    Passes.add(new NotificationPass("Start preprocessing the input bitcode ... "));
+    Passes.add(createLowerAtomicPass());
+    Passes.add(createLowerInvokePass());
+    Passes.add(createPromoteMemoryToRegisterPass());
+    Passes.add(createSCCPPass());
+    Passes.add(createLoopSimplifyPass());
+    Passes.add(new SimplifyLatch());
+    Passes.add(new MergeReturn());
+    Passes.add(new RemoveNoRetFunction());
+    Passes.add(new RemoveIrreducibleFunction());
+    Passes.add(new LowerConstantExpr());
+    Passes.add(new LowerSelect());
+    Passes.add(new RemoveDeadBlock());
+    Passes.add(new LowerGlobalConstantArraySelect());
+#ifndef NDEBUG
+    Passes.add(new NameBlock());
+#endif
+    Passes.add(new NotificationPass("Start preprocessing the input bitcode ... ""Done!"));
+}
+
+namespace {
+/// the result of lifting one implementation in its own thread
+struct LiftingSlot {
+    std::string InputFilename;
+    /// prefixes the fresh names of the slot, so that they do not depend on how the two threads are scheduled
+    std::string Namespace;
+    /// path conditions translated into the z3 context of the main thread
+    std::vector<z3::expr> Results;
+    bool Failed = false;
+};
+} // namespace
+
+/// lift one implementation with its own llvm context, z3 session and pass manager
+static void liftInThread(const char *Argv0, Z3Session &MainSession, LiftingSlot &Slot) {
+    Z3Session Session(&MainSession, Slot.Namespace);
+    Z3Session::Scope EnterSession(Session);
+
+    SMDiagnostic Err;
+    LLVMContext Context;
+    std::unique_ptr<Module> M = parseIRFile(Slot.InputFilename, Err, Context);
+    if (!M) {
+        Err.print(Argv0, errs());
+        Slot.Failed = true;
+        return;
+    }
+
+    if (verifyModule(*M, &errs())) {
+        errs() << Argv0 << ": error: input module is broken!\n";
+        Slot.Failed = true;
+        return;
+    }
+
+    std::vector<z3::expr> Results;
+    {
+        legacy::PassManager Passes;
+        addPreprocessingPasses(Passes);
+        if (!OnlyTransform) Passes.add(new LiftingProtocolFormatPass(Results));
+        Passes.run(*M);
+    }
+    errs()<<"\nInst num before slicing: "<<Inst.size()<<"\n";
+    errs()<<"\nInst num after slicing: "<<slice_Inst.size()<<"\n";
+
+    // the session of this thread is destroyed on return
+    Z3::translate(Results, MainSession, Slot.Results);
+}
+
+/// lift the two implementations concurrently and put the results in graphsForDiff in order
+static bool liftConcurrently(const char *Argv0) {
+    // the two threads share the output streams
+    outs().SetUnbuffered();
+
+    LiftingSlot Slot1, Slot2;
+    Slot1.InputFilename = InputFilename1.getValue();
+    Slot2.InputFilename = InputFilename2.getValue();
+    Slot1.Namespace = "m1_";
+    Slot2.Namespace = "m2_";
+    {
+        std::thread T1(liftInThread, Argv0, std::ref(Z3Session::current()), std::ref(Slot1));
+        std::thread T2(liftInThread, Argv0, std::ref(Z3Session::current()), std::ref(Slot2));
+        T1.join();
+        T2.join();
+    }
+    if (Slot1.Failed || Slot2.Failed) return false;
+
+    graphsForDiff.insert(graphsForDiff.end(), Slot1.Results.begin(), Slot1.Results.end());
+    graphsForDiff.insert(graphsForDiff.end(), Slot2.Results.begin(), Slot2.Results.end());
+
+    // the length of the message was created in the lifting threads, bind it in this thread as well
+    for (auto &PC: graphsForDiff) {
+        auto LenVec = Z3::find_all(PC, true, [](const z3::expr &E) { return Z3::is_length(E); });
+        if (!LenVec.empty()) {
+            Z3::length(LenVec[0].get_sort().bv_size());
+            break;
+        }
+    }
+    return true;
+}
+
+
 
 int main(int argc, char **argv) {
     InitLLVM X(argc, argv);
@@ -142,83 +264,74 @@ int main(int argc, char **argv) {
 
     SMDiagnostic Err;
     LLVMContext Context;
-
-    // the first graph
-    std::unique_ptr<Module> M1 = parseIRFile(InputFilename1.getValue(), Err, Context);
-    if (!M1) {
-        Err.print(argv[0], errs());
-        return 1;
-    }
-
-    if (verifyModule(*M1, &errs())) {
-        errs() << argv[0] << ": error: input module is broken!\n";
-        return 1;
-    }
-
-    // the second graph
-    std::unique_ptr<Module> M2 = parseIRFile(InputFilename2.getValue(), Err, Context);
-    if (!M2) {
-        Err.print(argv[1], errs());
-        return 1;
-    }
-
-    if (verifyModule(*M2, &errs())) {
-        errs() << argv[1] << ": error: input module is broken!\n";
-        return 1;
-    }
-
+    std::unique_ptr<Module> M1, M2;
     legacy::PassManager Passes;
+    std::unique_ptr<ToolOutputFile> Out;
 
-    Passes.add(new NotificationPass("Start preprocessing the input bitcode ... "));
-    Passes.add(createLowerAtomicPass());
-    Passes.add(createLowerInvokePass());
-    Passes.add(createPromoteMemoryToRegisterPass());
-    Passes.add(createSCCPPass());
-    Passes.add(createLoopSimplifyPass());
-    Passes.add(new SimplifyLatch());
-    Passes.add(new MergeReturn());
-    Passes.add(new RemoveNoRetFunction());
-    Passes.add(new RemoveIrreducibleFunction());
-    Passes.add(new LowerConstantExpr());
-    Passes.add(new LowerSelect());
-    Passes.add(new RemoveDeadBlock());
-    Passes.add(new LowerGlobalConstantArraySelect());
-#ifndef NDEBUG
-    Passes.add(new NameBlock());
-#endif
-    Passes.add(new NotificationPass("Start preprocessing the input bitcode ... ""Done!"));
-    if (!OnlyTransform) Passes.add(new LiftingProtocolFormatPass());
+    if (ParallelLifting) {
+        if (!OutputFilename.getValue().empty()) {
+            errs() << argv[0] << ": error: -o cannot be used with -pardiff-parallel!\n";
+            return 1;
+        }
+        if (!liftConcurrently(argv[0])) return 1;
+    } else {
+        // the first graph
+        M1 = parseIRFile(InputFilename1.getValue(), Err, Context);
+        if (!M1) {
+            Err.print(argv[0], errs());
+            return 1;
+        }
 
-    std::unique_ptr<ToolOutputFile> Out;
-    if (!OutputFilename.getValue().empty()) {
-        std::error_code EC;
-        Out = std::make_unique<ToolOutputFile>(OutputFilename, EC, sys::fs::F_None);
-        if (EC) {
-            errs() << EC.message() << '\n';
+        if (verifyModule(*M1, &errs())) {
+            errs() << argv[0] << ": error: input module is broken!\n";
             return 1;
         }
 
-        if (OutputAssembly.getValue()) {
-            Passes.add(createPrintModulePass(Out->os()));
-        } else {
-            Passes.add(createBitcodeWriterPass(Out->os()));
+        // the second graph
+        M2 = parseIRFile(InputFilename2.getValue(), Err, Context);
+        if (!M2) {
+            Err.print(argv[1], errs());
+            return 1;
         }
-    }
 
-    Passes.add(new NotificationPass("Start preprocessing the diff of two programs "));
-    Passes.add(new NotificationPass("Start to get BNF for the first implementation ... ""Done!"));
-    Passes.run(*M1);
-    errs()<<"\nInst num before slicing: "<<Inst.size()<<"\n";
-    errs()<<"\nInst num after slicing: "<<slice_Inst.size()<<"\n";
+        if (verifyModule(*M2, &errs())) {
+            errs() << argv[1] << ": error: input module is broken!\n";
+            return 1;
+        }
 
-    Passes.add(new NotificationPass("Start to get BNF for the second implementation ... ""Done!"));
-    Passes.add(new NotificationPass("Start to get BNF for the first implementation ... ""Done!"));
-    Inst.clear();
-    slice_Inst.clear();
-    Passes.run(*M2);
-    errs()<<"\nInst num before slicing: "<<Inst.size()<<"\n";
-    errs()<<"\nInst num after slicing: "<<slice_Inst.size()<<"\n";
-    Passes.add(new NotificationPass("Start to get BNF for the second implementation ... ""Done!"));
+        addPreprocessingPasses(Passes);
+        if (!OnlyTransform) Passes.add(new LiftingProtocolFormatPass());
+
+        if (!OutputFilename.getValue().empty()) {
+            std::error_code EC;
+            Out = std::make_unique<ToolOutputFile>(OutputFilename, EC, sys::fs::F_None);
+            if (EC) {
+                errs() << EC.message() << '\n';
+                return 1;
+            }
+
+            if (OutputAssembly.getValue()) {
+                Passes.add(createPrintModulePass(Out->os()));
+            } else {
+                Passes.add(createBitcodeWriterPass(Out->os()));
+            }
+        }
+
+        Passes.add(new NotificationPass("Start preprocessing the diff of two programs "));
+        Passes.add(new NotificationPass("Start to get BNF for the first implementation ... ""Done!"));
+        Passes.run(*M1);
+        errs()<<"\nInst num before slicing: "<<Inst.size()<<"\n";
+        errs()<<"\nInst num after slicing: "<<slice_Inst.size()<<"\n";
+
+        Passes.add(new NotificationPass("Start to get BNF for the second implementation ... ""Done!"));
+        Passes.add(new NotificationPass("Start to get BNF for the first implementation ... ""Done!"));
+        Inst.clear();
+        slice_Inst.clear();
+        Passes.run(*M2);
+        errs()<<"\nInst num before slicing: "<<Inst.size()<<"\n";
+        errs()<<"\nInst num after slicing: "<<slice_Inst.size()<<"\n";
+        Passes.add(new NotificationPass("Start to get BNF for the second implementation ... ""Done!"));
+    }
     //errs()<<"***first:";
     //errs()<<graphsForDiff[0]<<"\n";
     //errs()<<"***second:";
@@ -231,54 +344,70 @@ int main(int argc, char **argv) {
     BNFRef BNF2 = BNF::get(graphsForDiff[1]);
     errs()<<"\nBNF for the first version:\n"<<BNF1;
     errs()<<"\n\nBNF for the second version:\n"<<BNF2;
-    FSMRef f1,f2;
+    CompactFSMRef f1,f2;
     Passes.add(new NotificationPass("Start to generate FSM for two programs ... ""Done!"));
     
     {
         TimeRecorder FSM1Timer("Generate FSM1");
         errs()<<"start to construct the first FSM\n";
-        f1 = FSM::getFSM(BNF1);
-        errs()<<"Node num before simplify: "<<f1->allNodes.size()<<"\n";
+        FSMRef Machine = FSM::getFSM(BNF1);
+        errs()<<"Node num before simplify: "<<Machine->allNodes.size()<<"\n";
         int edgenum =0;
-        for(auto n: f1->allNodes){
+        for(auto n: Machine->allNodes){
             edgenum += n->transition.size();
         }
         errs()<<"Edge num before simplify: "<<edgenum<<"\n";
-        f1->simplify();     
-        errs()<<"\nFSM for the first version:\n"<<f1;
-        errs()<<"Node num after simplify: "<<f1->allNodes.size()<<"\n";
-        edgenum =0;
-        for(auto n: f1->allNodes){
-            edgenum += n->transition.size();
+        Machine->simplify();
+        // the diff and the output only traverse the simplified FSM, which is kept in the compact form
+        f1 = Machine->freeze();
+        errs()<<"Node num after simplify: "<<f1->numStates()<<"\n";
+        errs()<<"Edge num after simplify: "<<f1->numEdges()<<"\n";
+        if (MinimizeFSM) {
+            f1 = minimizeFSM(*f1);
+            errs()<<"Node num after minimize: "<<f1->numStates()<<"\n";
+            errs()<<"Edge num after minimize: "<<f1->numEdges()<<"\n";
         }
-        errs()<<"Edge num after simplify: "<<edgenum<<"\n";
+        errs()<<"\nFSM for the first version:\n"<<*f1;
+        errs()<<"Guard num in the FSM: "<<f1->numGuards()<<" ("<<f1->memoryUsage()<<" bytes in the compact form)\n";
     }
     {
         TimeRecorder FSM2Timer("Generate FSM2");
         errs()<<"start to construct the second FSM\n";
-        f2 = FSM::getFSM(BNF2);
-        errs()<<"Node num before simplify: "<<f2->allNodes.size()<<"\n";
+        FSMRef Machine = FSM::getFSM(BNF2);
+        errs()<<"Node num before simplify: "<<Machine->allNodes.size()<<"\n";
         int edgenum2 =0;
-        for(auto n: f2->allNodes){
+        for(auto n: Machine->allNodes){
             edgenum2 += n->transition.size();
         }
         errs()<<"Edge num before simplify: "<<edgenum2<<"\n";
-        f2->simplify();
-        errs()<<"\nFSM for the second version:\n"<<f2;
-        errs()<<"Node num after simplify: "<<f2->allNodes.size()<<"\n";
-        edgenum2 =0;
-        for(auto n: f2->allNodes){
-            edgenum2 += n->transition.size();
+        Machine->simplify();
+        f2 = Machine->freeze();
+        errs()<<"Node num after simplify: "<<f2->numStates()<<"\n";
+        errs()<<"Edge num after simplify: "<<f2->numEdges()<<"\n";
+        if (MinimizeFSM) {
+            f2 = minimizeFSM(*f2);
+            errs()<<"Node num after minimize: "<<f2->numStates()<<"\n";
+            errs()<<"Edge num after minimize: "<<f2->numEdges()<<"\n";
         }
-        errs()<<"Edge num after simplify: "<<edgenum2<<"\n";
+        errs()<<"\nFSM for the second version:\n"<<*f2;
+        errs()<<"Guard num in the FSM: "<<f2->numGuards()<<" ("<<f2->memoryUsage()<<" bytes in the compact form)\n";
     }
     Passes.add(new NotificationPass("Start to get-diff ... ""Done!"));
     
     {
         TimeRecorder diffTimer("FSM diff");
         errs()<<"start to bisimulation\n";
-        bisimulation(f1, f2);
+        if (DiffEngine == DEK_PartitionRefinement) {
+            partitionRefinement(*f1, *f2);
+        } else {
+            bisimulation(*f1, *f2);
+        }
     }
+    FunctionSummary::report();
+    Z3Solver::reportCache();
+
+    // the z3 session of this thread is destroyed before the global exprs
+    graphsForDiff.clear();
 
     if (Out) Out->keep();
 